@@ -0,0 +1,118 @@
+/*
+ * Copyright 2023 Roger Feese
+ *
+ * Measure how keyed reads scale with reader threads, compared with the same
+ * reads serialised by a mutex. A writer thread keeps updating values during
+ * each run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../src/configuration.h"
+
+#define NUM_KEYS 1000
+#define RUN_NS 500000000.0
+
+static pthread_mutex_t baseline_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic int running;
+static int use_mutex;
+
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *reader(void *arg){
+	unsigned long *ops = arg;
+	char key[32];
+	int ival;
+	unsigned long n = 0;
+	for(int k = 0; atomic_load_explicit(&running, memory_order_relaxed); k = (k + 7919) % NUM_KEYS){
+		snprintf(key, sizeof(key), "key%d", k);
+		if(use_mutex){
+			pthread_mutex_lock(&baseline_lock);
+			configuration_get_int_value(key, &ival);
+			pthread_mutex_unlock(&baseline_lock);
+		}
+		else{
+			configuration_get_int_value(key, &ival);
+		}
+		n++;
+	}
+	*ops = n;
+	return NULL;
+}
+
+static void *writer(void *arg){
+	char key[32];
+	for(int i = 0; atomic_load_explicit(&running, memory_order_relaxed); i++){
+		snprintf(key, sizeof(key), "key%d", i % NUM_KEYS);
+		if(use_mutex){
+			pthread_mutex_lock(&baseline_lock);
+			configuration_set_int_value(key, i);
+			pthread_mutex_unlock(&baseline_lock);
+		}
+		else{
+			configuration_set_int_value(key, i);
+		}
+		// a steady trickle of updates, not a write storm
+		struct timespec pause = { 0, 10000 };
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+// return reads per second with num_readers threads
+static double run(int num_readers){
+	pthread_t threads[num_readers];
+	unsigned long ops[num_readers];
+	pthread_t writer_thread;
+
+	atomic_store(&running, 1);
+	pthread_create(&writer_thread, NULL, writer, NULL);
+	for(int i = 0; i < num_readers; i++){
+		pthread_create(&threads[i], NULL, reader, &ops[i]);
+	}
+	double start = now_ns();
+	struct timespec duration = { 0, (long)RUN_NS };
+	nanosleep(&duration, NULL);
+	atomic_store(&running, 0);
+
+	unsigned long total = 0;
+	for(int i = 0; i < num_readers; i++){
+		pthread_join(threads[i], NULL);
+		total += ops[i];
+	}
+	double elapsed = now_ns() - start;
+	pthread_join(writer_thread, NULL);
+	return total / (elapsed / 1e9);
+}
+
+int main(int argc, char *argv[]){
+	int max_threads = 8;
+	if(argc > 1){
+		max_threads = atoi(argv[1]);
+	}
+
+	char key[32];
+	for(int i = 0; i < NUM_KEYS; i++){
+		snprintf(key, sizeof(key), "key%d", i);
+		configuration_set_int_value(key, i);
+	}
+
+	printf("%8s %16s %16s %8s\n", "threads", "lock-free get/s", "mutex get/s", "speedup");
+	for(int num_readers = 1; num_readers <= max_threads; num_readers *= 2){
+		use_mutex = 0;
+		double lock_free = run(num_readers);
+		use_mutex = 1;
+		double mutex = run(num_readers);
+		printf("%8d %16.0f %16.0f %8.2f\n", num_readers, lock_free, mutex, lock_free / mutex);
+	}
+
+	configuration_reset();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2023 Roger Feese
+ *
+ * Measure how index mappings affect configuration_load, loading a file whose
+ * lines mostly hold keys that are not mapped with no mappings and with
+ * NUM_MAPPINGS of them. Each new key is looked up among the mappings.
+ * Usage: bench_load [num_lines [dir]].
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/configuration.c"
+
+#define NUM_MAPPINGS 128
+#define NUM_LOADS 50
+
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// return average ns per load, a configuration only loads once
+static double run(int num_mappings, t_configuration_index_mapping *mappings){
+	double elapsed = 0;
+	for(int i = 0; i < NUM_LOADS; i++){
+		configuration_reset();
+		configuration_init("bench", "bench.ini");
+		if(num_mappings){
+			configuration_init_indexes(mappings, num_mappings);
+		}
+		double start = now_ns();
+		if(!configuration_load()){
+			printf("load failed: %s\n", configuration_get_error());
+			exit(EXIT_FAILURE);
+		}
+		elapsed += now_ns() - start;
+	}
+	return elapsed / NUM_LOADS;
+}
+
+int main(int argc, char *argv[]){
+	int num_lines = 10000;
+	const char *basedir = "/tmp";
+	if(argc > 1){
+		num_lines = atoi(argv[1]);
+	}
+	if(argc > 2){
+		basedir = argv[2];
+	}
+
+	char tmpdir[300];
+	snprintf(tmpdir, sizeof(tmpdir), "%s/bench_configurationXXXXXX", basedir);
+	if(!mkdtemp(tmpdir)){
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	setenv("XDG_CONFIG_HOME", tmpdir, 1);
+	char configdir[320];
+	char path[340];
+	snprintf(configdir, sizeof(configdir), "%s/bench", tmpdir);
+	mkdir(configdir, 0755);
+	snprintf(path, sizeof(path), "%s/bench.ini", configdir);
+
+	// mapped keys share a prefix with the other keys, as they tend to
+	t_configuration_index_mapping mappings[NUM_MAPPINGS];
+	for(int i = 0; i < NUM_MAPPINGS; i++){
+		snprintf(mappings[i].key, sizeof(mappings[i].key), "setting.mapped%d", i);
+		mappings[i].index = i;
+		mappings[i].val_type = CONFIGURATION_VAL_INT;
+		snprintf(mappings[i].default_value, sizeof(mappings[i].default_value), "%d", i);
+	}
+	FILE *f = fopen(path, "w");
+	if(!f){
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	for(int i = 0; i < num_lines; i++){
+		if(i < NUM_MAPPINGS){
+			fprintf(f, "setting.mapped%d %d\n", i, i);
+		}
+		else{
+			fprintf(f, "setting.other%d %d\n", i, i);
+		}
+	}
+	fclose(f);
+
+	double unmapped = run(0, mappings);
+	double mapped = run(NUM_MAPPINGS, mappings);
+	printf("%10s %10s %14s %14s %14s\n", "lines", "mappings", "load us", "ns/line", "vs unmapped");
+	printf("%10d %10d %14.1f %14.1f %14.2f\n", num_lines, 0, unmapped / 1e3, unmapped / num_lines, 1.0);
+	printf("%10d %10d %14.1f %14.1f %14.2f\n", num_lines, NUM_MAPPINGS, mapped / 1e3, mapped / num_lines, mapped / unmapped);
+
+	configuration_reset();
+	unlink(path);
+	rmdir(configdir);
+	rmdir(tmpdir);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2023 Roger Feese
+ *
+ * Measure value classification and number conversion throughput of the
+ * loader's parser against the sscanf and strtol/strtof approaches it replaced.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/configuration.c"
+
+#define NUM_VALUES 1000000
+
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// classify the way the loader did with sscanf
+static t_conf_val_type parse_sscanf(const char *str, size_t len, t_config_value *value){
+	int int_value;
+	float float_value;
+	int charsmatching = 0;
+	if(len && sscanf(str, "%d%n", &int_value, &charsmatching) == 1 && charsmatching == len){
+		*value = _value_from_int(int_value);
+		return CONFIGURATION_VAL_INT;
+	}
+	if(len && sscanf(str, "%f%n", &float_value, &charsmatching) == 1 && charsmatching == len){
+		*value = _value_from_float(float_value);
+		return CONFIGURATION_VAL_FLOAT;
+	}
+	return CONFIGURATION_VAL_STR;
+}
+
+// classify with strtol and strtof
+static t_conf_val_type parse_strto(const char *str, size_t len, t_config_value *value){
+	char *end;
+	long int_value = len ? strtol(str, &end, 10) : 0;
+	if(len && end == str + len && int_value >= INT_MIN && int_value <= INT_MAX){
+		*value = _value_from_int((int)int_value);
+		return CONFIGURATION_VAL_INT;
+	}
+	float float_value = len ? strtof(str, &end) : 0.0f;
+	if(len && end == str + len){
+		*value = _value_from_float(float_value);
+		return CONFIGURATION_VAL_FLOAT;
+	}
+	return CONFIGURATION_VAL_STR;
+}
+
+static void run(const char *name, t_conf_val_type (*parse)(const char *, size_t, t_config_value *), char **values, size_t *lens, size_t bytes){
+	int counts[3] = { 0 };
+	t_config_value value;
+	double start = now_ns();
+	for(int i = 0; i < NUM_VALUES; i++){
+		counts[parse(values[i], lens[i], &value)]++;
+	}
+	double elapsed = now_ns() - start;
+	printf("%-12s %10.1f %10.1f %8d %8d %8d\n", name, elapsed / NUM_VALUES, bytes / (elapsed / 1e9) / 1e6,
+		counts[CONFIGURATION_VAL_INT], counts[CONFIGURATION_VAL_FLOAT], counts[CONFIGURATION_VAL_STR]);
+}
+
+int main(){
+	char **values = malloc(NUM_VALUES * sizeof(char *));
+	size_t *lens = malloc(NUM_VALUES * sizeof(size_t));
+	size_t bytes = 0;
+	char buf[64];
+	srand(1);
+	for(int i = 0; i < NUM_VALUES; i++){
+		switch(i % 4){
+			case 0: snprintf(buf, sizeof(buf), "%d", rand() - RAND_MAX / 2); break;
+			case 1: snprintf(buf, sizeof(buf), "%d.%04d", rand() % 10000, rand() % 10000); break;
+			case 2: snprintf(buf, sizeof(buf), "str%d", rand()); break;
+			case 3: snprintf(buf, sizeof(buf), "%d", rand() % 100); break;
+		}
+		values[i] = strdup(buf);
+		lens[i] = strlen(buf);
+		bytes += lens[i];
+	}
+
+	printf("%-12s %10s %10s %8s %8s %8s\n", "parser", "ns/value", "MB/s", "int", "float", "str");
+	run("sscanf", parse_sscanf, values, lens, bytes);
+	run("strtol/f", parse_strto, values, lens, bytes);
+	run("single-pass", _value_parse, values, lens, bytes);
+
+	for(int i = 0; i < NUM_VALUES; i++){
+		free(values[i]);
+	}
+	free(values);
+	free(lens);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2023 Roger Feese
+ *
+ * Measure the cost of a crash-safe save (temp file, fsync, rename and
+ * directory fsync) against writing the same lines in place, of a save with
+ * nothing to write, and of persisting a set through the journal instead,
+ * alone or as part of a transaction.
+ * Sync costs depend on the filesystem, so the directory to save in can be
+ * given: bench_save [max_keys [dir]].
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/configuration.h"
+
+#define NUM_SAVES 20
+#define NUM_UNCHANGED 100000
+// stays below the journal compaction size
+#define NUM_JOURNALED 1000
+
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// write the lines a save of num_keys keys writes, the way save used to
+static void write_in_place(const char *path, int num_keys){
+	FILE *f = fopen(path, "w");
+	if(!f){
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	for(int i = 0; i < num_keys; i++){
+		fprintf(f, "key%d %d\n", i, i);
+	}
+	fclose(f);
+}
+
+int main(int argc, char *argv[]){
+	int max_keys = 100000;
+	const char *basedir = "/tmp";
+	if(argc > 1){
+		max_keys = atoi(argv[1]);
+	}
+	if(argc > 2){
+		basedir = argv[2];
+	}
+
+	char tmpdir[300];
+	snprintf(tmpdir, sizeof(tmpdir), "%s/bench_configurationXXXXXX", basedir);
+	if(!mkdtemp(tmpdir)){
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	setenv("XDG_CONFIG_HOME", tmpdir, 1);
+
+	char configdir[320];
+	char path[340];
+	char inplace[340];
+	char journal[350];
+	snprintf(configdir, sizeof(configdir), "%s/bench", tmpdir);
+	mkdir(configdir, 0755);
+	snprintf(path, sizeof(path), "%s/bench.ini", configdir);
+	snprintf(inplace, sizeof(inplace), "%s/inplace.ini", configdir);
+	snprintf(journal, sizeof(journal), "%s.journal", path);
+
+	printf("%10s %14s %14s %14s %14s %14s\n", "keys", "in-place us", "save us", "unchanged ns", "journal ns", "journal txn ns");
+	for(int num_keys = 10; num_keys <= max_keys; num_keys *= 10){
+		char key[32];
+		configuration_reset();
+		configuration_init("bench", "bench.ini");
+		for(int i = 0; i < num_keys; i++){
+			snprintf(key, sizeof(key), "key%d", i);
+			configuration_set_int_value(key, i);
+		}
+
+		double start = now_ns();
+		for(int i = 0; i < NUM_SAVES; i++){
+			write_in_place(inplace, num_keys);
+		}
+		double inplace_us = (now_ns() - start) / NUM_SAVES / 1e3;
+
+		// one changed value makes every save write the whole file
+		start = now_ns();
+		for(int i = 0; i < NUM_SAVES; i++){
+			configuration_set_int_value("key0", i);
+			if(!configuration_save()){
+				printf("save failed: %s\n", configuration_get_error());
+				return EXIT_FAILURE;
+			}
+		}
+		double save_us = (now_ns() - start) / NUM_SAVES / 1e3;
+
+		start = now_ns();
+		for(int i = 0; i < NUM_UNCHANGED; i++){
+			configuration_save();
+		}
+		double unchanged_ns = (now_ns() - start) / NUM_UNCHANGED;
+
+		// each set appends one record instead of a save rewriting every key
+		configuration_use_journal(1);
+		start = now_ns();
+		for(int i = 0; i < NUM_JOURNALED; i++){
+			configuration_set_int_value("key0", i);
+		}
+		double journal_ns = (now_ns() - start) / NUM_JOURNALED;
+
+		// a transaction journals all of its sets with one write
+		start = now_ns();
+		configuration_begin();
+		for(int i = 0; i < NUM_JOURNALED; i++){
+			snprintf(key, sizeof(key), "key%d", i % num_keys);
+			configuration_set_int_value(key, i);
+		}
+		configuration_commit();
+		double txn_ns = (now_ns() - start) / NUM_JOURNALED;
+		configuration_save();
+		configuration_use_journal(0);
+
+		printf("%10d %14.1f %14.1f %14.1f %14.1f %14.1f\n", num_keys, inplace_us, save_us, unchanged_ns, journal_ns, txn_ns);
+	}
+
+	configuration_reset();
+	unlink(path);
+	unlink(inplace);
+	unlink(journal);
+	rmdir(configdir);
+	rmdir(tmpdir);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2023 Roger Feese
+ *
+ * Measure how load, get and set scale with the number of configuration keys,
+ * and what a handle saves over reading one key by name in a loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/configuration.h"
+
+#define NUM_HOT_GETS 1000000
+
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void write_config(const char *path, int num_keys){
+	FILE *f = fopen(path, "w");
+	if(!f){
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	for(int i = 0; i < num_keys; i++){
+		switch(i % 3){
+			case 0: fprintf(f, "key%d %d\n", i, i); break;
+			case 1: fprintf(f, "key%d %d.5\n", i, i); break;
+			case 2: fprintf(f, "key%d str%d\n", i, i); break;
+		}
+	}
+	fclose(f);
+}
+
+int main(int argc, char *argv[]){
+	int max_keys = 1000000;
+	if(argc > 1){
+		max_keys = atoi(argv[1]);
+	}
+
+	char tmpdir[] = "/tmp/bench_configurationXXXXXX";
+	if(!mkdtemp(tmpdir)){
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	setenv("XDG_CONFIG_HOME", tmpdir, 1);
+
+	char configdir[300];
+	char path[320];
+	snprintf(configdir, sizeof(configdir), "%s/bench", tmpdir);
+	mkdir(configdir, 0755);
+	snprintf(path, sizeof(path), "%s/bench.ini", configdir);
+
+	char snapshot[330];
+	snprintf(snapshot, sizeof(snapshot), "%s.cache", path);
+
+	printf("%10s %12s %12s %12s %12s %12s %12s %12s %12s\n", "keys", "load ns/key", "snap ns/key", "get ns/op", "hot ns/op", "handle ns/op", "set ns/op", "txn ns/op", "add ns/op");
+	for(int num_keys = 10; num_keys <= max_keys; num_keys *= 10){
+		char key[32];
+		int ival;
+		write_config(path, num_keys);
+
+		configuration_reset();
+		configuration_init("bench", "bench.ini");
+		double start = now_ns();
+		if(!configuration_load()){
+			printf("load failed: %s\n", configuration_get_error());
+			return EXIT_FAILURE;
+		}
+		double load_ns = (now_ns() - start) / num_keys;
+
+		// load from a snapshot written by the previous load
+		configuration_reset();
+		configuration_use_snapshot(1);
+		configuration_load();
+		configuration_reset();
+		start = now_ns();
+		configuration_load();
+		double snapshot_ns = (now_ns() - start) / num_keys;
+		configuration_use_snapshot(0);
+		unlink(snapshot);
+
+		// stride through keys so consecutive lookups do not share cache lines
+		start = now_ns();
+		for(int i = 0, k = 0; i < num_keys; i++, k = (k + 7919) % num_keys){
+			snprintf(key, sizeof(key), "key%d", k - k % 3);
+			configuration_get_int_value(key, &ival);
+		}
+		double get_ns = (now_ns() - start) / num_keys;
+
+		// one key read over and over, by name and through a handle
+		snprintf(key, sizeof(key), "key%d", num_keys / 2 - num_keys / 2 % 3);
+		start = now_ns();
+		for(int i = 0; i < NUM_HOT_GETS; i++){
+			configuration_get_int_value(key, &ival);
+		}
+		double hot_ns = (now_ns() - start) / NUM_HOT_GETS;
+		configuration_handle_t *handle = configuration_lookup(key);
+		start = now_ns();
+		for(int i = 0; i < NUM_HOT_GETS; i++){
+			configuration_get_int_by_handle(handle, &ival);
+		}
+		double handle_ns = (now_ns() - start) / NUM_HOT_GETS;
+		configuration_handle_free(handle);
+
+		start = now_ns();
+		for(int i = 0, k = 0; i < num_keys; i++, k = (k + 7919) % num_keys){
+			snprintf(key, sizeof(key), "key%d", k);
+			configuration_set_int_value(key, i);
+		}
+		double set_ns = (now_ns() - start) / num_keys;
+
+		// the same sets applied as one transaction
+		start = now_ns();
+		configuration_begin();
+		for(int i = 0, k = 0; i < num_keys; i++, k = (k + 7919) % num_keys){
+			snprintf(key, sizeof(key), "key%d", k);
+			configuration_set_int_value(key, i);
+		}
+		configuration_commit();
+		double txn_ns = (now_ns() - start) / num_keys;
+
+		// sets of new keys, growing storage from empty
+		configuration_reset();
+		start = now_ns();
+		for(int i = 0; i < num_keys; i++){
+			snprintf(key, sizeof(key), "new%d", i);
+			configuration_set_int_value(key, i);
+		}
+		double add_ns = (now_ns() - start) / num_keys;
+
+		printf("%10d %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f\n", num_keys, load_ns, snapshot_ns, get_ns, hot_ns, handle_ns, set_ns, txn_ns, add_ns);
+	}
+
+	configuration_reset();
+	unlink(path);
+	rmdir(configdir);
+	rmdir(tmpdir);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2023 Roger Feese
+ *
+ * Measure the throughput of the loader's line tokenizer and of
+ * configuration_stream with the scalar delimiter scan against the vector scan
+ * picked for this CPU, on generated files from 1 KB up to max_bytes.
+ * Usage: bench_scan [max_bytes [dir]], max_bytes defaults to 64 MB.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/configuration.c"
+
+// bytes to tokenize per measurement, small files are tokenized repeatedly
+#define MIN_WORK (64 << 20)
+
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// lines like those of generated tables, keys of 12 to 60 bytes
+static size_t make_text(char *text, size_t size){
+	size_t used = 0;
+	for(int i = 0; ; i++){
+		char line[128];
+		int len;
+		switch(i % 3){
+			case 0:
+				len = snprintf(line, sizeof(line), "table.row%d %d\n", i, i);
+				break;
+			case 1:
+				len = snprintf(line, sizeof(line), "generated.table.section%d.column.setting.name %d.5\n", i % 1000, i);
+				break;
+			default:
+				len = snprintf(line, sizeof(line), "generated.table.row%d.description value of row %d\n", i, i);
+				break;
+		}
+		if(used + len > size){
+			break;
+		}
+		memcpy(text + used, line, len);
+		used += len;
+	}
+	return used;
+}
+
+// return bytes per second of splitting every line of text
+static double tokenize(const char *text, size_t size){
+	size_t num_runs = MIN_WORK / size + 1;
+	size_t checksum = 0;
+	double start = now_ns();
+	for(size_t run = 0; run < num_runs; run++){
+		const char *end = text + size;
+		const char *next;
+		for(const char *p = text; p < end; p = next){
+			const char *eol = memchr(p, '\n', end - p);
+			if(!eol){
+				eol = end;
+			}
+			next = eol + 1;
+			t_config_line tokens;
+			if(_line_split(p, eol, &tokens) == CONFIGURATION_LINE_ENTRY){
+				checksum += tokens.key_len;
+			}
+		}
+	}
+	double elapsed = now_ns() - start;
+	if(!checksum){
+		printf("no entries tokenized\n");
+	}
+	return size * num_runs / elapsed * 1e9;
+}
+
+static int count_entry(configuration_t *cfg, const char *key, const t_configuration_value *value, void *ctx){
+	(*(size_t *)ctx)++;
+	return 1;
+}
+
+// return bytes per second of streaming the file at path, which is cached after the first run
+static double stream(const char *path, size_t size){
+	size_t num_runs = MIN_WORK / size + 1;
+	size_t num_entries = 0;
+	configuration_stream(path, count_entry, &num_entries);
+	double start = now_ns();
+	for(size_t run = 0; run < num_runs; run++){
+		if(configuration_stream(path, count_entry, &num_entries) < 0){
+			printf("stream failed: %s\n", configuration_get_error());
+			exit(EXIT_FAILURE);
+		}
+	}
+	return size * num_runs / (now_ns() - start) * 1e9;
+}
+
+static const char *scan_name(){
+#ifdef CONFIGURATION_SCAN_X86
+	if(configuration_scan_delim == _scan_delim_avx2){
+		return "avx2";
+	}
+	if(configuration_scan_delim == _scan_delim_sse2){
+		return "sse2";
+	}
+#endif
+	return "scalar";
+}
+
+int main(int argc, char *argv[]){
+	size_t max_bytes = 64 << 20;
+	const char *basedir = "/tmp";
+	if(argc > 1){
+		max_bytes = strtoull(argv[1], NULL, 10);
+	}
+	if(argc > 2){
+		basedir = argv[2];
+	}
+	char path[300];
+	snprintf(path, sizeof(path), "%s/bench_scanXXXXXX", basedir);
+	int fd = mkstemp(path);
+	if(fd < 0){
+		perror("mkstemp");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	pthread_once(&configuration_scan_once, _scan_init);
+	const char *(*vector_scan)(const char *, const char *) = configuration_scan_delim;
+	char *text = malloc(max_bytes);
+	if(!text){
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	printf("%12s %8s %16s %16s %16s %16s\n", "bytes", "scan", "tokenize MB/s", "scalar MB/s", "stream MB/s", "scalar MB/s");
+	for(size_t size = 1024; size <= max_bytes; size *= 4){
+		size_t used = make_text(text, size);
+		FILE *f = fopen(path, "w");
+		if(!f || fwrite(text, 1, used, f) != used){
+			perror(path);
+			return EXIT_FAILURE;
+		}
+		fclose(f);
+
+		configuration_scan_delim = vector_scan;
+		double vector_tokenize = tokenize(text, used);
+		double vector_stream = stream(path, used);
+		configuration_scan_delim = _scan_delim_scalar;
+		double scalar_tokenize = tokenize(text, used);
+		double scalar_stream = stream(path, used);
+		configuration_scan_delim = vector_scan;
+		printf("%12zu %8s %16.1f %16.1f %16.1f %16.1f\n", used, scan_name(),
+				vector_tokenize / 1e6, scalar_tokenize / 1e6, vector_stream / 1e6, scalar_stream / 1e6);
+	}
+
+	free(text);
+	unlink(path);
+	return EXIT_SUCCESS;
+}
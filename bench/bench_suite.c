@@ -0,0 +1,247 @@
+/*
+ * Copyright 2023 Roger Feese
+ *
+ * Benchmark suite for tracking performance across versions. Synthetic
+ * configs of several sizes, key lengths and value type mixes are loaded,
+ * saved, read by key (present and missing), set by key and read and set by
+ * index. Each operation is timed in batches of BATCH_OPS, and the mean and
+ * percentiles of the per-operation time over all batches are reported.
+ *
+ * Output is tab separated with a header row, one row per measurement:
+ *   op keys key_len mix runs ns_per_op p50 p90 p99 max
+ * Lines starting with # are comments.
+ * Usage: bench_suite [max_keys [dir]].
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/configuration.h"
+
+#define BATCH_OPS 64
+#define MIN_OPS 200000
+#define MIN_FILE_RUNS 5
+#define FILE_BUDGET_NS 500000000.0
+
+typedef enum { MIX_INT, MIX_STR, MIX_MIXED } t_mix;
+static const char *mix_names[] = { "int", "str", "mixed" };
+
+static char configdir[320];
+static char path[340];
+
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b){
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// print ns per op of each run, which are sorted in place
+static void report(const char *op, int num_keys, int key_len, t_mix mix, double *runs, int num_runs){
+	double total = 0;
+	for(int i = 0; i < num_runs; i++){
+		total += runs[i];
+	}
+	qsort(runs, num_runs, sizeof(double), compare_double);
+	printf("%s\t%d\t%d\t%s\t%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", op, num_keys, key_len, mix_names[mix], num_runs,
+		total / num_runs, runs[num_runs / 2], runs[num_runs * 9 / 10], runs[num_runs * 99 / 100], runs[num_runs - 1]);
+	fflush(stdout);
+}
+
+// key i of key_len characters, random letters ending in i, the same for every run
+static void make_key(char *key, int key_len, int i){
+	unsigned int seed = i * 2654435761u;
+	int len = key_len - 6;
+	for(int c = 0; c < len; c++){
+		seed = seed * 1103515245u + 12345u;
+		key[c] = 'a' + (seed >> 16) % 26;
+	}
+	for(int c = key_len - 1; c >= len; c--){
+		key[c] = '0' + i % 10;
+		i /= 10;
+	}
+	key[key_len] = '\0';
+}
+
+static void write_config(int num_keys, int key_len, t_mix mix){
+	FILE *f = fopen(path, "w");
+	if(!f){
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	char key[64];
+	for(int i = 0; i < num_keys; i++){
+		make_key(key, key_len, i);
+		int type = mix == MIX_MIXED ? i % 3 : (mix == MIX_INT ? 0 : 2);
+		switch(type){
+			case 0: fprintf(f, "%s %d\n", key, i); break;
+			case 1: fprintf(f, "%s %d.25\n", key, i); break;
+			case 2: fprintf(f, "%s value%d\n", key, i); break;
+		}
+	}
+	fclose(f);
+}
+
+static void load(){
+	configuration_reset();
+	configuration_init("bench", "bench.ini");
+	if(!configuration_load()){
+		printf("# load failed: %s\n", configuration_get_error());
+		exit(EXIT_FAILURE);
+	}
+}
+
+// time whole file operations, enough runs for stable percentiles within the budget
+static int file_runs(double first_ns){
+	int num_runs = FILE_BUDGET_NS / (first_ns > 1 ? first_ns : 1);
+	return num_runs < MIN_FILE_RUNS ? MIN_FILE_RUNS : (num_runs > 1000 ? 1000 : num_runs);
+}
+
+static void bench_config(int num_keys, int key_len, t_mix mix){
+	write_config(num_keys, key_len, mix);
+
+	// load, reported per key
+	double start = now_ns();
+	load();
+	int num_runs = file_runs(now_ns() - start);
+	double *runs = malloc((num_runs > MIN_OPS / BATCH_OPS ? num_runs : MIN_OPS / BATCH_OPS) * sizeof(double));
+	for(int r = 0; r < num_runs; r++){
+		configuration_reset();
+		configuration_init("bench", "bench.ini");
+		start = now_ns();
+		configuration_load();
+		runs[r] = (now_ns() - start) / num_keys;
+	}
+	report("load_per_key", num_keys, key_len, mix, runs, num_runs);
+
+	// a changed value makes every save write the file
+	load();
+	start = now_ns();
+	configuration_set_int_value("bench_counter", 0);
+	configuration_save();
+	num_runs = file_runs(now_ns() - start);
+	for(int r = 0; r < num_runs; r++){
+		configuration_set_int_value("bench_counter", r + 1);
+		start = now_ns();
+		configuration_save();
+		runs[r] = now_ns() - start;
+	}
+	report("save", num_keys, key_len, mix, runs, num_runs);
+
+	// keys are visited in a fixed scattered order so lookups do not share cache lines
+	char (*keys)[64] = malloc(BATCH_OPS * sizeof(*keys));
+	char (*missing)[64] = malloc(BATCH_OPS * sizeof(*missing));
+	int batches = MIN_OPS / BATCH_OPS;
+	int ival;
+	float fval;
+	char sval[64];
+	int k = 0;
+	for(int b = 0; b < batches; b++){
+		for(int i = 0; i < BATCH_OPS; i++, k = (k + 7919) % num_keys){
+			make_key(keys[i], key_len, k);
+		}
+		start = now_ns();
+		for(int i = 0; i < BATCH_OPS; i++){
+			switch(mix == MIX_MIXED ? (b * BATCH_OPS + i) % 3 : (mix == MIX_INT ? 0 : 2)){
+				case 0: configuration_get_int_value(keys[i], &ival); break;
+				case 1: configuration_get_float_value(keys[i], &fval); break;
+				case 2: configuration_get_str_value(keys[i], sval, sizeof(sval)); break;
+			}
+		}
+		runs[b] = (now_ns() - start) / BATCH_OPS;
+	}
+	report("get_hit", num_keys, key_len, mix, runs, batches);
+
+	for(int b = 0; b < batches; b++){
+		for(int i = 0; i < BATCH_OPS; i++, k = (k + 7919) % num_keys){
+			make_key(missing[i], key_len, k);
+			missing[i][0] = 'A';
+		}
+		start = now_ns();
+		for(int i = 0; i < BATCH_OPS; i++){
+			configuration_get_int_value(missing[i], &ival);
+		}
+		runs[b] = (now_ns() - start) / BATCH_OPS;
+	}
+	report("get_miss", num_keys, key_len, mix, runs, batches);
+
+	for(int b = 0; b < batches; b++){
+		for(int i = 0; i < BATCH_OPS; i++, k = (k + 7919) % num_keys){
+			make_key(keys[i], key_len, k);
+		}
+		start = now_ns();
+		for(int i = 0; i < BATCH_OPS; i++){
+			configuration_set_int_value(keys[i], b);
+		}
+		runs[b] = (now_ns() - start) / BATCH_OPS;
+	}
+	report("set", num_keys, key_len, mix, runs, batches);
+
+	for(int b = 0; b < batches; b++){
+		start = now_ns();
+		for(int i = 0; i < BATCH_OPS; i++, k = (k + 7919) % num_keys){
+			configuration_get_by_index_int_value(k, &ival);
+		}
+		runs[b] = (now_ns() - start) / BATCH_OPS;
+	}
+	report("get_index", num_keys, key_len, mix, runs, batches);
+
+	for(int b = 0; b < batches; b++){
+		start = now_ns();
+		for(int i = 0; i < BATCH_OPS; i++, k = (k + 7919) % num_keys){
+			configuration_set_by_index_int_value(k, b);
+		}
+		runs[b] = (now_ns() - start) / BATCH_OPS;
+	}
+	report("set_index", num_keys, key_len, mix, runs, batches);
+
+	free(keys);
+	free(missing);
+	free(runs);
+}
+
+int main(int argc, char *argv[]){
+	int max_keys = 100000;
+	const char *basedir = "/tmp";
+	if(argc > 1){
+		max_keys = atoi(argv[1]);
+	}
+	if(argc > 2){
+		basedir = argv[2];
+	}
+
+	char tmpdir[300];
+	snprintf(tmpdir, sizeof(tmpdir), "%s/bench_configurationXXXXXX", basedir);
+	if(!mkdtemp(tmpdir)){
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	setenv("XDG_CONFIG_HOME", tmpdir, 1);
+	snprintf(configdir, sizeof(configdir), "%s/bench", tmpdir);
+	mkdir(configdir, 0755);
+	snprintf(path, sizeof(path), "%s/bench.ini", configdir);
+
+	printf("# ns per operation over batches of %d operations, load per key, save per file\n", BATCH_OPS);
+	printf("op\tkeys\tkey_len\tmix\truns\tns_per_op\tp50\tp90\tp99\tmax\n");
+	int key_lens[] = { 8, 32 };
+	for(int num_keys = 100; num_keys <= max_keys; num_keys *= 10){
+		for(int l = 0; l < 2; l++){
+			for(t_mix mix = MIX_INT; mix <= MIX_MIXED; mix++){
+				bench_config(num_keys, key_lens[l], mix);
+			}
+		}
+	}
+
+	configuration_reset();
+	unlink(path);
+	rmdir(configdir);
+	rmdir(tmpdir);
+	return EXIT_SUCCESS;
+}
@@ -2,20 +2,47 @@
  * Copyright 2023 Roger Feese
  */
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <locale.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 #include "configuration.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#include <immintrin.h>
+#define CONFIGURATION_SCAN_X86
+#endif
 #ifdef WIN32
 #include <direct.h> /* for _mkdir */
+#define environ _environ
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+extern char **environ;
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
 #endif
 
-/* TODO: make config items array automatically expandable */
-#define CONFIGURATION_ITEMS_MAX 128
-
-typedef enum config_val_type { CONFIGURATION_VAL_INT, CONFIGURATION_VAL_FLOAT, CONFIGURATION_VAL_STR } t_conf_val_type;
+// initial item capacity, doubled whenever it runs out
+#define CONFIGURATION_ITEMS_INITIAL 8
 
 #define CONFIGURATION_KEY_MAX	33
+// longest section.key read from a [section] of a config file
+#define CONFIGURATION_SECTION_KEY_MAX	256
+// bytes read at a time by configuration_stream(), the longest line it accepts
+#define CONFIGURATION_STREAM_CHUNK	65536
 #define CONFIGURATION_VAL_STR_LEN	33
 
 // Configuration item key to index mapping
@@ -26,595 +53,4963 @@ typedef struct configuration_index_mapping {
 	char default_value[CONFIGURATION_VAL_STR_LEN];
 } t_configuration_index_mapping;
 
+/*
+ * Item values are packed into a single word so readers always see a type
+ * together with its value. The low two bits hold the type, int and float
+ * bits are kept in the upper 32 bits and string values are a pointer to an
+ * 8 byte aligned string. The third bit marks strings set at runtime, which
+ * are freed when replaced, see t_config_str.
+ */
+typedef uint64_t t_config_value;
+
+#define CONFIGURATION_VAL_TYPE_MASK	3u
+#define CONFIGURATION_VAL_OWNED	4u
+
+// keys and string values point into the configuration string arena
 typedef struct s_config_item {
-	char key[32];
-	t_conf_val_type val_type;
-	union {
-		int int_value;
-		float float_value;
-		char str_value[CONFIGURATION_VAL_STR_LEN];
-	} val;
+	const char *key; // NULL for unused items, never changes once published
+	_Atomic t_config_value val;
 } t_config_item;
 
+// Arena chunk, strings are bump allocated and never move or get freed individually
+typedef struct s_string_chunk {
+	struct s_string_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+} t_string_chunk;
+
+#define CONFIGURATION_STRING_CHUNK_MIN 1024
+#define CONFIGURATION_STRING_CHUNK_MAX 65536
+#define CONFIGURATION_STRING_ALIGN 8
+
+/*
+ * String value set at runtime. Unlike the arena strings it is allocated on
+ * its own, so a string key that keeps being set does not grow memory. The
+ * published table owns it; once replaced it is retired and freed when no
+ * reader can still be using it, like a retired table.
+ */
+typedef struct s_config_str {
+	struct s_config_str *next; // retired strings waiting to be freed
+	unsigned long retired_epoch;
+	unsigned long stamp; // see _strs_stamp
+	_Alignas(CONFIGURATION_STRING_ALIGN) char str[];
+} t_config_str;
+
+// Retired strings left after freeing what can be freed, see _str_retire
+#define CONFIGURATION_RETIRED_STRS_MIN 64
+
+// Interned string table slot
+typedef struct s_string_slot {
+	unsigned int hash;
+	const char *str; // NULL = empty
+} t_string_slot;
+
+// Open-addressing hash index slot, item is the item index + 1 (0 = empty)
+typedef struct s_config_index_slot {
+	unsigned int hash;
+	_Atomic unsigned int item;
+} t_config_index_slot;
+
+/*
+ * Items of a table in key order for prefix queries, sorted by the first query
+ * of the table. Queries scan the items appended in place since, and merge
+ * them into a new order once there are more than CONFIGURATION_SORTED_TAIL.
+ */
+#define CONFIGURATION_SORTED_TAIL 32
+
+typedef struct s_config_sorted {
+	struct s_config_sorted *older; // replaced, freed once no reader can still use it
+	_Atomic unsigned long retired_epoch; // 0 until replaced
+	int num_items; // items of the table covered
+	int num_keys;
+	const t_config_item *items[]; // items with keys, sorted by key
+} t_config_sorted;
+
+/*
+ * Items and their index. Readers use the published table without locking.
+ * Writers fill in new items and index slots in place, publishing them with
+ * release stores, and replace the whole table when it has to grow or be
+ * reloaded. Replaced tables are freed once no reader can still be using them.
+ */
+typedef struct s_config_table {
+	_Atomic int num_items;
+	int items_size; // allocated items
+	t_config_item *items;
+	unsigned int index_size; // power of two, at least twice items_size
+	t_config_index_slot *index;
+	// changes whenever keys may have moved to other items, see t_configuration_handle
+	unsigned int generation;
+	_Atomic(t_config_sorted *) sorted; // NULL until the first prefix query
+	// retired tables waiting to be freed
+	struct s_config_table *retired_next;
+	unsigned long retired_epoch;
+} t_config_table;
+
+/*
+ * Binary snapshot of a loaded table, kept next to the config file so later
+ * loads can skip parsing. The file is in host byte order and laid out as the
+ * header, items, index slots, intern table slots and then the string data.
+ */
+#define CONFIGURATION_SNAPSHOT_SUFFIX ".cache"
+#define CONFIGURATION_SNAPSHOT_MAGIC "CFGSNAP"
+#define CONFIGURATION_SNAPSHOT_VERSION 2
+
+typedef struct s_snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	// the text file the snapshot was made from
+	uint64_t text_size;
+	int64_t text_mtime_sec;
+	int64_t text_mtime_nsec;
+	uint64_t text_hash;
+	// mappings change where items are placed
+	uint64_t mappings_hash;
+	uint32_t num_items;
+	uint32_t items_size;
+	uint32_t index_size;
+	uint32_t num_strings;
+	uint32_t string_slots_size;
+	uint32_t reserved;
+	uint64_t strings_size;
+	uint64_t checksum; // of everything after the header
+} t_snapshot_header;
+
+typedef struct s_snapshot_item {
+	uint32_t key; // offset into the string data, UINT32_MAX for unused items
+	uint32_t type;
+	uint64_t value; // packed int or float value, or offset into the string data
+} t_snapshot_item;
+
+// intern table slot, in the same position as in the intern table
+typedef struct s_snapshot_string {
+	uint32_t hash;
+	uint32_t offset; // offset into the string data, UINT32_MAX for empty slots
+} t_snapshot_string;
+
+// mapped snapshot whose strings are used in place until reset
+typedef struct s_snapshot_map {
+	struct s_snapshot_map *next;
+	void *addr;
+	size_t size;
+} t_snapshot_map;
+
 #define CONFIGURATION_ERROR_MSG_LEN 128
 
+// longest config dirname and filename, with the terminating NUL
+#define CONFIGURATION_FILENAME_LEN 32
+// configdir relative to the working directory, on Windows or without HOME
+#define CONFIGURATION_CONFIGDIR_DEFAULT "config"
+
+// config filename with the longest suffix, see _config_name
+#define CONFIGURATION_NAME_MAX (CONFIGURATION_FILENAME_LEN + sizeof(CONFIGURATION_JOURNAL_OLD_SUFFIX ".tmp"))
+#ifdef WIN32
+// configdir and a name in it, see _config_path
+#define CONFIGURATION_PATH_MAX (_MAX_PATH + CONFIGURATION_NAME_MAX)
+#endif
+
+/*
+ * Most recent error of a thread. Only what is needed to describe it is kept,
+ * the message is formatted when asked for by configuration_ctx_get_error, so
+ * failing calls such as gets of optional keys stay cheap.
+ */
+typedef struct s_config_error {
+	const struct s_configuration *cfg; // configuration the error belongs to
+	t_configuration_error code;
+	const char *format; // of the message, taking the arguments below in order
+	int has_str; // format takes str
+	int has_number; // format takes number
+	int sys_errno; // of system errors
+	long long number;
+	char str[CONFIGURATION_ERROR_MSG_LEN];
+} t_config_error;
+
+static _Thread_local t_config_error _last_error;
+
+// quiet time after the last change to the config file before it is reloaded
+#define CONFIGURATION_WATCH_DEBOUNCE_MS 100
+
+/*
+ * Journal of sets, appended beside the config file as lines in the config
+ * file format and replayed on top of it by load. A save rotates the journal
+ * to the old name while it writes the config file, and removes it after.
+ */
+#define CONFIGURATION_JOURNAL_SUFFIX ".journal"
+#define CONFIGURATION_JOURNAL_OLD_SUFFIX ".journal.old"
+// journal size at which a set folds the journal into the config file
+#ifndef CONFIGURATION_JOURNAL_COMPACT_SIZE
+#define CONFIGURATION_JOURNAL_COMPACT_SIZE (64 * 1024)
+#endif
+
+// a set staged by a transaction, see configuration_ctx_begin
+typedef struct s_txn_set {
+	const char *key; // interned, NULL for unused items
+	int index; // -1 for keys that were not in the table when staged
+	unsigned int generation; // of the table index was found in
+	t_config_value value;
+} t_txn_set;
+
+/*
+ * Runtime metrics, only kept when built with CONFIGURATION_METRICS. Without
+ * it the macros below expand to nothing.
+ */
+#ifdef CONFIGURATION_METRICS
+typedef struct s_config_histogram {
+	_Atomic unsigned long count;
+	_Atomic unsigned long long total_ns;
+	_Atomic unsigned long buckets[CONFIGURATION_HISTOGRAM_BUCKETS];
+} t_config_histogram;
+
+typedef struct s_config_metrics {
+	_Atomic unsigned long gets;
+	_Atomic unsigned long get_misses;
+	_Atomic unsigned long sets;
+	_Atomic unsigned long loads;
+	_Atomic unsigned long load_failures;
+	_Atomic unsigned long saves;
+	_Atomic unsigned long saves_skipped;
+	_Atomic unsigned long save_failures;
+	_Atomic unsigned long parse_errors;
+	t_config_histogram load_ns;
+	t_config_histogram save_ns;
+	t_config_histogram fsync_ns;
+} t_config_metrics;
+
+#define CONFIGURATION_COUNT(cfg, counter) atomic_fetch_add_explicit(&(cfg)->metrics.counter, 1, memory_order_relaxed)
+#define CONFIGURATION_TIME_START(start) uint64_t start = _metrics_now()
+#define CONFIGURATION_TIME_END(cfg, histogram, start) _histogram_add(&(cfg)->metrics.histogram, _metrics_now() - (start))
+#else
+#define CONFIGURATION_COUNT(cfg, counter)
+#define CONFIGURATION_TIME_START(start)
+#define CONFIGURATION_TIME_END(cfg, histogram, start)
+#endif
+
+// subscriber to changes, see configuration_ctx_subscribe
+typedef struct s_subscription {
+	struct s_subscription *next;
+	int id;
+	_Atomic int active; // cleared by unsubscribe, freed by reset
+	config_changed_t *callback;
+	void *ctx;
+	char prefix[];
+} t_subscription;
+
+// item overridden by an environment variable, see configuration_ctx_use_env
+typedef struct s_env_override {
+	const char *key; // interned
+	t_config_value value; // from the environment
+	t_config_value shadow; // beneath the override, if has_shadow
+	int has_shadow;
+} t_env_override;
+
+// caller of configuration_ctx_save_async waiting for the save
+typedef struct s_save_request {
+	struct s_save_request *next;
+	config_saved_t *callback;
+	void *ctx;
+} t_save_request;
+
 typedef struct s_configuration {
 	// directory to contain configuration file(s)
-	char dirname[32];
+	char dirname[CONFIGURATION_FILENAME_LEN];
 	// name of configuration file
-	char filename[32];
-	char configdir[256];
+	char filename[CONFIGURATION_FILENAME_LEN];
+	char *configdir; // allocated by _configdir_init, kept until configuration_destroy()
 	int configdirok;
+	_Atomic int dir_fd; // configdir, -1 until first opened
 	int loaded;
-	int saved;
-	int num_items;
-	t_config_item items[CONFIGURATION_ITEMS_MAX];
-	t_configuration_index_mapping mappings[CONFIGURATION_ITEMS_MAX];
-	char error_msg[CONFIGURATION_ERROR_MSG_LEN];
+	// number of value changes, and the number the config file last matched
+	_Atomic unsigned long changes;
+	_Atomic unsigned long saved;
+	// serialises saves
+	pthread_mutex_t save_lock;
+	// background saves, see configuration_ctx_save_async
+	pthread_mutex_t save_async_lock;
+	pthread_cond_t save_wanted; // signalled when a save is requested or the thread should stop
+	pthread_cond_t save_done; // signalled after each background save
+	pthread_t save_thread;
+	int save_thread_running;
+	int save_thread_stop;
+	unsigned long save_requests; // number of requests so far
+	unsigned long save_requests_done; // number of requests covered by finished saves
+	int save_result; // of the last background save
+	t_save_request *save_waiting; // callbacks of requests not yet taken by the thread
+	_Atomic(t_config_table *) table;
+	t_config_table *retired;
+	t_config_str *retired_strs;
+	int num_retired_strs;
+	int reclaim_strs; // free retired strings when there are this many
+	unsigned long str_stamp; // last stamp of the strings of a published table
+	// serialises writers, readers never take it
+	pthread_mutex_t lock;
+	int num_mappings;
+	t_configuration_index_mapping *mappings;
+	// perfect hash of the mapping keys, NULL slots if keys share a hash
+	unsigned short *mapping_displacements;
+	unsigned int mapping_buckets;
+	unsigned int *mapping_slots;
+	const t_configuration_schema *schema; // see configuration_ctx_init_schema
+	unsigned int generations; // last table generation handed out
+	// interned keys and string values
+	t_string_chunk *strings;
+	unsigned int num_strings;
+	unsigned int string_slots_size; // power of two, at least twice num_strings
+	t_string_slot *string_slots;
+	// binary snapshots, see configuration_ctx_use_snapshot
+	int use_snapshot;
+	t_snapshot_map *snapshots;
+	// journal of sets, see configuration_ctx_use_journal
+	int use_journal;
+	int journal_fd; // -1 until the first append
+	size_t journal_size;
+	// sets staged by the thread in a transaction, see configuration_ctx_begin
+	int txn_active;
+	pthread_t txn_owner;
+	t_txn_set *txn_sets;
+	int txn_num_sets;
+	int txn_num_new; // staged sets of keys not in the table
+	int txn_sets_size;
+	// background reload of the config file, see configuration_ctx_watch
+	int watching;
+	int watch_fd;
+	int watch_wake[2]; // closing the write end stops the watch thread
+	// the config file as the last save wrote it, so the watch thread can skip it
+	struct stat written;
+	int has_written;
+	pthread_t watch_thread;
+	// layers below and above the config file, see configuration_ctx_use_system_config
+	int use_system_config;
+	char env_prefix[32]; // empty without environment overrides
+	t_config_table *layers_base; // unpublished defaults and system config files, NULL until loaded
+	t_env_override *env_overrides; // applied by the last load
+	int num_env_overrides;
+	// change notification, see configuration_ctx_subscribe
+	_Atomic(t_subscription *) subscriptions;
+	int last_subscription_id;
+	const char **changed_keys; // interned, waiting to be delivered
+	_Atomic int num_changed;
+	int changed_size;
+	_Atomic int notifying; // a thread is delivering changed keys
+#ifdef CONFIGURATION_METRICS
+	t_config_metrics metrics;
+#endif
+	config_log_t *log; // default writes to stderr
+	void *log_ctx;
 } t_configuration;
 
-t_configuration configuration = { .dirname = "configuration", .filename = "configuration.ini", .configdir = "config" };
+/*
+ * Resolved key. The item index is cached together with the generation of the
+ * table it was found in, packed in one word so threads sharing a handle
+ * always see a matching pair. The index stays valid while the published
+ * table has that generation.
+ */
+typedef struct s_configuration_handle {
+	t_configuration *cfg;
+	_Atomic uint64_t slot; // generation << 32 | item index
+	char key[];
+} t_configuration_handle;
+
+#define CONFIGURATION_DEFAULTS { .dirname = "configuration", .filename = "configuration.ini", .lock = PTHREAD_MUTEX_INITIALIZER, .save_lock = PTHREAD_MUTEX_INITIALIZER, .save_async_lock = PTHREAD_MUTEX_INITIALIZER, .save_wanted = PTHREAD_COND_INITIALIZER, .save_done = PTHREAD_COND_INITIALIZER, .save_result = 1, .dir_fd = -1, .journal_fd = -1 }
+
+// default configuration used by the configuration_* functions without a context
+t_configuration configuration = CONFIGURATION_DEFAULTS;
+
+/*
+ * Epoch based reclamation, shared by all contexts. A reading thread
+ * announces the global epoch while it uses a table. A table retired at
+ * epoch E is freed once every announced epoch is greater than E.
+ */
+typedef struct s_config_reader {
+	_Atomic unsigned long epoch; // 0 when not reading
+	_Atomic int in_use;
+	int depth; // nested reads, only used by the owning thread
+	struct s_config_reader *next;
+} t_config_reader;
+
+// aligned empty string for values that could not be interned
+static _Alignas(CONFIGURATION_STRING_ALIGN) const char configuration_empty_str[1] = "";
+
+// C locale for number conversions that have to use the C library
+static locale_t configuration_c_locale = (locale_t)0;
+static pthread_once_t configuration_c_locale_once = PTHREAD_ONCE_INIT;
+
+static _Atomic unsigned long configuration_epoch = 1;
+static _Atomic(t_config_reader *) configuration_readers = NULL;
+static _Thread_local t_config_reader *configuration_reader = NULL;
+static pthread_key_t configuration_reader_key;
+static pthread_once_t configuration_reader_once = PTHREAD_ONCE_INIT;
 
 //---------------------------------------------------------------------------
-void configuration_reset(){
-	for(int i = 0; i < CONFIGURATION_ITEMS_MAX; i++){
-		configuration.mappings[i].key[0] = '\0'; 
-		configuration.mappings[i].index = 0; 
-		configuration.items[i].key[0] = '\0'; 
-		configuration.items[i].val_type = CONFIGURATION_VAL_INT; 
-		configuration.items[i].val.int_value = 0; 
+static inline t_conf_val_type _value_type(t_config_value value){
+	return (t_conf_val_type)(value & CONFIGURATION_VAL_TYPE_MASK);
+}
+//---------------------------------------------------------------------------
+static inline t_config_value _value_from_int(int value){
+	return ((t_config_value)(uint32_t)value << 32) | CONFIGURATION_VAL_INT;
+}
+//---------------------------------------------------------------------------
+static inline int _value_int(t_config_value value){
+	return (int)(uint32_t)(value >> 32);
+}
+//---------------------------------------------------------------------------
+static inline t_config_value _value_from_float(float value){
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return ((t_config_value)bits << 32) | CONFIGURATION_VAL_FLOAT;
+}
+//---------------------------------------------------------------------------
+static inline float _value_float(t_config_value value){
+	uint32_t bits = (uint32_t)(value >> 32);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+//---------------------------------------------------------------------------
+static inline t_config_value _value_from_str(const char *value){
+	return (t_config_value)(uintptr_t)value | CONFIGURATION_VAL_STR;
+}
+//---------------------------------------------------------------------------
+static inline const char *_value_str(t_config_value value){
+	return (const char *)(uintptr_t)(value & ~(t_config_value)(CONFIGURATION_VAL_TYPE_MASK | CONFIGURATION_VAL_OWNED));
+}
+//---------------------------------------------------------------------------
+// the runtime string value holds, NULL for other values
+static inline t_config_str *_value_owned(t_config_value value){
+	if(_value_type(value) != CONFIGURATION_VAL_STR || !(value & CONFIGURATION_VAL_OWNED)){
+		return NULL;
 	}
-	configuration.num_items = 0;
-	configuration.loaded = 0;
-	configuration.error_msg[0] = '\0';
-	configuration.configdirok = 0;
+	return (t_config_str *)(_value_str(value) - offsetof(t_config_str, str));
 }
 //---------------------------------------------------------------------------
-int _configdir_init(int create_configdir){
-
-	if(configuration.configdirok){
-		return 1;
+static void _c_locale_init(){
+	configuration_c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+//---------------------------------------------------------------------------
+/*
+ * Convert the len bytes at str to a float with strtof in the C locale.
+ * Used for numbers too long or too large for the exact conversion in _value_parse.
+ */
+static float _value_parse_float_slow(const char *str, size_t len){
+	char buf[128];
+	char *copy = len < sizeof(buf) ? buf : malloc(len + 1);
+	if(!copy){
+		return NAN;
 	}
+	memcpy(copy, str, len);
+	copy[len] = '\0';
 
-	/* find config directory */
-#ifndef WIN32
-	/* for UNIX systems */
-	char config_base[200] = { '\0' };
+	pthread_once(&configuration_c_locale_once, _c_locale_init);
+	locale_t locale = configuration_c_locale ? uselocale(configuration_c_locale) : (locale_t)0;
+	float value = strtof(copy, NULL);
+	if(locale){
+		uselocale(locale);
+	}
+	if(copy != buf){
+		free(copy);
+	}
+	return value;
+}
+//---------------------------------------------------------------------------
+static int _value_match_word(const char *str, const char *end, const char *word){
+	size_t len = strlen(word);
+	return (size_t)(end - str) == len && strncasecmp(str, word, len) == 0;
+}
+//---------------------------------------------------------------------------
+/*
+ * Classify the len bytes at str as an int, a float or a string in a single
+ * pass, converting numbers as it goes. Numbers always use '.' as the decimal
+ * point, whatever the locale. Ints that do not fit an int and floats that
+ * do not fit a float are left as strings so their text is not lost.
+ *
+ * \return type of the value, with the converted number in *value for ints and floats.
+ */
+static t_conf_val_type _value_parse(const char *str, size_t len, t_config_value *value){
+	const char *p = str;
+	const char *end = str + len;
+	int negative = 0;
+	if(p < end && (*p == '+' || *p == '-')){
+		negative = (*p++ == '-');
+	}
 
-	/* try XDG standard */
-	char *xdg_config = getenv("XDG_CONFIG_HOME");
-	if(xdg_config != NULL){
-		if(strlen(xdg_config) > sizeof(config_base)){
-			snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Your XDG config path is too long for me to use.");
+	// significant digits are kept while they fit, the rest only scale the exponent
+	uint64_t mantissa = 0;
+	int num_digits = 0;
+	int exponent = 0;
+	int inexact = 0;
+	for(; p < end && *p >= '0' && *p <= '9'; p++, num_digits++){
+		if(mantissa < 100000000000000000ull){
+			mantissa = mantissa * 10 + (*p - '0');
 		}
 		else{
-			snprintf(config_base, sizeof(config_base), "%s", xdg_config);
+			exponent++;
+			inexact |= (*p != '0');
 		}
 	}
 
-	// if we don't have a config_base yet, try HOME
-	if(strlen(config_base) == 0){
-		/* find HOME directory */
-		char *homedir = getenv("HOME");
-		if(homedir == NULL){
-			snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Unable to find HOME directory for configuration.");
-			printf("Unable to find HOME directory for configuration.\n");
-			//exit?
-			configuration.configdirok = 0;
+	if(p == end && num_digits){
+		if(exponent == 0 && mantissa <= (negative ? 2147483648ull : 2147483647ull)){
+			*value = _value_from_int(negative ? (int)-(int64_t)mantissa : (int)mantissa);
+			return CONFIGURATION_VAL_INT;
 		}
-		else{
-			if(strlen(homedir) + strlen("/.config")  > sizeof(config_base)){
-				snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN,"Your XDG config path is too long for me to use.");
+		return CONFIGURATION_VAL_STR;
+	}
+
+	if(!num_digits && (_value_match_word(p, end, "inf") || _value_match_word(p, end, "infinity"))){
+		*value = _value_from_float(negative ? -INFINITY : INFINITY);
+		return CONFIGURATION_VAL_FLOAT;
+	}
+	if(!num_digits && _value_match_word(p, end, "nan")){
+		*value = _value_from_float(negative ? -NAN : NAN);
+		return CONFIGURATION_VAL_FLOAT;
+	}
+
+	if(p < end && *p == '.'){
+		for(p++; p < end && *p >= '0' && *p <= '9'; p++, num_digits++){
+			if(mantissa < 100000000000000000ull){
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
 			}
 			else{
-				snprintf(config_base, sizeof(config_base), "%s/.config", homedir);
-
-				// create HOME/.config dir if it doesn't exist
-				struct stat st;
-				if(stat(config_base, &st) != 0){
-					if(create_configdir){
-#ifdef WIN32
-						if(_mkdir(config_base) != 0){
-#else
-						if(mkdir(config_base, 0755) != 0){
-#endif
-							snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Unable to create HOME./config configuration directory %s.", config_base);
-							configuration.configdirok = 0;
-							return 0;
-						}
-					}
-				}
+				inexact |= (*p != '0');
 			}
 		}
 	}
+	if(!num_digits){
+		return CONFIGURATION_VAL_STR;
+	}
 
-	if(strlen(config_base) > 0){
-		if(strlen(config_base) + strlen("/") + strlen(configuration.dirname) > sizeof(configuration.configdir)){
-			snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Your config directory path is too long for me to use.");
-			printf("Your config directory path is too long for me to use.\n");
-			return 0;
+	if(p < end && (*p == 'e' || *p == 'E')){
+		p++;
+		int exp_negative = 0;
+		if(p < end && (*p == '+' || *p == '-')){
+			exp_negative = (*p++ == '-');
+		}
+		if(p == end || *p < '0' || *p > '9'){
+			return CONFIGURATION_VAL_STR;
 		}
-		snprintf(configuration.configdir, sizeof(configuration.configdir), "%s/%s", config_base, configuration.dirname);
+		int exp_value = 0;
+		for(; p < end && *p >= '0' && *p <= '9'; p++){
+			if(exp_value < 100000){
+				exp_value = exp_value * 10 + (*p - '0');
+			}
+		}
+		exponent += exp_negative ? -exp_value : exp_value;
+	}
+	if(p != end){
+		return CONFIGURATION_VAL_STR;
 	}
-#endif
 
-	//create dir if it doesn't exist
-	struct stat st;
-	if(stat(configuration.configdir, &st) == 0){
-		configuration.configdirok = 1; //found
+	// exact powers of ten in float
+	static const float pow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+	float f;
+	if(mantissa == 0){
+		f = 0.0f;
 	}
-	else{ //create, if requested
-		if(!create_configdir){
-			snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration directory does not exist and not created (as requested).");
-			return 0;
-		}
-#ifdef WIN32
-		if(_mkdir(configuration.configdir) == 0){
-#else
-		if(mkdir(configuration.configdir, 0755) == 0){
-#endif
-			configuration.configdirok = 1;
-		}
-		else{
-			snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Unable to create configuration directory %s.", configuration.configdir);
-			configuration.configdirok = 0;
-			return 0;
+	else if(!inexact && mantissa <= (1u << 24) && exponent >= -10 && exponent <= 10){
+		// mantissa and power of ten are exact, so one rounding gives the nearest float
+		f = exponent < 0 ? (float)mantissa / pow10[-exponent] : (float)mantissa * pow10[exponent];
+	}
+	else{
+		f = _value_parse_float_slow(str, len);
+		if(isinf(f)){
+			// too large for a float
+			return CONFIGURATION_VAL_STR;
 		}
+		*value = _value_from_float(f);
+		return CONFIGURATION_VAL_FLOAT;
 	}
-	return 1;
+	*value = _value_from_float(negative ? -f : f);
+	return CONFIGURATION_VAL_FLOAT;
 }
 //---------------------------------------------------------------------------
-int configuration_init(char config_dirname[], char config_filename[]){
-
-	if(!strlen(config_dirname)){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Specified config dirname was empty.");
-		return 0;
+/*
+ * Format a float for the config file with '.' as the decimal point, whatever the locale.
+ */
+static void _value_format_float(char *buf, size_t size, float value){
+	snprintf(buf, size, "%0.4f", value);
+	const char *point = localeconv()->decimal_point;
+	if(point[0] == '.' && point[1] == '\0'){
+		return;
 	}
-	if(!strlen(config_filename)){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Specified config filename was empty.");
-		return 0;
+	char *found = strstr(buf, point);
+	if(found){
+		size_t point_len = strlen(point);
+		*found = '.';
+		memmove(found + 1, found + point_len, strlen(found + point_len) + 1);
 	}
-	snprintf(configuration.dirname, 32, "%s", config_dirname);
-	snprintf(configuration.filename, 32, "%s", config_filename);
-	configuration.error_msg[0] = '\0';
-	return _configdir_init(1);
 }
 //---------------------------------------------------------------------------
-int configuration_init_indexes(t_configuration_index_mapping mappings[CONFIGURATION_ITEMS_MAX]){
-	for(int i = 0; i < CONFIGURATION_ITEMS_MAX; i++){
-		if(strnlen(mappings[i].key, CONFIGURATION_KEY_MAX)){
-			if((mappings[i].index < CONFIGURATION_ITEMS_MAX)){
-				configuration.mappings[i] = mappings[i];
-				snprintf(configuration.items[mappings[i].index].key, CONFIGURATION_KEY_MAX, "%s", mappings[i].key);
-				configuration.items[mappings[i].index].val_type = mappings[i].val_type;
-				switch(mappings[i].val_type){
-					case CONFIGURATION_VAL_INT:
-						sscanf(mappings[i].default_value, "%d", &configuration.items[mappings[i].index].val.int_value);
-						break;
-
-					case CONFIGURATION_VAL_FLOAT:
-						sscanf(mappings[i].default_value, "%f", &configuration.items[mappings[i].index].val.float_value);
-						break;
-
-					case CONFIGURATION_VAL_STR:
-						snprintf(configuration.items[mappings[i].index].val.str_value, CONFIGURATION_VAL_STR_LEN, "%s", mappings[i].default_value);
-						break;
-				}
-			}
-			else {
-				snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Invalid mapping to index %d.", mappings[i].index);
-				printf("Invalid configuration mapping to %d.\n", mappings[i].index);
-			}
+static void _reader_release(void *reader){
+	atomic_store(&((t_config_reader *)reader)->in_use, 0);
+}
+//---------------------------------------------------------------------------
+static void _reader_key_init(){
+	pthread_key_create(&configuration_reader_key, _reader_release);
+}
+//---------------------------------------------------------------------------
+/*
+ * Find the reader record of the calling thread, reusing a record left by an
+ * exited thread or adding a new one.
+ *
+ * \return reader record or NULL if one could not be allocated.
+ */
+static t_config_reader *_reader_get(){
+	if(configuration_reader){
+		return configuration_reader;
+	}
+	pthread_once(&configuration_reader_once, _reader_key_init);
+
+	t_config_reader *reader;
+	for(reader = atomic_load(&configuration_readers); reader; reader = reader->next){
+		int unused = 0;
+		if(atomic_compare_exchange_strong(&reader->in_use, &unused, 1)){
+			break;
 		}
 	}
-	return 1;
+	if(!reader){
+		reader = calloc(1, sizeof(t_config_reader));
+		if(!reader){
+			return NULL;
+		}
+		atomic_init(&reader->in_use, 1);
+		reader->next = atomic_load(&configuration_readers);
+		while(!atomic_compare_exchange_weak(&configuration_readers, &reader->next, reader));
+	}
+	pthread_setspecific(configuration_reader_key, reader);
+	configuration_reader = reader;
+	return reader;
 }
 //---------------------------------------------------------------------------
-int configuration_load(){
-
-	_configdir_init(0);
-
-	//can't load if configdir not ok
-	if(!configuration.configdirok){
-		return 0;
+/*
+ * Start reading the published table of cfg. Must be paired with _read_end.
+ */
+static t_config_reader *_read_begin(t_configuration *cfg){
+	t_config_reader *reader = _reader_get();
+	if(!reader){
+		// no reader record, fall back to excluding writers
+		pthread_mutex_lock(&cfg->lock);
+		return NULL;
 	}
-
-	//don't load more than once
-	if(configuration.loaded){
-		return 1;
+	if(reader->depth++ == 0){
+		atomic_store(&reader->epoch, atomic_load(&configuration_epoch));
 	}
-
-	char fqconfigname[288]; // configdir + configfile
-	snprintf(fqconfigname, sizeof(fqconfigname), "%s/%s", configuration.configdir, configuration.filename);
-
-	// init configuration
-	configuration.num_items = 0;
-	// count mapped items
-	int num_mapped_items = 0;
-	for(int i = 0; i < CONFIGURATION_ITEMS_MAX; i++){
-		if(strnlen(configuration.mappings[i].key, CONFIGURATION_KEY_MAX)){
-			num_mapped_items++;
+	return reader;
+}
+//---------------------------------------------------------------------------
+static void _read_end(t_configuration *cfg, t_config_reader *reader){
+	if(!reader){
+		pthread_mutex_unlock(&cfg->lock);
+		return;
+	}
+	if(--reader->depth == 0){
+		atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+	}
+}
+//---------------------------------------------------------------------------
+static void _table_free(t_config_table *table){
+	if(table){
+		t_config_sorted *sorted = atomic_load(&table->sorted);
+		while(sorted){
+			t_config_sorted *older = sorted->older;
+			free(sorted);
+			sorted = older;
 		}
+		free(table->items);
+		free(table->index);
+		free(table);
 	}
-	// start non-indexed items after mappings
-	configuration.num_items = num_mapped_items;
-
-	FILE *configfile = NULL;
-	configfile = fopen(fqconfigname, "r");
-	if(!configfile){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Unable to open configfile %s.", fqconfigname);
-		return 0;
+}
+//---------------------------------------------------------------------------
+/*
+ * Get the epoch of the oldest read in progress.
+ */
+static unsigned long _epoch_oldest(){
+	unsigned long oldest = ULONG_MAX;
+	for(t_config_reader *reader = atomic_load(&configuration_readers); reader; reader = reader->next){
+		unsigned long epoch = atomic_load(&reader->epoch);
+		if(epoch && epoch < oldest){
+			oldest = epoch;
+		}
 	}
-
-	int at_eof = 0;
-	int line = 0;
-	while(!at_eof){
-		char tmpkey[CONFIGURATION_KEY_MAX];
-		char tmpval[CONFIGURATION_VAL_STR_LEN];
-		int charsmatching = 0; // number of chars matching format
-		int signal = fscanf(configfile, "%32s %32s\n", &tmpkey[0], &tmpval[0]);
-
-		if(signal == EOF){
-			// reached end of file
-			at_eof = 1;
-			continue;
+	return oldest;
+}
+//---------------------------------------------------------------------------
+/*
+ * Free the replaced key orders of a published table retired before oldest.
+ * Readers only ever replace the newest order, so the older ones can be
+ * unlinked under the writer lock.
+ */
+static void _sorted_reclaim(t_config_table *table, unsigned long oldest){
+	t_config_sorted *sorted = table ? atomic_load_explicit(&table->sorted, memory_order_acquire) : NULL;
+	while(sorted && sorted->older){
+		t_config_sorted *older = sorted->older;
+		unsigned long retired_epoch = atomic_load(&older->retired_epoch);
+		if(retired_epoch && retired_epoch < oldest){
+			sorted->older = older->older;
+			free(older);
 		}
-
-		if(signal != 2){
-			printf("ERROR: reading configuration entry %d from %s\n", line, fqconfigname);
-			// try next line
-			line++;
-			continue;
+		else{
+			sorted = older;
 		}
-		line++;
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Free retired tables, strings and key orders that no reader can still be using.
+ */
+static void _tables_reclaim(t_configuration *cfg){
+	unsigned long oldest = _epoch_oldest();
+	_sorted_reclaim(atomic_load_explicit(&cfg->table, memory_order_relaxed), oldest);
 
-		int insert_index = configuration.num_items;
-		// if key matches a mapping, insert in mapped position
-		if(num_mapped_items > 0){
-			for(int i = 0; i < num_mapped_items; i++){
-				if(strncmp(configuration.mappings[i].key, tmpkey, CONFIGURATION_KEY_MAX) == 0){
-					insert_index = configuration.mappings[i].index;
-				}
-			}
+	t_config_table **link = &cfg->retired;
+	while(*link){
+		t_config_table *table = *link;
+		if(table->retired_epoch < oldest){
+			*link = table->retired_next;
+			_table_free(table);
 		}
-
-		// copy the key
-		snprintf(configuration.items[insert_index].key, CONFIGURATION_KEY_MAX, "%s", tmpkey);
-
-		// convert tmpval
-		// check for integer
-		sscanf(tmpval, "%d%n", &configuration.items[insert_index].val.int_value, &charsmatching);
-		if(charsmatching == strlen(tmpval)){
-			// all chars were int
-			configuration.items[insert_index].val_type = CONFIGURATION_VAL_INT;
-			if(insert_index >= num_mapped_items){
-				configuration.num_items = configuration.num_items + 1;
-			}
-			continue;
+		else{
+			link = &table->retired_next;
 		}
-
-		sscanf(tmpval, "%f%n", &configuration.items[insert_index].val.float_value, &charsmatching);
-		if(charsmatching == strlen(tmpval)){
-			// all chars were float
-			configuration.items[insert_index].val_type = CONFIGURATION_VAL_FLOAT;
-			if(insert_index >= num_mapped_items){
-				configuration.num_items = configuration.num_items + 1;
-			}
-			continue;
+	}
+	t_config_str **str_link = &cfg->retired_strs;
+	while(*str_link){
+		t_config_str *str = *str_link;
+		if(str->retired_epoch < oldest){
+			*str_link = str->next;
+			free(str);
+			cfg->num_retired_strs--;
 		}
-
-		// if not int or float, assume string
-		snprintf(configuration.items[insert_index].val.str_value, CONFIGURATION_VAL_STR_LEN, "%s", tmpval);
-		configuration.items[insert_index].val_type = CONFIGURATION_VAL_STR;
-		if(insert_index >= num_mapped_items){
-			configuration.num_items = configuration.num_items + 1;
+		else{
+			str_link = &str->next;
 		}
 	}
-
-	fclose(configfile);
-	configuration.loaded = 1;
-	return 1;	
+	cfg->reclaim_strs = 2 * cfg->num_retired_strs + CONFIGURATION_RETIRED_STRS_MIN;
 }
 //---------------------------------------------------------------------------
-int configuration_save(){
-	FILE *configfile;
-	int i = 0;
-	char fqconfigname[288]; //configdir + configfile
-
-	_configdir_init(1);
-
-	//configuration.configdirok?
-	if(!configuration.configdirok){
-		return 0;
+/*
+ * Retire the runtime string value holds, if any, after it has been replaced
+ * in the published table. Values set in place do not replace the table, so
+ * retired strings are also freed here once their number has doubled, which
+ * keeps the cost of a set constant even while a reader holds them back.
+ * Caller must hold the writer lock.
+ */
+static void _str_retire(t_configuration *cfg, t_config_value value){
+	t_config_str *str = _value_owned(value);
+	if(str){
+		// readers that started before the replacement announce an older epoch
+		str->retired_epoch = atomic_fetch_add(&configuration_epoch, 1);
+		str->next = cfg->retired_strs;
+		cfg->retired_strs = str;
+		if(++cfg->num_retired_strs >= cfg->reclaim_strs){
+			_tables_reclaim(cfg);
+		}
 	}
-
-	snprintf(fqconfigname, sizeof(fqconfigname), "%s/%s", configuration.configdir, configuration.filename);
-	configfile = fopen(fqconfigname, "w");
-
-	if(configfile == NULL){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Unable to open configfile for save.");
-		printf("Unable to open configfile for save.\n");
-		return 0;
+}
+//---------------------------------------------------------------------------
+/*
+ * Stamp the runtime strings of table, which is about to be published, and
+ * retire those of the old published table that it no longer holds.
+ */
+static void _strs_stamp(t_configuration *cfg, t_config_table *table, t_config_table *old){
+	unsigned long stamp = ++cfg->str_stamp;
+	int num_items = atomic_load_explicit(&table->num_items, memory_order_relaxed);
+	for(int i = 0; i < num_items; i++){
+		t_config_str *str = _value_owned(atomic_load_explicit(&table->items[i].val, memory_order_relaxed));
+		if(str){
+			str->stamp = stamp;
+		}
 	}
-
-	for(i = 0; i < configuration.num_items; i++){
-		switch(configuration.items[i].val_type){
-			case CONFIGURATION_VAL_INT:
-				fprintf(configfile, "%s %d\n", configuration.items[i].key, configuration.items[i].val.int_value);
-				break;
-			case CONFIGURATION_VAL_FLOAT:
-				fprintf(configfile, "%s %0.4f\n", configuration.items[i].key, configuration.items[i].val.float_value);
-				break;
-			case CONFIGURATION_VAL_STR:
-				fprintf(configfile, "%s %s\n", configuration.items[i].key, configuration.items[i].val.str_value);
-				break;
+	num_items = old ? atomic_load_explicit(&old->num_items, memory_order_relaxed) : 0;
+	for(int i = 0; i < num_items; i++){
+		t_config_value value = atomic_load_explicit(&old->items[i].val, memory_order_relaxed);
+		t_config_str *str = _value_owned(value);
+		if(str && str->stamp != stamp){
+			_str_retire(cfg, value);
 		}
 	}
-
-	fclose(configfile);
-	configuration.saved = 1;
-	return 1;	
 }
 //---------------------------------------------------------------------------
-const char * configuration_get_configdir(){
-	if(!configuration.configdirok){
-		return "";
+/*
+ * Make table the published table of cfg and retire the previous one.
+ * Caller must hold the writer lock.
+ */
+static void _table_publish(t_configuration *cfg, t_config_table *table){
+	t_config_table *old = atomic_exchange(&cfg->table, table);
+	if(old != table){
+		_strs_stamp(cfg, table, old);
 	}
-	return configuration.configdir;
+	if(old && old != table){
+		old->retired_epoch = atomic_fetch_add(&configuration_epoch, 1);
+		old->retired_next = cfg->retired;
+		cfg->retired = old;
+	}
+	_tables_reclaim(cfg);
 }
 //---------------------------------------------------------------------------
-int configuration_get_by_index_int_value(const unsigned int index, int *value){
-	if(!value){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Value is null.");
-		return 0;
+/*
+ * Free the published and retired tables. Only safe when no other thread uses cfg.
+ */
+static void _tables_free(t_configuration *cfg){
+	t_config_table *table = atomic_exchange(&cfg->table, NULL);
+	int num_items = table ? atomic_load(&table->num_items) : 0;
+	for(int i = 0; i < num_items; i++){
+		free(_value_owned(atomic_load(&table->items[i].val)));
+	}
+	_table_free(table);
+	while(cfg->retired){
+		t_config_table *next = cfg->retired->retired_next;
+		_table_free(cfg->retired);
+		cfg->retired = next;
+	}
+	while(cfg->retired_strs){
+		t_config_str *next = cfg->retired_strs->next;
+		free(cfg->retired_strs);
+		cfg->retired_strs = next;
+	}
+	cfg->num_retired_strs = 0;
+}
+//---------------------------------------------------------------------------
+configuration_t *configuration_create(){
+	t_configuration *cfg = malloc(sizeof(t_configuration));
+	if(cfg){
+		*cfg = (t_configuration)CONFIGURATION_DEFAULTS;
+	}
+	return cfg;
+}
+//---------------------------------------------------------------------------
+void configuration_destroy(configuration_t *cfg){
+	if(!cfg){
+		return;
+	}
+	configuration_ctx_reset(cfg);
+	free(cfg->configdir);
+	cfg->configdir = NULL;
+	if(cfg != &configuration){
+		pthread_mutex_destroy(&cfg->lock);
+		pthread_mutex_destroy(&cfg->save_lock);
+		pthread_mutex_destroy(&cfg->save_async_lock);
+		pthread_cond_destroy(&cfg->save_wanted);
+		pthread_cond_destroy(&cfg->save_done);
+		free(cfg);
+	}
+}
+//---------------------------------------------------------------------------
+configuration_t *configuration_default(){
+	return &configuration;
+}
+//---------------------------------------------------------------------------
+static void _txn_end(t_configuration *cfg){
+	for(int i = 0; i < cfg->txn_num_sets; i++){
+		t_config_str *str = _value_owned(cfg->txn_sets[i].value);
+		if(str && str->stamp != cfg->str_stamp){
+			// not published by a commit, so no reader has seen it
+			free(str);
+		}
+	}
+	free(cfg->txn_sets);
+	cfg->txn_sets = NULL;
+	cfg->txn_num_sets = 0;
+	cfg->txn_num_new = 0;
+	cfg->txn_sets_size = 0;
+	cfg->txn_active = 0;
+}
+//---------------------------------------------------------------------------
+#ifndef WIN32
+static void _journal_close(t_configuration *cfg){
+	if(cfg->journal_fd >= 0){
+		close(cfg->journal_fd);
+		cfg->journal_fd = -1;
+	}
+}
+#endif
+//---------------------------------------------------------------------------
+static void _mappings_hash_free(t_configuration *cfg){
+	free(cfg->mapping_displacements);
+	free(cfg->mapping_slots);
+	cfg->mapping_displacements = NULL;
+	cfg->mapping_slots = NULL;
+	cfg->mapping_buckets = 0;
+}
+//---------------------------------------------------------------------------
+static void _error_set(const t_configuration *cfg, t_configuration_error code, const char *format, const char *str, int has_number, long long number){
+	t_config_error *error = &_last_error;
+	error->sys_errno = code == CONFIGURATION_ERROR_SYSTEM ? errno : 0;
+	error->cfg = cfg;
+	error->code = code;
+	error->format = format;
+	error->has_str = str != NULL;
+	error->has_number = has_number;
+	error->number = number;
+	if(str){
+		size_t len = 0;
+		while(len < sizeof(error->str) - 1 && str[len]){
+			error->str[len] = str[len];
+			len++;
+		}
+		error->str[len] = '\0';
+	}
+}
+//---------------------------------------------------------------------------
+static void _error(const t_configuration *cfg, t_configuration_error code, const char *msg){
+	_error_set(cfg, code, msg, NULL, 0, 0);
+}
+//---------------------------------------------------------------------------
+static void _error_str(const t_configuration *cfg, t_configuration_error code, const char *format, const char *str){
+	_error_set(cfg, code, format, str, 0, 0);
+}
+//---------------------------------------------------------------------------
+static void _error_int(const t_configuration *cfg, t_configuration_error code, const char *format, int number){
+	_error_set(cfg, code, format, NULL, 1, number);
+}
+//---------------------------------------------------------------------------
+static void _error_clear(const t_configuration *cfg){
+	if(_last_error.cfg == cfg){
+		_last_error.code = CONFIGURATION_OK;
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Pass a message to the log callback of the configuration, or write it to
+ * stderr if none has been set.
+ */
+static void _log(t_configuration *cfg, t_configuration_log_level level, const char *format, ...){
+	char msg[CONFIGURATION_ERROR_MSG_LEN * 2];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+	if(cfg->log){
+		cfg->log(cfg, level, msg, cfg->log_ctx);
+	}
+	else{
+		fprintf(stderr, "%s: %s\n", level == CONFIGURATION_LOG_ERROR ? "ERROR" : "WARNING", msg);
+	}
+}
+//---------------------------------------------------------------------------
+#ifdef CONFIGURATION_METRICS
+static uint64_t _metrics_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+//---------------------------------------------------------------------------
+static void _histogram_add(t_config_histogram *histogram, uint64_t ns){
+	// bucket i holds [2^i, 2^(i+1)) ns
+	int bucket = 63 - __builtin_clzll(ns | 1);
+	if(bucket >= CONFIGURATION_HISTOGRAM_BUCKETS){
+		bucket = CONFIGURATION_HISTOGRAM_BUCKETS - 1;
+	}
+	atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->total_ns, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+}
+//---------------------------------------------------------------------------
+static void _histogram_copy(t_configuration_histogram *copy, t_config_histogram *histogram){
+	copy->count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+	copy->total_ns = atomic_load_explicit(&histogram->total_ns, memory_order_relaxed);
+	for(int i = 0; i < CONFIGURATION_HISTOGRAM_BUCKETS; i++){
+		copy->buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+	}
+}
+#endif
+//---------------------------------------------------------------------------
+static void _configdir_close(t_configuration *cfg){
+#ifndef WIN32
+	int fd = atomic_exchange(&cfg->dir_fd, -1);
+	if(fd >= 0){
+		close(fd);
+	}
+#endif
+}
+//---------------------------------------------------------------------------
+// forget the layers read by the last load, the next load reads them again
+static void _layers_free(t_configuration *cfg){
+	_table_free(cfg->layers_base);
+	cfg->layers_base = NULL;
+	free(cfg->env_overrides);
+	cfg->env_overrides = NULL;
+	cfg->num_env_overrides = 0;
+}
+//---------------------------------------------------------------------------
+static void _subscriptions_free(t_configuration *cfg){
+	t_subscription *subscription = atomic_exchange(&cfg->subscriptions, NULL);
+	while(subscription){
+		t_subscription *next = subscription->next;
+		free(subscription);
+		subscription = next;
+	}
+	free(cfg->changed_keys);
+	cfg->changed_keys = NULL;
+	atomic_store(&cfg->num_changed, 0);
+	cfg->changed_size = 0;
+}
+//---------------------------------------------------------------------------
+/*
+ * Write the configuration in the background whenever saves are requested.
+ * All requests made while a save is running are served by the next one,
+ * which writes the values published when it runs. Values are changed in
+ * place and the journal is folded into the saved file, so saving the values
+ * of an older request would drop the journaled sets made since.
+ */
+static void *_save_thread(void *arg){
+	t_configuration *cfg = arg;
+	pthread_mutex_lock(&cfg->save_async_lock);
+	for(;;){
+		while(cfg->save_requests_done == cfg->save_requests && !cfg->save_thread_stop){
+			pthread_cond_wait(&cfg->save_wanted, &cfg->save_async_lock);
+		}
+		// requests made before stopping are still saved
+		if(cfg->save_requests_done == cfg->save_requests){
+			break;
+		}
+		unsigned long requests = cfg->save_requests;
+		t_save_request *waiting = cfg->save_waiting;
+		cfg->save_waiting = NULL;
+		pthread_mutex_unlock(&cfg->save_async_lock);
+
+		int saved = configuration_ctx_save(cfg);
+		// oldest request first
+		t_save_request *request = NULL;
+		while(waiting){
+			t_save_request *next = waiting->next;
+			waiting->next = request;
+			request = waiting;
+			waiting = next;
+		}
+		while(request){
+			t_save_request *next = request->next;
+			request->callback(cfg, saved, request->ctx);
+			free(request);
+			request = next;
+		}
+
+		pthread_mutex_lock(&cfg->save_async_lock);
+		cfg->save_result = saved;
+		cfg->save_requests_done = requests;
+		pthread_cond_broadcast(&cfg->save_done);
+	}
+	pthread_mutex_unlock(&cfg->save_async_lock);
+	return NULL;
+}
+//---------------------------------------------------------------------------
+// finish the requested saves and stop the save thread
+static void _save_thread_stop(t_configuration *cfg){
+	pthread_mutex_lock(&cfg->save_async_lock);
+	if(!cfg->save_thread_running){
+		pthread_mutex_unlock(&cfg->save_async_lock);
+		return;
+	}
+	cfg->save_thread_stop = 1;
+	pthread_cond_signal(&cfg->save_wanted);
+	pthread_mutex_unlock(&cfg->save_async_lock);
+	pthread_join(cfg->save_thread, NULL);
+	cfg->save_thread_running = 0;
+	cfg->save_thread_stop = 0;
+	cfg->save_result = 1;
+}
+//---------------------------------------------------------------------------
+void configuration_ctx_reset(configuration_t *cfg){
+	configuration_ctx_unwatch(cfg);
+	_save_thread_stop(cfg);
+	_tables_free(cfg);
+	_layers_free(cfg);
+	free(cfg->mappings);
+	cfg->mappings = NULL;
+	cfg->num_mappings = 0;
+	_mappings_hash_free(cfg);
+	cfg->schema = NULL;
+	while(cfg->strings){
+		t_string_chunk *next = cfg->strings->next;
+		free(cfg->strings);
+		cfg->strings = next;
+	}
+	free(cfg->string_slots);
+	cfg->string_slots = NULL;
+	cfg->string_slots_size = 0;
+	cfg->num_strings = 0;
+#ifndef WIN32
+	while(cfg->snapshots){
+		t_snapshot_map *next = cfg->snapshots->next;
+		munmap(cfg->snapshots->addr, cfg->snapshots->size);
+		free(cfg->snapshots);
+		cfg->snapshots = next;
+	}
+	_journal_close(cfg);
+#endif
+	_txn_end(cfg);
+	_subscriptions_free(cfg);
+#ifdef CONFIGURATION_METRICS
+	memset(&cfg->metrics, 0, sizeof(cfg->metrics));
+#endif
+	cfg->loaded = 0;
+	cfg->has_written = 0;
+	// the config file still holds the values that were removed
+	atomic_fetch_add(&cfg->changes, 1);
+	// options go back to their defaults, as for a new context
+	cfg->use_snapshot = 0;
+	cfg->use_journal = 0;
+	cfg->use_system_config = 0;
+	cfg->env_prefix[0] = '\0';
+	cfg->log = NULL;
+	cfg->log_ctx = NULL;
+	_error_clear(cfg);
+	_configdir_close(cfg);
+	cfg->configdirok = 0;
+}
+//---------------------------------------------------------------------------
+static unsigned int _index_hash(const char *key){
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	while(*key){
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+//---------------------------------------------------------------------------
+static unsigned int _index_hash_len(const char *key, size_t len){
+	// FNV-1a, same as _index_hash for unterminated strings
+	unsigned int hash = 2166136261u;
+	for(size_t i = 0; i < len; i++){
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+//---------------------------------------------------------------------------
+/*
+ * Minimal perfect hash by hash and displace, see t_configuration_schema.
+ * Seed 0 picks the bucket, the bucket's displacement plus one picks the slot.
+ */
+static unsigned int _phash_mix(unsigned int hash, unsigned int seed){
+	// murmur3 finaliser
+	hash ^= seed * 0x9e3779b9u;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+//---------------------------------------------------------------------------
+static unsigned int _phash_slot(unsigned int hash, unsigned int displacement, unsigned int num_slots){
+	return ((uint64_t)_phash_mix(hash, displacement + 1) * num_slots) >> 32;
+}
+//---------------------------------------------------------------------------
+/*
+ * Get the only slot value a key with hash can have. Callers compare the key.
+ *
+ * \return slot value, or -1 if there are no slots.
+ */
+static int _phash_find(const unsigned short *displacements, unsigned int num_buckets, const unsigned int *slots, unsigned int num_slots, unsigned int hash){
+	if(!num_slots){
+		return -1;
+	}
+	unsigned int bucket = _phash_mix(hash, 0) & (num_buckets - 1);
+	return slots[_phash_slot(hash, displacements[bucket], num_slots)];
+}
+//---------------------------------------------------------------------------
+/*
+ * Build a perfect hash of num_keys distinct key hashes into num_keys slots,
+ * each slot holding the position of its hash. Buckets with the most keys are
+ * placed first, each with the first displacement that puts all of its keys
+ * in free slots.
+ *
+ * \param num_buckets Power of two, fewer buckets make smaller but slower to build tables.
+ * \return 1 if built, 0 if some bucket could not be placed or out of memory.
+ */
+static int _phash_build(const unsigned int *hashes, unsigned int num_keys, unsigned int num_buckets, unsigned short *displacements, unsigned int *slots){
+	unsigned int *bucket_start = calloc(num_buckets + 1, sizeof(unsigned int));
+	unsigned int *bucket_keys = malloc((num_keys + 1) * sizeof(unsigned int));
+	unsigned int *order = malloc(num_buckets * sizeof(unsigned int));
+	unsigned int *bucket_slots = malloc((num_keys + 1) * sizeof(unsigned int));
+	char *taken = calloc(num_keys + 1, 1);
+	int ok = bucket_start && bucket_keys && order && bucket_slots && taken;
+
+	// group keys by bucket
+	for(unsigned int i = 0; ok && i < num_keys; i++){
+		bucket_start[(_phash_mix(hashes[i], 0) & (num_buckets - 1)) + 1]++;
+	}
+	unsigned int max_size = 0;
+	for(unsigned int b = 0; ok && b < num_buckets; b++){
+		if(bucket_start[b + 1] > max_size){
+			max_size = bucket_start[b + 1];
+		}
+		bucket_start[b + 1] += bucket_start[b];
+	}
+	for(unsigned int i = 0; ok && i < num_keys; i++){
+		unsigned int b = _phash_mix(hashes[i], 0) & (num_buckets - 1);
+		bucket_keys[bucket_start[b]++] = i;
+	}
+	for(unsigned int b = num_buckets; ok && b > 0; b--){
+		bucket_start[b] = bucket_start[b - 1];
+	}
+	if(ok){
+		bucket_start[0] = 0;
+	}
+
+	// largest buckets first
+	unsigned int num_order = 0;
+	for(unsigned int size = max_size; ok && size > 0; size--){
+		for(unsigned int b = 0; b < num_buckets; b++){
+			if(bucket_start[b + 1] - bucket_start[b] == size){
+				order[num_order++] = b;
+			}
+		}
+	}
+	for(unsigned int b = 0; ok && b < num_buckets; b++){
+		displacements[b] = 0;
+	}
+
+	for(unsigned int o = 0; ok && o < num_order; o++){
+		unsigned int b = order[o];
+		unsigned int first = bucket_start[b];
+		unsigned int size = bucket_start[b + 1] - first;
+		unsigned int d;
+		for(d = 0; d <= USHRT_MAX; d++){
+			unsigned int placed = 0;
+			for(; placed < size; placed++){
+				unsigned int slot = _phash_slot(hashes[bucket_keys[first + placed]], d, num_keys);
+				if(taken[slot]){
+					break;
+				}
+				taken[slot] = 1;
+				bucket_slots[placed] = slot;
+			}
+			if(placed == size){
+				break;
+			}
+			while(placed > 0){
+				taken[bucket_slots[--placed]] = 0;
+			}
+		}
+		if(d > USHRT_MAX){
+			ok = 0;
+			break;
+		}
+		displacements[b] = d;
+		for(unsigned int k = 0; k < size; k++){
+			slots[bucket_slots[k]] = bucket_keys[first + k];
+		}
+	}
+
+	free(bucket_start);
+	free(bucket_keys);
+	free(order);
+	free(bucket_slots);
+	free(taken);
+	return ok;
+}
+//---------------------------------------------------------------------------
+static int _hash_compare(const void *a, const void *b){
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+	return (x > y) - (x < y);
+}
+//---------------------------------------------------------------------------
+/*
+ * Allocate and build a perfect hash of num_keys key hashes, with about four
+ * keys per bucket, or more buckets if those can not all be placed.
+ *
+ * \return 1 if built, 0 if hashes are not distinct or out of memory.
+ */
+static int _phash_create(const unsigned int *hashes, unsigned int num_keys, unsigned int *num_buckets, unsigned short **displacements, unsigned int **slots){
+	*displacements = NULL;
+	*slots = NULL;
+	unsigned int *sorted = malloc(num_keys * sizeof(unsigned int));
+	if(!num_keys || !sorted){
+		free(sorted);
+		return 0;
+	}
+	memcpy(sorted, hashes, num_keys * sizeof(unsigned int));
+	qsort(sorted, num_keys, sizeof(unsigned int), _hash_compare);
+	unsigned int i;
+	for(i = 1; i < num_keys && sorted[i] != sorted[i - 1]; i++);
+	free(sorted);
+	if(i < num_keys){
+		return 0;
+	}
+
+	unsigned int max_buckets = 1;
+	while(max_buckets < 2 * num_keys){
+		max_buckets *= 2;
+	}
+	*displacements = malloc(max_buckets * sizeof(unsigned short));
+	*slots = malloc(num_keys * sizeof(unsigned int));
+	if(*displacements && *slots){
+		for(*num_buckets = 1; *num_buckets * 4 < num_keys; *num_buckets *= 2);
+		for(; *num_buckets <= max_buckets; *num_buckets *= 2){
+			if(_phash_build(hashes, num_keys, *num_buckets, *displacements, *slots)){
+				return 1;
+			}
+		}
+	}
+	free(*displacements);
+	free(*slots);
+	*displacements = NULL;
+	*slots = NULL;
+	return 0;
+}
+//---------------------------------------------------------------------------
+/*
+ * Copy len bytes of str into the string arena as a terminated string.
+ *
+ * \return pointer to the copy or NULL if the arena could not grow.
+ */
+static const char *_string_alloc(t_configuration *cfg, const char *str, size_t len){
+	t_string_chunk *chunk = cfg->strings;
+	// keep strings aligned so their pointers can be tagged with a type
+	size_t used = chunk ? (chunk->used + CONFIGURATION_STRING_ALIGN - 1) & ~(size_t)(CONFIGURATION_STRING_ALIGN - 1) : 0;
+	if(!chunk || used > chunk->size || chunk->size - used < len + 1){
+		// each chunk is twice the size of the last, up to a limit
+		size_t size = chunk ? chunk->size * 2 : CONFIGURATION_STRING_CHUNK_MIN;
+		if(size > CONFIGURATION_STRING_CHUNK_MAX){
+			size = CONFIGURATION_STRING_CHUNK_MAX;
+		}
+		if(size < len + 1){
+			size = len + 1;
+		}
+		chunk = malloc(sizeof(t_string_chunk) + size);
+		if(!chunk){
+			_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration strings.");
+			return NULL;
+		}
+		chunk->size = size;
+		chunk->next = cfg->strings;
+		cfg->strings = chunk;
+		used = 0;
+	}
+	char *copy = &chunk->data[used];
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	chunk->used = used + len + 1;
+	return copy;
+}
+//---------------------------------------------------------------------------
+/*
+ * Make room in the intern table for num strings, keeping it at most half full.
+ *
+ * \return 1 if there is room.
+ */
+static int _strings_reserve(t_configuration *cfg, unsigned int num){
+	if(2 * num <= cfg->string_slots_size){
+		return 1;
+	}
+	unsigned int size = cfg->string_slots_size ? cfg->string_slots_size : 64;
+	while(size < 2 * num){
+		size *= 2;
+	}
+	t_string_slot *slots = calloc(size, sizeof(t_string_slot));
+	if(!slots){
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration strings.");
+		return 0;
+	}
+	for(unsigned int i = 0; i < cfg->string_slots_size; i++){
+		if(cfg->string_slots[i].str){
+			unsigned int pos = cfg->string_slots[i].hash & (size - 1);
+			while(slots[pos].str){
+				pos = (pos + 1) & (size - 1);
+			}
+			slots[pos] = cfg->string_slots[i];
+		}
+	}
+	free(cfg->string_slots);
+	cfg->string_slots = slots;
+	cfg->string_slots_size = size;
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Find or add the len bytes at str in the string arena, so each distinct
+ * string is stored once. str does not need to be terminated.
+ *
+ * \return interned string or NULL if the arena could not grow.
+ */
+static const char *_string_intern_len(t_configuration *cfg, const char *str, size_t len){
+	if(!_strings_reserve(cfg, cfg->num_strings + 1)){
+		return NULL;
+	}
+
+	unsigned int hash = _index_hash_len(str, len);
+	unsigned int mask = cfg->string_slots_size - 1;
+	unsigned int pos = hash & mask;
+	for(; cfg->string_slots[pos].str; pos = (pos + 1) & mask){
+		t_string_slot *slot = &cfg->string_slots[pos];
+		if(slot->hash == hash && strncmp(slot->str, str, len) == 0 && slot->str[len] == '\0'){
+			return slot->str;
+		}
+	}
+
+	const char *copy = _string_alloc(cfg, str, len);
+	if(copy){
+		cfg->string_slots[pos].hash = hash;
+		cfg->string_slots[pos].str = copy;
+		cfg->num_strings++;
+	}
+	return copy;
+}
+//---------------------------------------------------------------------------
+static const char *_string_intern(t_configuration *cfg, const char *str){
+	return _string_intern_len(cfg, str, strlen(str));
+}
+//---------------------------------------------------------------------------
+/*
+ * Copy a string value set at runtime, see t_config_str. It is owned by
+ * whoever stores it, and has to be freed if it is not stored.
+ *
+ * \return the value, or 0 if it could not be allocated.
+ */
+static t_config_value _str_new(t_configuration *cfg, const char *str){
+	size_t len = strlen(str);
+	t_config_str *copy = malloc(sizeof(t_config_str) + len + 1);
+	if(!copy){
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration string.");
+		return 0;
+	}
+	copy->stamp = 0;
+	memcpy(copy->str, str, len + 1);
+	return _value_from_str(copy->str) | CONFIGURATION_VAL_OWNED;
+}
+//---------------------------------------------------------------------------
+/*
+ * Find the item index of key in table, or -1 if the key is not in the index.
+ * Safe to call on a published table without holding the writer lock.
+ */
+static int _table_find(t_config_table *table, const char *key){
+	if(!table){
+		return -1;
+	}
+	unsigned int hash = _index_hash(key);
+	unsigned int mask = table->index_size - 1;
+	unsigned int item;
+	for(unsigned int pos = hash & mask; (item = atomic_load_explicit(&table->index[pos].item, memory_order_acquire)); pos = (pos + 1) & mask){
+		if(table->index[pos].hash == hash && strcmp(table->items[item - 1].key, key) == 0){
+			return item - 1;
+		}
+	}
+	return -1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Add the key stored at item_index to the index, replacing an existing entry for the same key.
+ */
+static void _index_insert(t_config_table *table, int item_index){
+	const char *key = table->items[item_index].key;
+	unsigned int hash = _index_hash(key);
+	unsigned int mask = table->index_size - 1;
+	unsigned int pos = hash & mask;
+	unsigned int item;
+	for(; (item = atomic_load_explicit(&table->index[pos].item, memory_order_relaxed)); pos = (pos + 1) & mask){
+		if(table->index[pos].hash == hash && strcmp(table->items[item - 1].key, key) == 0){
+			break;
+		}
+	}
+	table->index[pos].hash = hash;
+	atomic_store_explicit(&table->index[pos].item, item_index + 1, memory_order_release);
+}
+//---------------------------------------------------------------------------
+/*
+ * Rebuild the index of an unpublished table from the keyed items in [0, num_items).
+ */
+static void _index_rebuild(t_config_table *table){
+	memset(table->index, 0, table->index_size * sizeof(t_config_index_slot));
+	int num_items = atomic_load_explicit(&table->num_items, memory_order_relaxed);
+	for(int i = 0; i < num_items; i++){
+		if(table->items[i].key){
+			_index_insert(table, i);
+		}
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Make a copy of table holding its first num_items items, with room for at least num.
+ * Storage grows geometrically, new items are zeroed and the index is sized to
+ * stay at most half full. table may be NULL for an empty table.
+ *
+ * \return the copy, or NULL if it could not be allocated.
+ */
+static t_config_table *_table_copy(t_configuration *cfg, t_config_table *table, int num_items, int num){
+	int items_size = table ? table->items_size : CONFIGURATION_ITEMS_INITIAL;
+	while(items_size < num || items_size < num_items){
+		items_size *= 2;
+	}
+	unsigned int index_size = 1;
+	while(index_size < 2u * items_size){
+		index_size *= 2;
+	}
+
+	t_config_table *copy = calloc(1, sizeof(t_config_table));
+	if(copy){
+		copy->items = calloc(items_size, sizeof(t_config_item));
+		copy->index = calloc(index_size, sizeof(t_config_index_slot));
+	}
+	if(!copy || !copy->items || !copy->index){
+		_table_free(copy);
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration items.");
+		return NULL;
+	}
+	copy->items_size = items_size;
+	copy->index_size = index_size;
+	// copies keep the items where they were
+	copy->generation = table ? table->generation : ++cfg->generations;
+
+	int num_copied = table ? atomic_load(&table->num_items) : 0;
+	if(num_copied > num_items){
+		num_copied = num_items;
+	}
+	for(int i = 0; i < num_copied; i++){
+		copy->items[i].key = table->items[i].key;
+		atomic_init(&copy->items[i].val, atomic_load(&table->items[i].val));
+	}
+	atomic_init(&copy->num_items, num_items);
+	if(table && index_size == table->index_size && num_copied == atomic_load(&table->num_items)){
+		// same items in a same sized index, the slots can be copied as they are
+		memcpy(copy->index, table->index, index_size * sizeof(t_config_index_slot));
+	}
+	else{
+		_index_rebuild(copy);
+	}
+	return copy;
+}
+//---------------------------------------------------------------------------
+/*
+ * Get a table with room for at least num items. If table is too small a
+ * larger copy is returned and table is left unchanged.
+ *
+ * \return table with enough space, or NULL if it could not be allocated.
+ */
+static t_config_table *_table_reserve(t_configuration *cfg, t_config_table *table, int num){
+	if(table && num <= table->items_size){
+		return table;
+	}
+	return _table_copy(cfg, table, table ? atomic_load(&table->num_items) : 0, num);
+}
+//---------------------------------------------------------------------------
+/*
+ * Make room for num items in the published table, replacing it with a larger
+ * copy if needed. Caller must hold the writer lock.
+ *
+ * \return the published table or NULL if it could not grow.
+ */
+static t_config_table *_table_reserve_published(t_configuration *cfg, int num){
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	t_config_table *grown = _table_reserve(cfg, table, num);
+	if(grown && grown != table){
+		_table_publish(cfg, grown);
+	}
+	return grown;
+}
+//---------------------------------------------------------------------------
+/*
+ * Make configdir base/name, or just name without a base. Paths are allocated
+ * to fit, so they are not limited in length. base may be the current configdir.
+ *
+ * \return 1, or 0 if out of memory.
+ */
+static int _configdir_set(t_configuration *cfg, const char *base, const char *name){
+	size_t base_len = base ? strlen(base) + 1 : 0;
+	size_t name_len = strlen(name);
+	char *configdir = malloc(base_len + name_len + 1);
+	if(!configdir){
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration directory path.");
+		return 0;
+	}
+	if(base){
+		memcpy(configdir, base, base_len - 1);
+		configdir[base_len - 1] = '/';
+	}
+	memcpy(configdir + base_len, name, name_len + 1);
+	free(cfg->configdir);
+	cfg->configdir = configdir;
+	return 1;
+}
+//---------------------------------------------------------------------------
+int _configdir_init(t_configuration *cfg, int create_configdir){
+
+	if(cfg->configdirok){
+		return 1;
+	}
+	_configdir_close(cfg);
+
+	/* find config directory */
+#ifndef WIN32
+	/* for UNIX systems */
+	/* try XDG standard */
+	const char *config_base = getenv("XDG_CONFIG_HOME");
+
+	// if we don't have a config_base yet, try HOME
+	if(config_base == NULL || !config_base[0]){
+		config_base = NULL;
+		/* find HOME directory */
+		char *homedir = getenv("HOME");
+		if(homedir == NULL){
+			_error(cfg, CONFIGURATION_ERROR_CONFIGDIR, "Unable to find HOME directory for configuration.");
+			_log(cfg, CONFIGURATION_LOG_ERROR, "%s", configuration_ctx_get_error(cfg));
+			//exit?
+			cfg->configdirok = 0;
+		}
+		else{
+			// HOME/.config is built in configdir, which then gets dirname appended
+			if(!_configdir_set(cfg, homedir, ".config")){
+				return 0;
+			}
+			config_base = cfg->configdir;
+
+			// create HOME/.config dir if it doesn't exist
+			struct stat st;
+			if(stat(config_base, &st) != 0){
+				if(create_configdir){
+					if(mkdir(config_base, 0755) != 0){
+						_error_str(cfg, CONFIGURATION_ERROR_CONFIGDIR, "Unable to create HOME./config configuration directory %s.", config_base);
+						cfg->configdirok = 0;
+						return 0;
+					}
+				}
+			}
+		}
+	}
+
+	if(!_configdir_set(cfg, config_base, config_base ? cfg->dirname : CONFIGURATION_CONFIGDIR_DEFAULT)){
+		return 0;
+	}
+#else
+	if(!_configdir_set(cfg, NULL, CONFIGURATION_CONFIGDIR_DEFAULT)){
+		return 0;
+	}
+#endif
+
+	//create dir if it doesn't exist
+	struct stat st;
+	if(stat(cfg->configdir, &st) == 0){
+		cfg->configdirok = 1; //found
+	}
+	else{ //create, if requested
+		if(!create_configdir){
+			_error(cfg, CONFIGURATION_ERROR_CONFIGDIR, "Configuration directory does not exist and not created (as requested).");
+			return 0;
+		}
+#ifdef WIN32
+		if(_mkdir(cfg->configdir) == 0){
+#else
+		if(mkdir(cfg->configdir, 0755) == 0){
+#endif
+			cfg->configdirok = 1;
+		}
+		else{
+			_error_str(cfg, CONFIGURATION_ERROR_CONFIGDIR, "Unable to create configuration directory %s.", cfg->configdir);
+			cfg->configdirok = 0;
+			return 0;
+		}
+	}
+	return 1;
+}
+//---------------------------------------------------------------------------
+#ifndef WIN32
+/*
+ * Open configdir once, files in it are then reached relative to it without
+ * walking the path again. Loads, saves and journal appends may race to open
+ * it, only one fd is kept.
+ *
+ * \return directory fd, or -1 if it could not be opened.
+ */
+static int _configdir_fd(t_configuration *cfg){
+	int fd = atomic_load_explicit(&cfg->dir_fd, memory_order_acquire);
+	if(fd >= 0){
+		return fd;
+	}
+	fd = open(cfg->configdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0){
+		return -1;
+	}
+	int opened = -1;
+	if(!atomic_compare_exchange_strong(&cfg->dir_fd, &opened, fd)){
+		close(fd);
+		return opened;
+	}
+	return fd;
+}
+//---------------------------------------------------------------------------
+static int _config_open(t_configuration *cfg, const char *name, int flags){
+	return openat(_configdir_fd(cfg), name, flags | O_CLOEXEC, 0666);
+}
+#else
+//---------------------------------------------------------------------------
+static void _config_path(t_configuration *cfg, char *path, size_t size, const char *name){
+	snprintf(path, size, "%s/%s", cfg->configdir, name);
+}
+#endif
+//---------------------------------------------------------------------------
+/*
+ * Put name followed by suffix into buffer, which holds CONFIGURATION_NAME_MAX bytes.
+ *
+ * \return 1, or 0 if the name does not fit.
+ */
+static int _config_name(t_configuration *cfg, char *buffer, const char *name, const char *suffix){
+	int len = snprintf(buffer, CONFIGURATION_NAME_MAX, "%s%s", name, suffix);
+	if(len < 0 || len >= (int)CONFIGURATION_NAME_MAX){
+		_error_str(cfg, CONFIGURATION_ERROR_INVALID, "Configuration file name %s is too long.", name);
+		return 0;
+	}
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Open the file name in configdir for reading ("r") or replacing ("w").
+ */
+static FILE *_config_fopen(t_configuration *cfg, const char *name, const char *mode){
+#ifdef WIN32
+	char path[CONFIGURATION_PATH_MAX];
+	_config_path(cfg, path, sizeof(path), name);
+	return fopen(path, mode);
+#else
+	int fd = _config_open(cfg, name, mode[0] == 'w' ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY);
+	if(fd < 0){
+		return NULL;
+	}
+	FILE *f = fdopen(fd, mode);
+	if(!f){
+		close(fd);
+	}
+	return f;
+#endif
+}
+//---------------------------------------------------------------------------
+static int _config_stat(t_configuration *cfg, const char *name, struct stat *st){
+#ifdef WIN32
+	char path[CONFIGURATION_PATH_MAX];
+	_config_path(cfg, path, sizeof(path), name);
+	return stat(path, st);
+#else
+	return fstatat(_configdir_fd(cfg), name, st, 0);
+#endif
+}
+//---------------------------------------------------------------------------
+static int _config_rename(t_configuration *cfg, const char *from, const char *to){
+#ifdef WIN32
+	char from_path[CONFIGURATION_PATH_MAX];
+	char to_path[CONFIGURATION_PATH_MAX];
+	_config_path(cfg, from_path, sizeof(from_path), from);
+	_config_path(cfg, to_path, sizeof(to_path), to);
+	return rename(from_path, to_path);
+#else
+	return renameat(_configdir_fd(cfg), from, _configdir_fd(cfg), to);
+#endif
+}
+//---------------------------------------------------------------------------
+static int _config_remove(t_configuration *cfg, const char *name){
+#ifdef WIN32
+	char path[CONFIGURATION_PATH_MAX];
+	_config_path(cfg, path, sizeof(path), name);
+	return remove(path);
+#else
+	return unlinkat(_configdir_fd(cfg), name, 0);
+#endif
+}
+//---------------------------------------------------------------------------
+static int _value_equal(t_config_value a, t_config_value b){
+	if(a == b){
+		return 1;
+	}
+	// snapshot strings are not interned with the others
+	return _value_type(a) == CONFIGURATION_VAL_STR && _value_type(b) == CONFIGURATION_VAL_STR
+		&& strcmp(_value_str(a), _value_str(b)) == 0;
+}
+//---------------------------------------------------------------------------
+static int _key_compare(const void *a, const void *b){
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+//---------------------------------------------------------------------------
+/*
+ * Sort keys and drop repeated ones.
+ *
+ * \return number of distinct keys.
+ */
+static int _keys_unique(const char **keys, int num_keys){
+	if(!num_keys){
+		// keys may be NULL, which qsort must not be given
+		return 0;
+	}
+	qsort(keys, num_keys, sizeof(const char *), _key_compare);
+	int num_unique = 0;
+	for(int i = 0; i < num_keys; i++){
+		if(!num_unique || strcmp(keys[num_unique - 1], keys[i]) != 0){
+			keys[num_unique++] = keys[i];
+		}
+	}
+	return num_unique;
+}
+//---------------------------------------------------------------------------
+/*
+ * Remember that the interned key changed, for subscribers to be told by
+ * _notify. Caller must hold the writer lock.
+ */
+static void _changed(t_configuration *cfg, const char *key){
+	if(!atomic_load_explicit(&cfg->subscriptions, memory_order_relaxed)){
+		return;
+	}
+	int num_changed = atomic_load_explicit(&cfg->num_changed, memory_order_relaxed);
+	if(num_changed == cfg->changed_size){
+		// a burst of sets repeats keys, only grow for distinct ones
+		num_changed = _keys_unique(cfg->changed_keys, num_changed);
+		if(num_changed * 2 >= cfg->changed_size){
+			int changed_size = cfg->changed_size ? cfg->changed_size * 2 : 16;
+			const char **changed_keys = realloc(cfg->changed_keys, changed_size * sizeof(const char *));
+			if(!changed_keys){
+				_log(cfg, CONFIGURATION_LOG_ERROR, "No more space for configuration changes.");
+				atomic_store(&cfg->num_changed, num_changed);
+				return;
+			}
+			cfg->changed_keys = changed_keys;
+			cfg->changed_size = changed_size;
+		}
+	}
+	cfg->changed_keys[num_changed] = key;
+	atomic_store(&cfg->num_changed, num_changed + 1);
+}
+//---------------------------------------------------------------------------
+/*
+ * Remember the keys whose values differ between the published table and the
+ * table about to replace it. Caller must hold the writer lock.
+ */
+static void _changes_diff(t_configuration *cfg, t_config_table *old, t_config_table *table){
+	if(!atomic_load_explicit(&cfg->subscriptions, memory_order_relaxed)){
+		return;
+	}
+	int num_items = atomic_load_explicit(&table->num_items, memory_order_relaxed);
+	for(int i = 0; i < num_items; i++){
+		const char *key = table->items[i].key;
+		if(key){
+			int j = _table_find(old, key);
+			if(j < 0 || !_value_equal(atomic_load_explicit(&old->items[j].val, memory_order_relaxed), atomic_load_explicit(&table->items[i].val, memory_order_relaxed))){
+				_changed(cfg, key);
+			}
+		}
+	}
+	// removed keys
+	num_items = old ? atomic_load_explicit(&old->num_items, memory_order_relaxed) : 0;
+	for(int i = 0; i < num_items; i++){
+		if(old->items[i].key && _table_find(table, old->items[i].key) < 0){
+			_changed(cfg, old->items[i].key);
+		}
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Tell subscribers about the remembered changes. Call without holding the
+ * writer lock. Only one thread delivers at a time, other threads leave their
+ * changes to it, so changes made during a delivery arrive together in the
+ * next one.
+ */
+static void _notify(t_configuration *cfg){
+	if(!atomic_load_explicit(&cfg->subscriptions, memory_order_acquire)){
+		return;
+	}
+	while(atomic_load(&cfg->num_changed) && !atomic_exchange(&cfg->notifying, 1)){
+		pthread_mutex_lock(&cfg->lock);
+		const char **keys = cfg->changed_keys;
+		int num_keys = atomic_load(&cfg->num_changed);
+		cfg->changed_keys = NULL;
+		cfg->changed_size = 0;
+		atomic_store(&cfg->num_changed, 0);
+		t_subscription *subscriptions = atomic_load(&cfg->subscriptions);
+		pthread_mutex_unlock(&cfg->lock);
+
+		num_keys = _keys_unique(keys, num_keys);
+		const char **matches = malloc(num_keys * sizeof(const char *));
+		for(t_subscription *subscription = subscriptions; matches && subscription; subscription = subscription->next){
+			if(!atomic_load(&subscription->active)){
+				continue;
+			}
+			size_t prefix_len = strlen(subscription->prefix);
+			int num_matches = 0;
+			for(int i = 0; i < num_keys; i++){
+				if(strncmp(keys[i], subscription->prefix, prefix_len) == 0){
+					matches[num_matches++] = keys[i];
+				}
+			}
+			if(num_matches){
+				subscription->callback(cfg, matches, num_matches, subscription->ctx);
+			}
+		}
+		free(matches);
+		free(keys);
+		atomic_store(&cfg->notifying, 0);
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Append a new item for key with value and add it to the index of the published table.
+ * Caller must hold the writer lock.
+ *
+ * \return index of the new item or -1 if storage could not grow.
+ */
+static int _item_add(t_configuration *cfg, const char *key, t_config_value value){
+	const char *interned = _string_intern(cfg, key);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	int i = table ? atomic_load_explicit(&table->num_items, memory_order_relaxed) : 0;
+	if(interned){
+		table = _table_reserve_published(cfg, i + 1);
+	}
+	if(!interned || !table){
+		_log(cfg, CONFIGURATION_LOG_ERROR, "No more space in configuration for %s.", key);
+		return -1;
+	}
+	// fill in the item before readers can reach it through the index
+	table->items[i].key = interned;
+	atomic_store_explicit(&table->items[i].val, value, memory_order_relaxed);
+	_index_insert(table, i);
+	atomic_store_explicit(&table->num_items, i + 1, memory_order_release);
+	// queries sort again every CONFIGURATION_SORTED_TAIL new keys
+	t_config_sorted *sorted = atomic_load_explicit(&table->sorted, memory_order_acquire);
+	if(sorted && sorted->older){
+		_sorted_reclaim(table, _epoch_oldest());
+	}
+	return i;
+}
+//---------------------------------------------------------------------------
+#ifndef WIN32
+/*
+ * Open the journal for appending. A record cut short by a crash is dropped,
+ * so the next record starts on a line of its own. Caller must hold the
+ * writer lock.
+ *
+ * \return 1 if open.
+ */
+static int _journal_open(t_configuration *cfg){
+	if(cfg->journal_fd >= 0){
+		return 1;
+	}
+	if(!cfg->configdirok && !_configdir_init(cfg, 1)){
+		return 0;
+	}
+	char journalname[CONFIGURATION_NAME_MAX];
+	if(!_config_name(cfg, journalname, cfg->filename, CONFIGURATION_JOURNAL_SUFFIX)){
+		return 0;
+	}
+	int fd = _config_open(cfg, journalname, O_RDWR | O_APPEND | O_CREAT);
+	if(fd < 0){
+		_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to open configuration journal.");
+		return 0;
+	}
+
+	// find the end of the last complete record
+	off_t size = lseek(fd, 0, SEEK_END);
+	off_t end = size;
+	char buf[256];
+	while(end > 0){
+		ssize_t n = end < (off_t)sizeof(buf) ? end : (off_t)sizeof(buf);
+		if(pread(fd, buf, n, end - n) != n){
+			end = -1;
+			break;
+		}
+		while(n > 0 && buf[n - 1] != '\n'){
+			n--;
+			end--;
+		}
+		if(n > 0){
+			break;
+		}
+	}
+	if(size < 0 || end < 0 || (end != size && ftruncate(fd, end) != 0)){
+		_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to read configuration journal.");
+		close(fd);
+		return 0;
+	}
+	cfg->journal_fd = fd;
+	cfg->journal_size = end;
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Get the text of value as it is written to the config file. Numbers are
+ * formatted into buf.
+ */
+static const char *_value_text(char *buf, size_t size, t_config_value value){
+	switch(_value_type(value)){
+		case CONFIGURATION_VAL_INT:
+			snprintf(buf, size, "%d", _value_int(value));
+			return buf;
+		case CONFIGURATION_VAL_FLOAT:
+			_value_format_float(buf, size, _value_float(value));
+			return buf;
+		default:
+			return _value_str(value);
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Append len bytes of complete records to the journal with a single write.
+ * Caller must hold the writer lock.
+ *
+ * \return 1 if appended.
+ */
+static int _journal_write(t_configuration *cfg, const struct iovec *records, int num_records, size_t len){
+	if(!_journal_open(cfg)){
+		return 0;
+	}
+	if(writev(cfg->journal_fd, records, num_records) != (ssize_t)len){
+		// drop a partial record
+		if(ftruncate(cfg->journal_fd, cfg->journal_size) != 0){
+			_journal_close(cfg);
+		}
+		_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to append to configuration journal.");
+		return 0;
+	}
+	cfg->journal_size += len;
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Append a record setting key to value to the journal. Caller must hold the
+ * writer lock.
+ *
+ * \return 1 if appended or journaling is off.
+ */
+static int _journal_append(t_configuration *cfg, const char *key, t_config_value value){
+	if(!cfg->use_journal){
+		return 1;
+	}
+	char buf[64];
+	const char *str = _value_text(buf, sizeof(buf), value);
+	struct iovec record[4] = {
+		{ (void *)key, strlen(key) },
+		{ " ", 1 },
+		{ (void *)str, strlen(str) },
+		{ "\n", 1 }
+	};
+	return _journal_write(cfg, record, 4, record[0].iov_len + record[2].iov_len + 2);
+}
+#endif
+//---------------------------------------------------------------------------
+/*
+ * Check whether sets by the calling thread are staged in a transaction.
+ * Caller must hold the writer lock.
+ */
+static int _txn_owned(t_configuration *cfg){
+	return cfg->txn_active && pthread_equal(cfg->txn_owner, pthread_self());
+}
+//---------------------------------------------------------------------------
+/*
+ * Stage a set of the item at index, or of a new key when index is -1, until
+ * the transaction is committed. Caller must hold the writer lock.
+ *
+ * \return 1 if staged.
+ */
+static int _txn_stage(t_configuration *cfg, const char *key, int index, t_config_value value){
+	if(cfg->txn_num_sets == cfg->txn_sets_size){
+		int size = cfg->txn_sets_size ? 2 * cfg->txn_sets_size : CONFIGURATION_ITEMS_INITIAL;
+		t_txn_set *sets = realloc(cfg->txn_sets, size * sizeof(t_txn_set));
+		if(!sets){
+			_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration transaction.");
+			return 0;
+		}
+		cfg->txn_sets = sets;
+		cfg->txn_sets_size = size;
+	}
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	cfg->txn_sets[cfg->txn_num_sets++] = (t_txn_set){ key, index, table ? table->generation : 0, value };
+	if(index < 0){
+		cfg->txn_num_new++;
+	}
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Check whether key and value would be saved as a line that reads back as a
+ * [section] line, which is what a key of the form [name] with an empty value
+ * looks like, see _line_split.
+ */
+static int _entry_is_section(const char *key, t_config_value value){
+	if(!key || _value_type(value) != CONFIGURATION_VAL_STR || *_value_str(value)){
+		return 0;
+	}
+	size_t len = strlen(key);
+	return len >= 2 && key[0] == '[' && key[len - 1] == ']' && strcspn(key + 1, " \t\r\n[]") == len - 2;
+}
+//---------------------------------------------------------------------------
+/*
+ * Store value for key in the published table, adding the key if it is new.
+ * Caller must hold the writer lock.
+ *
+ * \return 1 if stored.
+ */
+static int _item_set(t_configuration *cfg, const char *key, t_config_value value){
+	CONFIGURATION_COUNT(cfg, sets);
+	if(_entry_is_section(key, value)){
+		_error_str(cfg, CONFIGURATION_ERROR_INVALID, "Configuration key %s can not have an empty value.", key);
+		return 0;
+	}
+	if(_txn_owned(cfg)){
+		// items stay at their index, so existing keys are only looked up once
+		t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+		int i = _table_find(table, key);
+		if(i >= 0){
+			return _txn_stage(cfg, table->items[i].key, i, value);
+		}
+		const char *interned = _string_intern(cfg, key);
+		return interned && _txn_stage(cfg, interned, -1, value);
+	}
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	int i = _table_find(table, key);
+#ifndef WIN32
+	if(i < 0 && cfg->use_journal){
+		// make room for a new item first, so the journal only holds sets that are stored
+		int num_items = table ? atomic_load_explicit(&table->num_items, memory_order_relaxed) : 0;
+		if(!_string_intern(cfg, key) || !_table_reserve_published(cfg, num_items + 1)){
+			_log(cfg, CONFIGURATION_LOG_ERROR, "No more space in configuration for %s.", key);
+			return 0;
+		}
+	}
+	if(!_journal_append(cfg, key, value)){
+		return 0;
+	}
+#endif
+	if(i < 0){ //add new item
+		i = _item_add(cfg, key, value);
+		if(i < 0){
+			return 0;
+		}
+		_changed(cfg, atomic_load_explicit(&cfg->table, memory_order_relaxed)->items[i].key);
+	}
+	else{
+		t_config_value old = atomic_load_explicit(&table->items[i].val, memory_order_relaxed);
+		if(!_value_equal(old, value)){
+			_changed(cfg, table->items[i].key);
+		}
+		atomic_store_explicit(&table->items[i].val, value, memory_order_seq_cst);
+		_str_retire(cfg, old);
+	}
+	atomic_fetch_add_explicit(&cfg->changes, 1, memory_order_release);
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Store value at index of the published table. Caller must hold the writer lock.
+ *
+ * \return 1 if stored, 0 if index is out of bounds.
+ */
+static int _item_set_by_index(t_configuration *cfg, const unsigned int index, t_config_value value){
+	CONFIGURATION_COUNT(cfg, sets);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	if(!table || index >= (unsigned int)atomic_load_explicit(&table->num_items, memory_order_relaxed)){
+		_error_int(cfg, CONFIGURATION_ERROR_INDEX, "Configuration index %lld out of bounds.", index);
+		return 0;
+	}
+	if(_entry_is_section(table->items[index].key, value)){
+		_error_str(cfg, CONFIGURATION_ERROR_INVALID, "Configuration key %s can not have an empty value.", table->items[index].key);
+		return 0;
+	}
+	if(_txn_owned(cfg)){
+		return _txn_stage(cfg, table->items[index].key, index, value);
+	}
+#ifndef WIN32
+	// unused items are not saved, so not journaled either
+	if(table->items[index].key && !_journal_append(cfg, table->items[index].key, value)){
+		return 0;
+	}
+#endif
+	t_config_value old = atomic_load_explicit(&table->items[index].val, memory_order_relaxed);
+	if(table->items[index].key && !_value_equal(old, value)){
+		_changed(cfg, table->items[index].key);
+	}
+	atomic_store_explicit(&table->items[index].val, value, memory_order_seq_cst);
+	_str_retire(cfg, old);
+	atomic_fetch_add_explicit(&cfg->changes, 1, memory_order_release);
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Copy a string value to str, if str is given. Strings set at runtime are
+ * freed once replaced, so this has to be done before the read ends.
+ */
+static void _value_copy_str(t_config_value value, char *str, int size){
+	if(str && _value_type(value) == CONFIGURATION_VAL_STR){
+		snprintf(str, size, "%s", _value_str(value));
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Read the value of key from the published table without taking the writer
+ * lock. A string value is copied to str, if given.
+ *
+ * \return 1 if found.
+ */
+static int _value_find(t_configuration *cfg, const char *key, t_config_value *value, char *str, int size){
+	t_config_reader *reader = _read_begin(cfg);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_acquire);
+	int i = _table_find(table, key);
+	if(i >= 0){
+		*value = atomic_load_explicit(&table->items[i].val, memory_order_acquire);
+		_value_copy_str(*value, str, size);
+	}
+	_read_end(cfg, reader);
+	CONFIGURATION_COUNT(cfg, gets);
+	if(i < 0){
+		CONFIGURATION_COUNT(cfg, get_misses);
+	}
+	return i >= 0;
+}
+//---------------------------------------------------------------------------
+/*
+ * Read the value at index from the published table without taking the writer
+ * lock. A string value is copied to str, if given.
+ *
+ * \return 1 if index is in bounds.
+ */
+static int _value_at(t_configuration *cfg, const unsigned int index, t_config_value *value, char *str, int size){
+	t_config_reader *reader = _read_begin(cfg);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_acquire);
+	int found = table && index < (unsigned int)atomic_load_explicit(&table->num_items, memory_order_acquire);
+	if(found){
+		*value = atomic_load_explicit(&table->items[index].val, memory_order_acquire);
+		_value_copy_str(*value, str, size);
+	}
+	_read_end(cfg, reader);
+	CONFIGURATION_COUNT(cfg, gets);
+	if(!found){
+		CONFIGURATION_COUNT(cfg, get_misses);
+	}
+	return found;
+}
+//---------------------------------------------------------------------------
+static int _item_key_compare(const void *a, const void *b){
+	return strcmp((*(const t_config_item *const *)a)->key, (*(const t_config_item *const *)b)->key);
+}
+//---------------------------------------------------------------------------
+/*
+ * Get the key order of the first num_items items of a published table,
+ * merging the items added since the last sort into a new order once there
+ * are more than CONFIGURATION_SORTED_TAIL of them. Keys of items already
+ * published never change, so only the new items need sorting. Readers racing
+ * to sort keep whichever order is stored first.
+ *
+ * \return the sorted items, or NULL if none could be allocated.
+ */
+static t_config_sorted *_table_sorted(t_config_table *table, int num_items){
+	t_config_sorted *sorted = atomic_load_explicit(&table->sorted, memory_order_acquire);
+	int num_sorted = sorted ? sorted->num_items : 0;
+	if(sorted && num_items - num_sorted <= CONFIGURATION_SORTED_TAIL){
+		return sorted;
+	}
+	t_config_sorted *fresh = malloc(sizeof(t_config_sorted) + num_items * sizeof(t_config_item *));
+	if(!fresh){
+		return sorted;
+	}
+	atomic_init(&fresh->retired_epoch, 0);
+	fresh->num_items = num_items;
+	int num_added = 0;
+	for(int i = num_sorted; i < num_items; i++){
+		if(table->items[i].key){
+			fresh->items[num_added++] = &table->items[i];
+		}
+	}
+	qsort(fresh->items, num_added, sizeof(t_config_item *), _item_key_compare);
+	// merge the previous order in from the back, behind the new items
+	fresh->num_keys = num_added + (sorted ? sorted->num_keys : 0);
+	int old = fresh->num_keys - num_added - 1;
+	int added = num_added - 1;
+	int merged = fresh->num_keys - 1;
+	while(old >= 0){
+		if(added >= 0 && strcmp(fresh->items[added]->key, sorted->items[old]->key) > 0){
+			fresh->items[merged--] = fresh->items[added--];
+		}
+		else{
+			fresh->items[merged--] = sorted->items[old--];
+		}
+	}
+	fresh->older = sorted;
+	if(!atomic_compare_exchange_strong_explicit(&table->sorted, &fresh->older, fresh, memory_order_acq_rel, memory_order_acquire)){
+		sorted = fresh->older;
+		free(fresh);
+		return sorted;
+	}
+	if(sorted){
+		// readers that started before the replacement announce an older epoch
+		atomic_store(&sorted->retired_epoch, atomic_fetch_add(&configuration_epoch, 1));
+	}
+	return fresh;
+}
+//---------------------------------------------------------------------------
+static void _value_unpack(t_config_value packed, t_configuration_value *value){
+	value->type = _value_type(packed);
+	switch(value->type){
+		case CONFIGURATION_VAL_INT:
+			value->int_value = _value_int(packed);
+			break;
+		case CONFIGURATION_VAL_FLOAT:
+			value->float_value = _value_float(packed);
+			break;
+		default:
+			value->str_value = _value_str(packed);
+			break;
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Call callback with the key and value of item.
+ *
+ * \return what callback returned.
+ */
+static int _item_visit(t_configuration *cfg, const t_config_item *item, config_foreach_t *callback, void *ctx){
+	t_configuration_value value;
+	_value_unpack(atomic_load_explicit(&item->val, memory_order_acquire), &value);
+	return callback(cfg, item->key, &value, ctx);
+}
+//---------------------------------------------------------------------------
+/*
+ * Call callback for the items of the published table with keys starting with
+ * prefix, in key order. The sorted items matching prefix are found by binary
+ * search and merged with the matching items added since they were sorted.
+ *
+ * \return number of items passed to callback, or -1 if out of memory.
+ */
+static int _table_foreach_prefix(t_configuration *cfg, t_config_table *table, const char *prefix, config_foreach_t *callback, void *ctx){
+	int num_items = table ? atomic_load_explicit(&table->num_items, memory_order_acquire) : 0;
+	if(!num_items){
+		return 0;
+	}
+	t_config_sorted *sorted = _table_sorted(table, num_items);
+	size_t prefix_len = strlen(prefix);
+
+	// first sorted key not below prefix
+	int first = 0;
+	int last = sorted ? sorted->num_keys : 0;
+	while(first < last){
+		int middle = first + (last - first) / 2;
+		if(strcmp(sorted->items[middle]->key, prefix) < 0){
+			first = middle + 1;
+		}
+		else{
+			last = middle;
+		}
+	}
+
+	// matching items past the sorted ones
+	const t_config_item *tail_buffer[CONFIGURATION_SORTED_TAIL];
+	const t_config_item **tail = tail_buffer;
+	int num_tail = 0;
+	int tail_start = sorted ? sorted->num_items : 0;
+	if(num_items - tail_start > CONFIGURATION_SORTED_TAIL){
+		tail = malloc((num_items - tail_start) * sizeof(t_config_item *));
+		if(!tail){
+			_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration query.");
+			return -1;
+		}
+	}
+	for(int i = tail_start; i < num_items; i++){
+		if(table->items[i].key && strncmp(table->items[i].key, prefix, prefix_len) == 0){
+			tail[num_tail++] = &table->items[i];
+		}
+	}
+	qsort(tail, num_tail, sizeof(t_config_item *), _item_key_compare);
+
+	int num_visited = 0;
+	int t = 0;
+	int more = 1;
+	while(more){
+		const t_config_item *item = NULL;
+		if(sorted && first < sorted->num_keys && strncmp(sorted->items[first]->key, prefix, prefix_len) == 0){
+			item = sorted->items[first];
+		}
+		if(t < num_tail && (!item || strcmp(tail[t]->key, item->key) < 0)){
+			item = tail[t++];
+		}
+		else if(item){
+			first++;
+		}
+		else{
+			break;
+		}
+		num_visited++;
+		more = _item_visit(cfg, item, callback, ctx);
+	}
+	if(tail != tail_buffer){
+		free(tail);
+	}
+	return num_visited;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_init(configuration_t *cfg, const char *config_dirname, const char *config_filename){
+
+	if(!strlen(config_dirname)){
+		_error(cfg, CONFIGURATION_ERROR_INVALID, "Specified config dirname was empty.");
+		return 0;
+	}
+	if(!strlen(config_filename)){
+		_error(cfg, CONFIGURATION_ERROR_INVALID, "Specified config filename was empty.");
+		return 0;
+	}
+	if(strlen(config_dirname) >= sizeof(cfg->dirname)){
+		_error(cfg, CONFIGURATION_ERROR_INVALID, "Specified config dirname is too long.");
+		return 0;
+	}
+	if(strlen(config_filename) >= sizeof(cfg->filename)){
+		_error(cfg, CONFIGURATION_ERROR_INVALID, "Specified config filename is too long.");
+		return 0;
+	}
+	if(strcmp(cfg->dirname, config_dirname) != 0){
+		// the configdir found and opened for the previous dirname is not this one
+		_configdir_close(cfg);
+		cfg->configdirok = 0;
+	}
+	snprintf(cfg->dirname, sizeof(cfg->dirname), "%s", config_dirname);
+	snprintf(cfg->filename, sizeof(cfg->filename), "%s", config_filename);
+	_error_clear(cfg);
+#ifndef WIN32
+	// the journal belongs to the previous file
+	pthread_mutex_lock(&cfg->lock);
+	_journal_close(cfg);
+	_layers_free(cfg);
+	pthread_mutex_unlock(&cfg->lock);
+#endif
+	// the new file does not hold the current values yet
+	atomic_fetch_add(&cfg->changes, 1);
+	return _configdir_init(cfg, 1);
+}
+//---------------------------------------------------------------------------
+// default value of a mapping, converted to its type
+static t_config_value _mapping_default(t_configuration *cfg, const t_configuration_index_mapping *mapping){
+	t_config_value parsed = 0;
+	t_conf_val_type parsed_type = _value_parse(mapping->default_value, strnlen(mapping->default_value, CONFIGURATION_VAL_STR_LEN), &parsed);
+	const char *str_value;
+	switch(mapping->val_type){
+		case CONFIGURATION_VAL_INT:
+			return parsed_type == CONFIGURATION_VAL_INT ? parsed : _value_from_int(0);
+
+		case CONFIGURATION_VAL_FLOAT:
+			if(parsed_type == CONFIGURATION_VAL_INT){
+				return _value_from_float(_value_int(parsed));
+			}
+			return parsed_type == CONFIGURATION_VAL_FLOAT ? parsed : _value_from_float(0.0f);
+
+		default:
+			str_value = _string_intern(cfg, mapping->default_value);
+			return _value_from_str(str_value ? str_value : configuration_empty_str);
+	}
+}
+//---------------------------------------------------------------------------
+static t_config_value _schema_default(t_configuration *cfg, const t_configuration_schema_item *item){
+	const char *str_value;
+	switch(item->val_type){
+		case CONFIGURATION_VAL_INT:
+			return _value_from_int(item->int_default);
+		case CONFIGURATION_VAL_FLOAT:
+			return _value_from_float(item->float_default);
+		default:
+			str_value = _string_intern(cfg, item->str_default ? item->str_default : "");
+			return _value_from_str(str_value ? str_value : configuration_empty_str);
+	}
+}
+//---------------------------------------------------------------------------
+/*
+ * Put the keys of the mappings and the schema with their defaults at their
+ * indexes of the unpublished table, which has room for them. Caller must hold
+ * the writer lock.
+ *
+ * \return 1, or 0 if a key could not be stored.
+ */
+static int _table_defaults(t_configuration *cfg, t_config_table *table){
+	for(int i = 0; i < cfg->num_mappings; i++){
+		const t_configuration_index_mapping *mapping = &cfg->mappings[i];
+		const char *key = _string_intern(cfg, mapping->key);
+		if(!key){
+			return 0;
+		}
+		if(!table->items[mapping->index].key){
+			table->items[mapping->index].key = key;
+			_index_insert(table, mapping->index);
+		}
+		atomic_store_explicit(&table->items[mapping->index].val, _mapping_default(cfg, mapping), memory_order_relaxed);
+	}
+	for(unsigned int i = 0; cfg->schema && i < cfg->schema->num_items; i++){
+		const t_configuration_schema_item *item = &cfg->schema->items[i];
+		const char *key = _string_intern(cfg, item->key);
+		if(!key){
+			return 0;
+		}
+		if(!table->items[i].key){
+			table->items[i].key = key;
+			_index_insert(table, i);
+		}
+		atomic_store_explicit(&table->items[i].val, _schema_default(cfg, item), memory_order_relaxed);
+	}
+	return 1;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_init_indexes(configuration_t *cfg, const t_configuration_index_mapping mappings[], int num_mappings){
+	pthread_mutex_lock(&cfg->lock);
+	// the defaults beneath the system config files change
+	_layers_free(cfg);
+	t_configuration_index_mapping *new_mappings = realloc(cfg->mappings, num_mappings * sizeof(t_configuration_index_mapping));
+	if(num_mappings && !new_mappings){
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration mappings.");
+		pthread_mutex_unlock(&cfg->lock);
+		return 0;
+	}
+	cfg->mappings = new_mappings;
+	cfg->num_mappings = 0;
+
+	// mapped keys may replace keys of published items, so work on a copy
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	table = _table_copy(cfg, table, table ? atomic_load(&table->num_items) : 0, 0);
+	if(!table){
+		pthread_mutex_unlock(&cfg->lock);
+		return 0;
+	}
+	table->generation = ++cfg->generations;
+
+	for(int i = 0; i < num_mappings; i++){
+		if(strnlen(mappings[i].key, CONFIGURATION_KEY_MAX)){
+			const char *key = _string_intern(cfg, mappings[i].key);
+			t_config_table *grown = NULL;
+			if(key && mappings[i].index >= 0){
+				grown = _table_reserve(cfg, table, mappings[i].index + 1);
+			}
+			if(grown){
+				if(grown != table){
+					_table_free(table);
+					table = grown;
+				}
+				int index = mappings[i].index;
+				cfg->mappings[cfg->num_mappings++] = mappings[i];
+				table->items[index].key = key;
+				_index_insert(table, index);
+				if(index >= atomic_load(&table->num_items)){
+					atomic_store(&table->num_items, index + 1);
+				}
+				atomic_store(&table->items[index].val, _mapping_default(cfg, &mappings[i]));
+			}
+			else {
+				_error_int(cfg, CONFIGURATION_ERROR_INVALID, "Invalid mapping to index %lld.", mappings[i].index);
+				_log(cfg, CONFIGURATION_LOG_ERROR, "%s", configuration_ctx_get_error(cfg));
+			}
+		}
+	}
+
+	// loading resolves each new key to its mapping in one probe
+	_mappings_hash_free(cfg);
+	unsigned int *hashes = malloc(cfg->num_mappings * sizeof(unsigned int));
+	if(hashes){
+		for(int i = 0; i < cfg->num_mappings; i++){
+			hashes[i] = _index_hash(cfg->mappings[i].key);
+		}
+		_phash_create(hashes, cfg->num_mappings, &cfg->mapping_buckets, &cfg->mapping_displacements, &cfg->mapping_slots);
+		free(hashes);
+	}
+
+	_table_publish(cfg, table);
+	atomic_fetch_add_explicit(&cfg->changes, 1, memory_order_release);
+	pthread_mutex_unlock(&cfg->lock);
+	return 1;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_init_schema(configuration_t *cfg, const t_configuration_schema *schema){
+	pthread_mutex_lock(&cfg->lock);
+	_layers_free(cfg);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	int num_items = table ? atomic_load_explicit(&table->num_items, memory_order_relaxed) : 0;
+	if((int)schema->num_items > num_items){
+		num_items = schema->num_items;
+	}
+	// schema keys may replace keys of published items, so work on a copy
+	table = _table_copy(cfg, table, num_items, num_items);
+	if(!table){
+		pthread_mutex_unlock(&cfg->lock);
+		return 0;
+	}
+	table->generation = ++cfg->generations;
+
+	for(unsigned int i = 0; i < schema->num_items; i++){
+		const t_configuration_schema_item *item = &schema->items[i];
+		const char *key = _string_intern(cfg, item->key);
+		t_config_value value = _schema_default(cfg, item);
+		if(!key){
+			_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration schema.");
+			_table_free(table);
+			pthread_mutex_unlock(&cfg->lock);
+			return 0;
+		}
+		table->items[i].key = key;
+		_index_insert(table, i);
+		atomic_store_explicit(&table->items[i].val, value, memory_order_relaxed);
+	}
+	cfg->schema = schema;
+	_table_publish(cfg, table);
+	atomic_fetch_add_explicit(&cfg->changes, 1, memory_order_release);
+	pthread_mutex_unlock(&cfg->lock);
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Get the contents of the open file f, which is closed. Regular files are
+ * mapped, anything else is read into a buffer. Either way the contents are followed by a NUL
+ * byte, so parsing can not run past the end of the data.
+ *
+ * \return contents, to be released with _file_release, or NULL if the file could not be read.
+ */
+static char *_file_read_stream(t_configuration *cfg, FILE *f, const char *name, size_t *size, int *mapped){
+	size_t capacity = 4096;
+#ifndef WIN32
+	struct stat st;
+	if(fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+		// the mapping is only terminated if the last page has a zero filled tail
+		if(st.st_size % sysconf(_SC_PAGESIZE) != 0){
+			char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+			if(data != MAP_FAILED){
+				madvise(data, st.st_size, MADV_SEQUENTIAL);
+				fclose(f);
+				*size = st.st_size;
+				*mapped = 1;
+				return data;
+			}
+		}
+		capacity = st.st_size + 1;
+	}
+#endif
+
+	char *data = malloc(capacity);
+	size_t len = 0;
+	while(data){
+		len += fread(data + len, 1, capacity - len - 1, f);
+		if(len < capacity - 1){
+			break;
+		}
+		capacity *= 2;
+		char *grown = realloc(data, capacity);
+		if(!grown){
+			free(data);
+		}
+		data = grown;
+	}
+	if(!data || ferror(f)){
+		_error_str(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to read configfile %s.", name);
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	data[len] = '\0';
+	*size = len;
+	*mapped = 0;
+	return data;
+}
+//---------------------------------------------------------------------------
+static char *_file_read(t_configuration *cfg, const char *name, size_t *size, int *mapped){
+	FILE *f = _config_fopen(cfg, name, "r");
+	if(!f){
+		_error_str(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to open configfile %s.", name);
+		return NULL;
+	}
+	return _file_read_stream(cfg, f, name, size, mapped);
+}
+//---------------------------------------------------------------------------
+static void _file_release(char *data, size_t size, int mapped){
+#ifndef WIN32
+	if(mapped){
+		munmap(data, size);
+		return;
+	}
+#endif
+	free(data);
+}
+//---------------------------------------------------------------------------
+#ifndef WIN32
+/*
+ * Hash len bytes at data, a word at a time. Only used to notice changes, not
+ * for security.
+ */
+static uint64_t _snapshot_hash(const void *data, size_t len){
+	const unsigned char *p = data;
+	uint64_t hash = 0xcbf29ce484222325ull ^ len;
+	for(; len >= 8; p += 8, len -= 8){
+		uint64_t word;
+		memcpy(&word, p, 8);
+		hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ull;
+	}
+	uint64_t word = 0;
+	memcpy(&word, p, len);
+	hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ull;
+	return hash ^ hash >> 32;
+}
+//---------------------------------------------------------------------------
+static uint64_t _snapshot_mappings_hash(t_configuration *cfg){
+	uint64_t hash = _snapshot_hash(&cfg->num_mappings, sizeof(cfg->num_mappings));
+	for(int i = 0; i < cfg->num_mappings; i++){
+		t_configuration_index_mapping *mapping = &cfg->mappings[i];
+		uint64_t fields[5] = {
+			hash,
+			_snapshot_hash(mapping->key, strnlen(mapping->key, CONFIGURATION_KEY_MAX)),
+			(uint64_t)mapping->index,
+			(uint64_t)mapping->val_type,
+			_snapshot_hash(mapping->default_value, strnlen(mapping->default_value, CONFIGURATION_VAL_STR_LEN))
+		};
+		hash = _snapshot_hash(fields, sizeof(fields));
+	}
+	const t_configuration_schema *schema = cfg->schema;
+	for(unsigned int i = 0; schema && i < schema->num_items; i++){
+		const t_configuration_schema_item *item = &schema->items[i];
+		// snapshots hold the defaults of the items missing from the file
+		uint32_t float_bits;
+		memcpy(&float_bits, &item->float_default, sizeof(float_bits));
+		const char *str_default = item->str_default ? item->str_default : "";
+		uint64_t fields[6] = {
+			hash,
+			_snapshot_hash(item->key, strlen(item->key)),
+			(uint64_t)item->val_type,
+			(uint64_t)(uint32_t)item->int_default,
+			float_bits,
+			_snapshot_hash(str_default, strlen(str_default))
+		};
+		hash = _snapshot_hash(fields, sizeof(fields));
+	}
+	return hash;
+}
+//---------------------------------------------------------------------------
+/*
+ * Find the intern table slot holding str itself.
+ *
+ * \return slot position or -1 if str is not interned.
+ */
+static long _string_slot_find(t_configuration *cfg, const char *str){
+	if(!cfg->string_slots_size){
+		return -1;
+	}
+	unsigned int mask = cfg->string_slots_size - 1;
+	for(unsigned int pos = _index_hash(str) & mask; cfg->string_slots[pos].str; pos = (pos + 1) & mask){
+		if(cfg->string_slots[pos].str == str){
+			return pos;
+		}
+	}
+	return -1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Write a snapshot of table to path, replacing any previous snapshot.
+ * Snapshots are only a cache, so failures are not reported.
+ */
+static void _snapshot_write(t_configuration *cfg, t_config_table *table, const char *name, const t_snapshot_header *source){
+	uint32_t num_items = atomic_load_explicit(&table->num_items, memory_order_relaxed);
+	uint32_t *offsets = malloc(cfg->string_slots_size * sizeof(uint32_t));
+	if(!offsets){
+		return;
+	}
+
+	// every interned string goes in, each aligned so it can be tagged when used
+	uint64_t strings_size = 0;
+	for(unsigned int i = 0; i < cfg->string_slots_size; i++){
+		if(cfg->string_slots[i].str){
+			strings_size = (strings_size + CONFIGURATION_STRING_ALIGN - 1) & ~(uint64_t)(CONFIGURATION_STRING_ALIGN - 1);
+			offsets[i] = strings_size;
+			strings_size += strlen(cfg->string_slots[i].str) + 1;
+		}
+	}
+	strings_size = (strings_size + 7) & ~(uint64_t)7;
+
+	size_t items_bytes = num_items * sizeof(t_snapshot_item);
+	size_t index_bytes = table->index_size * sizeof(t_config_index_slot);
+	size_t strings_bytes = cfg->string_slots_size * sizeof(t_snapshot_string);
+	size_t payload_size = items_bytes + index_bytes + strings_bytes + strings_size;
+	char *payload = strings_size < UINT32_MAX ? calloc(1, payload_size) : NULL;
+	if(!payload){
+		free(offsets);
+		return;
+	}
+	t_snapshot_item *items = (t_snapshot_item *)payload;
+	t_snapshot_string *strings = (t_snapshot_string *)(payload + items_bytes + index_bytes);
+	char *string_data = payload + items_bytes + index_bytes + strings_bytes;
+
+	for(uint32_t i = 0; i < num_items; i++){
+		t_config_value value = atomic_load_explicit(&table->items[i].val, memory_order_relaxed);
+		items[i].key = UINT32_MAX;
+		items[i].type = _value_type(value);
+		items[i].value = value;
+		long key_slot = table->items[i].key ? _string_slot_find(cfg, table->items[i].key) : -2;
+		long value_slot = _value_type(value) == CONFIGURATION_VAL_STR ? _string_slot_find(cfg, _value_str(value)) : -2;
+		if(key_slot == -1 || value_slot == -1){
+			// not from the arena, so it can not be written
+			free(payload);
+			free(offsets);
+			return;
+		}
+		if(key_slot >= 0){
+			items[i].key = offsets[key_slot];
+		}
+		if(value_slot >= 0){
+			items[i].value = offsets[value_slot];
+		}
+	}
+	memcpy(payload + items_bytes, table->index, index_bytes);
+	for(unsigned int i = 0; i < cfg->string_slots_size; i++){
+		strings[i].hash = cfg->string_slots[i].hash;
+		strings[i].offset = UINT32_MAX;
+		if(cfg->string_slots[i].str){
+			strings[i].offset = offsets[i];
+			strcpy(string_data + offsets[i], cfg->string_slots[i].str);
+		}
+	}
+	free(offsets);
+
+	t_snapshot_header header = *source;
+	memcpy(header.magic, CONFIGURATION_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = CONFIGURATION_SNAPSHOT_VERSION;
+	header.header_size = sizeof(t_snapshot_header);
+	header.num_items = num_items;
+	header.items_size = table->items_size;
+	header.index_size = table->index_size;
+	header.num_strings = cfg->num_strings;
+	header.string_slots_size = cfg->string_slots_size;
+	header.strings_size = strings_size;
+	header.checksum = _snapshot_hash(payload, payload_size);
+
+	// write beside the snapshot and rename, so readers never see a partial snapshot
+	char tmpname[CONFIGURATION_NAME_MAX];
+	FILE *f = _config_name(cfg, tmpname, name, ".tmp") ? _config_fopen(cfg, tmpname, "w") : NULL;
+	if(f){
+		int ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(payload, payload_size, 1, f) == 1;
+		if(fclose(f) == 0 && ok){
+			_config_rename(cfg, tmpname, name);
+		}
+		else{
+			_config_remove(cfg, tmpname);
+		}
+	}
+	free(payload);
+}
+//---------------------------------------------------------------------------
+/*
+ * Build a table from the snapshot at path if it was made from the text file
+ * described by source. A fresh context uses the strings in place from the
+ * mapped snapshot, which stays mapped until reset. Later loads copy the
+ * strings into the arena and unmap the snapshot, so reloads do not keep a
+ * mapping each. Caller must hold the writer lock.
+ *
+ * \return the table, or NULL if the snapshot is missing, stale or corrupt.
+ */
+static t_config_table *_snapshot_load(t_configuration *cfg, const char *name, const t_snapshot_header *source){
+	int fd = _config_open(cfg, name, O_RDONLY);
+	if(fd < 0){
+		return NULL;
+	}
+	struct stat st;
+	char *base = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(t_snapshot_header)){
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if(base == MAP_FAILED){
+		return NULL;
+	}
+	size_t size = st.st_size;
+
+	const t_snapshot_header *header = (const t_snapshot_header *)base;
+	int valid = memcmp(header->magic, CONFIGURATION_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+		&& header->version == CONFIGURATION_SNAPSHOT_VERSION
+		&& header->header_size == sizeof(t_snapshot_header)
+		&& header->text_size == source->text_size
+		&& header->text_mtime_sec == source->text_mtime_sec
+		&& header->text_mtime_nsec == source->text_mtime_nsec
+		&& header->text_hash == source->text_hash
+		&& header->mappings_hash == source->mappings_hash;
+
+	// sizes must describe a table this code could have built and fill the file exactly
+	uint32_t items_size = header->items_size;
+	uint32_t index_size = header->index_size;
+	valid = valid && items_size >= CONFIGURATION_ITEMS_INITIAL && items_size <= (1u << 28) && (items_size & (items_size - 1)) == 0
+		&& index_size >= 2 * items_size && index_size <= (1u << 29) && (index_size & (index_size - 1)) == 0
+		&& header->num_items <= items_size
+		&& header->string_slots_size <= (1u << 29) && (header->string_slots_size & (header->string_slots_size - 1)) == 0
+		&& 2 * header->num_strings <= header->string_slots_size
+		&& header->strings_size < UINT32_MAX && header->strings_size % 8 == 0;
+	size_t items_bytes = valid ? header->num_items * sizeof(t_snapshot_item) : 0;
+	size_t index_bytes = valid ? index_size * sizeof(t_config_index_slot) : 0;
+	size_t strings_bytes = valid ? header->string_slots_size * sizeof(t_snapshot_string) : 0;
+	size_t payload_size = items_bytes + index_bytes + strings_bytes + header->strings_size;
+	valid = valid && size == sizeof(t_snapshot_header) + payload_size
+		&& _snapshot_hash(base + sizeof(t_snapshot_header), payload_size) == header->checksum;
+
+	const t_snapshot_item *items = (const t_snapshot_item *)(base + sizeof(t_snapshot_header));
+	const t_config_index_slot *index = (const t_config_index_slot *)((const char *)items + items_bytes);
+	const t_snapshot_string *strings = (const t_snapshot_string *)((const char *)index + index_bytes);
+	const char *string_data = (const char *)strings + strings_bytes;
+	uint64_t strings_size = header->strings_size;
+
+	// offsets must point at terminated, aligned strings
+	valid = valid && (strings_size == 0 || string_data[strings_size - 1] == '\0');
+	for(uint32_t i = 0; valid && i < header->num_items; i++){
+		valid = (items[i].key == UINT32_MAX || (items[i].key < strings_size && items[i].key % CONFIGURATION_STRING_ALIGN == 0))
+			&& items[i].type <= CONFIGURATION_VAL_STR
+			&& (items[i].type != CONFIGURATION_VAL_STR || (items[i].value < strings_size && items[i].value % CONFIGURATION_STRING_ALIGN == 0));
+	}
+	for(uint32_t i = 0; valid && i < index_size; i++){
+		unsigned int item = atomic_load_explicit(&index[i].item, memory_order_relaxed);
+		valid = item <= header->num_items && (item == 0 || items[item - 1].key != UINT32_MAX);
+	}
+	uint32_t num_strings = 0;
+	for(uint32_t i = 0; valid && i < header->string_slots_size; i++){
+		if(strings[i].offset != UINT32_MAX){
+			valid = strings[i].offset < strings_size;
+			num_strings++;
+		}
+	}
+	valid = valid && num_strings == header->num_strings;
+
+	// a fresh context takes the intern table as it is, otherwise strings are interned one by one
+	int in_place = valid && cfg->num_strings == 0 && header->num_strings > 0;
+	t_config_table *table = NULL;
+	t_snapshot_map *map = NULL;
+	t_string_slot *string_slots = NULL;
+	if(valid){
+		table = calloc(1, sizeof(t_config_table));
+		if(table){
+			table->items = calloc(items_size, sizeof(t_config_item));
+			table->index = malloc(index_bytes);
+		}
+		if(in_place){
+			map = malloc(sizeof(t_snapshot_map));
+			string_slots = calloc(header->string_slots_size, sizeof(t_string_slot));
+		}
+	}
+	if(!table || !table->items || !table->index || (in_place && (!map || !string_slots))){
+		free(string_slots);
+		_table_free(table);
+		free(map);
+		munmap(base, size);
+		return NULL;
+	}
+
+	table->items_size = items_size;
+	table->index_size = index_size;
+	table->generation = ++cfg->generations;
+	for(uint32_t i = 0; i < header->num_items; i++){
+		const char *key = items[i].key == UINT32_MAX ? NULL : string_data + items[i].key;
+		const char *str = items[i].type == CONFIGURATION_VAL_STR ? string_data + items[i].value : NULL;
+		if(!in_place && ((key && !(key = _string_intern(cfg, key))) || (str && !(str = _string_intern(cfg, str))))){
+			_table_free(table);
+			munmap(base, size);
+			return NULL;
+		}
+		table->items[i].key = key;
+		atomic_init(&table->items[i].val, str ? _value_from_str(str) : items[i].value);
+	}
+	atomic_init(&table->num_items, header->num_items);
+	memcpy(table->index, index, index_bytes);
+
+	if(!in_place){
+		munmap(base, size);
+		return table;
+	}
+	// the snapshot strings become the intern table so later sets share them
+	for(uint32_t i = 0; i < header->string_slots_size; i++){
+		string_slots[i].hash = strings[i].hash;
+		string_slots[i].str = strings[i].offset == UINT32_MAX ? NULL : string_data + strings[i].offset;
+	}
+	free(cfg->string_slots);
+	cfg->string_slots = string_slots;
+	cfg->string_slots_size = header->string_slots_size;
+	cfg->num_strings = header->num_strings;
+
+	map->addr = base;
+	map->size = size;
+	map->next = cfg->snapshots;
+	cfg->snapshots = map;
+	return table;
+}
+#endif
+//---------------------------------------------------------------------------
+/*
+ * Get the index key is mapped to by the schema or the index mappings.
+ *
+ * \return mapped index, or -1 if key is not mapped.
+ */
+static int _mapping_index(t_configuration *cfg, const char *key){
+	const t_configuration_schema *schema = cfg->schema;
+	if(schema){
+		int i = _phash_find(schema->displacements, schema->num_buckets, schema->slots, schema->num_items, _index_hash(key));
+		if(i >= 0 && strcmp(schema->items[i].key, key) == 0){
+			return i;
+		}
+	}
+	if(cfg->mapping_slots){
+		int i = _phash_find(cfg->mapping_displacements, cfg->mapping_buckets, cfg->mapping_slots, cfg->num_mappings, _index_hash(key));
+		return i >= 0 && strcmp(cfg->mappings[i].key, key) == 0 ? cfg->mappings[i].index : -1;
+	}
+	// mapped more than once or sharing a hash, the first mapping wins
+	for(int i = 0; i < cfg->num_mappings; i++){
+		if(strcmp(cfg->mappings[i].key, key) == 0){
+			return cfg->mappings[i].index;
+		}
+	}
+	return -1;
+}
+//---------------------------------------------------------------------------
+static int _line_count(const char *data, size_t size){
+	int num_lines = 1;
+	for(const char *p = data; (p = memchr(p, '\n', data + size - p)); p++){
+		num_lines++;
+	}
+	return num_lines;
+}
+//---------------------------------------------------------------------------
+/*
+ * Find the first blank or newline from p, or end. Keys are usually short, so
+ * the vector versions test whole blocks at once and leave the rest of a
+ * block shorter than their width to the scalar loop.
+ */
+static const char *_scan_delim_scalar(const char *p, const char *end){
+	while(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'){
+		p++;
+	}
+	return p;
+}
+//---------------------------------------------------------------------------
+#ifdef CONFIGURATION_SCAN_X86
+static const char *_scan_delim_sse2(const char *p, const char *end){
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i nl = _mm_set1_epi8('\n');
+	for(; end - p >= 16; p += 16){
+		__m128i block = _mm_loadu_si128((const __m128i *)p);
+		__m128i delims = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, tab)),
+				_mm_or_si128(_mm_cmpeq_epi8(block, cr), _mm_cmpeq_epi8(block, nl)));
+		unsigned int mask = _mm_movemask_epi8(delims);
+		if(mask){
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return _scan_delim_scalar(p, end);
+}
+//---------------------------------------------------------------------------
+__attribute__((target("avx2")))
+static const char *_scan_delim_avx2(const char *p, const char *end){
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i nl = _mm256_set1_epi8('\n');
+	for(; end - p >= 32; p += 32){
+		__m256i block = _mm256_loadu_si256((const __m256i *)p);
+		__m256i delims = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, space), _mm256_cmpeq_epi8(block, tab)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(block, cr), _mm256_cmpeq_epi8(block, nl)));
+		unsigned int mask = _mm256_movemask_epi8(delims);
+		if(mask){
+			return p + __builtin_ctz(mask);
+		}
+	}
+	// a half block here rather than in _scan_delim_sse2, mixing in legacy SSE code after AVX stalls
+	if(end - p >= 16){
+		__m128i block = _mm_loadu_si128((const __m128i *)p);
+		__m128i delims = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(space)), _mm_cmpeq_epi8(block, _mm256_castsi256_si128(tab))),
+				_mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(cr)), _mm_cmpeq_epi8(block, _mm256_castsi256_si128(nl))));
+		unsigned int mask = _mm_movemask_epi8(delims);
+		if(mask){
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+	return _scan_delim_scalar(p, end);
+}
+#endif
+//---------------------------------------------------------------------------
+// widest delimiter scan the CPU supports, chosen by _scan_init
+static const char *(*configuration_scan_delim)(const char *p, const char *end) = _scan_delim_scalar;
+static pthread_once_t configuration_scan_once = PTHREAD_ONCE_INIT;
+
+static void _scan_init(){
+#ifdef CONFIGURATION_SCAN_X86
+	__builtin_cpu_init();
+	configuration_scan_delim = __builtin_cpu_supports("avx2") ? _scan_delim_avx2 : _scan_delim_sse2;
+#endif
+}
+//---------------------------------------------------------------------------
+// kinds of config file lines, see _line_split
+#define CONFIGURATION_LINE_BLANK	0
+#define CONFIGURATION_LINE_SECTION	1
+#define CONFIGURATION_LINE_ENTRY	2
+
+// words of a config file line, pointing into the line
+typedef struct s_config_line {
+	const char *key; // first word, or the name of a section
+	size_t key_len;
+	const char *value; // rest of the line without surrounding blanks
+	size_t value_len;
+} t_config_line;
+
+/*
+ * Split the line from p up to eol into its key and value, or the name of a
+ * [section] line. Only a line that is just [name], where name has no blanks or
+ * brackets, or just [], is a section line; any other line is an entry.
+ *
+ * \return kind of the line, CONFIGURATION_LINE_*.
+ */
+static int _line_split(const char *p, const char *eol, t_config_line *line){
+	// key is the first word, value is the rest of the line
+	const char *tmpkey = p;
+	while(tmpkey < eol && (*tmpkey == ' ' || *tmpkey == '\t' || *tmpkey == '\r')){
+		tmpkey++;
+	}
+	if(tmpkey == eol){
+		return CONFIGURATION_LINE_BLANK;
+	}
+	const char *keyend = configuration_scan_delim(tmpkey, eol);
+	const char *tmpval = keyend;
+	while(tmpval < eol && (*tmpval == ' ' || *tmpval == '\t' || *tmpval == '\r')){
+		tmpval++;
+	}
+	const char *valend = eol;
+	while(valend > tmpval && (valend[-1] == ' ' || valend[-1] == '\t' || valend[-1] == '\r')){
+		valend--;
+	}
+	// a section line is a single word, so the name has no blanks
+	if(valend == tmpval && keyend - tmpkey >= 2 && *tmpkey == '[' && keyend[-1] == ']'){
+		const char *section = tmpkey + 1;
+		size_t section_len = keyend - 1 - section;
+		if(!memchr(section, '[', section_len) && !memchr(section, ']', section_len)){
+			line->key = section;
+			line->key_len = section_len;
+			return CONFIGURATION_LINE_SECTION;
+		}
+	}
+	line->key = tmpkey;
+	line->key_len = keyend - tmpkey;
+	line->value = tmpval;
+	line->value_len = valend - tmpval;
+	return CONFIGURATION_LINE_ENTRY;
+}
+//---------------------------------------------------------------------------
+/*
+ * Put the NUL terminated section.key of an entry after a section line into buffer.
+ *
+ * \return length of the key, or 0 if it does not fit.
+ */
+static size_t _section_key(char *buffer, size_t size, const char *section, size_t section_len, const char *key, size_t key_len){
+	if(section_len + 1 + key_len + 1 > size){
+		return 0;
+	}
+	memcpy(buffer, section, section_len);
+	buffer[section_len] = '.';
+	memcpy(buffer + section_len + 1, key, key_len);
+	buffer[section_len + 1 + key_len] = '\0';
+	return section_len + 1 + key_len;
+}
+//---------------------------------------------------------------------------
+/*
+ * Parse the key value lines of data into the unpublished table. Keys after a
+ * [section] line are read as section.key until the next section line, and []
+ * goes back to plain keys. Callers reserve room for one item per line first.
+ *
+ * \return the table, which may have been replaced by a larger one.
+ */
+static t_config_table *_table_parse_lines(t_configuration *cfg, t_config_table *table, const char *fqconfigname, const char *data, size_t size){
+	int num_items = atomic_load_explicit(&table->num_items, memory_order_relaxed);
+	const char *section = NULL;
+	size_t section_len = 0;
+	char section_key[CONFIGURATION_SECTION_KEY_MAX];
+	pthread_once(&configuration_scan_once, _scan_init);
+
+	// tokenize in place, keys and string values are copied once into the arena
+	const char *end = data + size;
+	const char *next;
+	int line = 0;
+	for(const char *p = data; p < end; p = next){
+		const char *eol = memchr(p, '\n', end - p);
+		if(!eol){
+			eol = end;
+		}
+		next = eol + 1;
+
+		t_config_line tokens;
+		int kind = _line_split(p, eol, &tokens);
+		if(kind == CONFIGURATION_LINE_BLANK){
+			continue;
+		}
+		if(kind == CONFIGURATION_LINE_SECTION){
+			section = tokens.key;
+			section_len = tokens.key_len;
+			continue;
+		}
+		const char *tmpval = tokens.value;
+		size_t vallen = tokens.value_len;
+		line++;
+
+		const char *key;
+		if(section_len){
+			size_t key_len = _section_key(section_key, sizeof(section_key), section, section_len, tokens.key, tokens.key_len);
+			if(!key_len){
+				_log(cfg, CONFIGURATION_LOG_ERROR, "Key of entry %d from %s is too long.", line, fqconfigname);
+				CONFIGURATION_COUNT(cfg, parse_errors);
+				continue;
+			}
+			key = _string_intern_len(cfg, section_key, key_len);
+		}
+		else{
+			key = _string_intern_len(cfg, tokens.key, tokens.key_len);
+		}
+		if(!key){
+			_log(cfg, CONFIGURATION_LOG_ERROR, "No more space in configuration for entry %d from %s.", line, fqconfigname);
+			CONFIGURATION_COUNT(cfg, parse_errors);
+			continue;
+		}
+
+		// repeated keys overwrite the earlier entry
+		int insert_index = _table_find(table, key);
+		if(insert_index < 0){
+			// if key matches a mapping, insert in mapped position
+			insert_index = _mapping_index(cfg, key);
+			if(insert_index < 0){
+				insert_index = num_items;
+			}
+			t_config_table *grown = _table_reserve(cfg, table, insert_index + 1);
+			if(!grown){
+				_log(cfg, CONFIGURATION_LOG_ERROR, "No more space in configuration for entry %d from %s.", line, fqconfigname);
+				CONFIGURATION_COUNT(cfg, parse_errors);
+				continue;
+			}
+			if(grown != table){
+				_table_free(table);
+				table = grown;
+			}
+
+			table->items[insert_index].key = key;
+			_index_insert(table, insert_index);
+			if(insert_index == num_items){
+				num_items = num_items + 1;
+			}
+		}
+
+		// convert tmpval
+		t_config_value value;
+		if(_value_parse(tmpval, vallen, &value) == CONFIGURATION_VAL_STR){
+			// if not int or float, assume string
+			const char *str_value = _string_intern_len(cfg, tmpval, vallen);
+			value = _value_from_str(str_value ? str_value : configuration_empty_str);
+		}
+		atomic_store_explicit(&table->items[insert_index].val, value, memory_order_relaxed);
+	}
+	atomic_store_explicit(&table->num_items, num_items, memory_order_relaxed);
+	return table;
+}
+//---------------------------------------------------------------------------
+/*
+ * Parse the size bytes of config file text at data into a new, unpublished
+ * table. The table starts with the items of the layers below the config file,
+ * or without layers the defaults of the mappings and the schema. data must be
+ * followed by a NUL byte. Caller must hold the writer lock.
+ *
+ * \return the new table, or NULL if the text is malformed.
+ */
+static t_config_table *_table_parse(t_configuration *cfg, const char *fqconfigname, const char *data, size_t size){
+	// a NUL byte means a binary or partially written file
+	const char *nul = memchr(data, '\0', size);
+	if(nul){
+		int line = 0;
+		for(const char *p = data; (p = memchr(p, '\n', nul - p)); p++){
+			line++;
+		}
+		_error_set(cfg, CONFIGURATION_ERROR_MALFORMED, "Configfile %s is malformed after line %lld.", fqconfigname, 1, line);
+		CONFIGURATION_COUNT(cfg, parse_errors);
+		return NULL;
+	}
+
+	// init configuration
+	int num_mapped_items = cfg->num_mappings;
+	// start non-indexed items after mappings
+	int num_items = 0;
+	for(int i = 0; i < num_mapped_items; i++){
+		if(cfg->mappings[i].index >= num_items){
+			num_items = cfg->mappings[i].index + 1;
+		}
+	}
+	if(cfg->schema && (int)cfg->schema->num_items > num_items){
+		num_items = cfg->schema->num_items;
+	}
+	// start from the layers below the config file, or the defaults, never from
+	// the published table, which holds values of the config file
+	t_config_table *source = cfg->layers_base;
+	if(source){
+		num_items = atomic_load_explicit(&source->num_items, memory_order_relaxed);
+	}
+	// size the table and intern table for one item per line up front
+	int num_lines = _line_count(data, size);
+	t_config_table *table = _table_copy(cfg, source, num_items, num_items + num_lines);
+	if(!table || !_strings_reserve(cfg, cfg->num_strings + num_lines) || (!source && !_table_defaults(cfg, table))){
+		_table_free(table);
+		return NULL;
+	}
+	atomic_store_explicit(&table->num_items, num_items, memory_order_relaxed);
+	table->generation = ++cfg->generations;
+	return _table_parse_lines(cfg, table, fqconfigname, data, size);
+}
+//---------------------------------------------------------------------------
+/*
+ * Parse more lines on top of the unpublished table, making room for them.
+ *
+ * \return the table, which may have been replaced by a larger one.
+ */
+static t_config_table *_table_parse_more(t_configuration *cfg, t_config_table *table, const char *fqconfigname, const char *data, size_t size){
+	int num_lines = _line_count(data, size);
+	t_config_table *grown = _table_reserve(cfg, table, atomic_load_explicit(&table->num_items, memory_order_relaxed) + num_lines);
+	if(grown && grown != table){
+		_table_free(table);
+		table = grown;
+	}
+	if(grown && _strings_reserve(cfg, cfg->num_strings + num_lines)){
+		table = _table_parse_lines(cfg, table, fqconfigname, data, size);
+	}
+	return table;
+}
+//---------------------------------------------------------------------------
+/*
+ * Read the config file into a new, unpublished table, from its snapshot when
+ * snapshots are enabled and the snapshot matches the file. Caller must hold
+ * the writer lock.
+ *
+ * \return the new table, or NULL if the file could not be read or is malformed.
+ */
+static t_config_table *_table_load_file(t_configuration *cfg){
+#ifndef WIN32
+	struct stat st;
+	// snapshots do not cover the layers below the config file
+	int use_snapshot = cfg->use_snapshot && !cfg->layers_base && _config_stat(cfg, cfg->filename, &st) == 0;
+#endif
+
+	size_t size = 0;
+	int mapped = 0;
+	char *data = _file_read(cfg, cfg->filename, &size, &mapped);
+	if(!data){
+		return NULL;
+	}
+
+#ifndef WIN32
+	char snapshotname[CONFIGURATION_NAME_MAX];
+	t_snapshot_header source = { .text_size = size };
+	use_snapshot = use_snapshot && (uint64_t)st.st_size == size
+			&& _config_name(cfg, snapshotname, cfg->filename, CONFIGURATION_SNAPSHOT_SUFFIX);
+	if(use_snapshot){
+		source.text_mtime_sec = st.st_mtim.tv_sec;
+		source.text_mtime_nsec = st.st_mtim.tv_nsec;
+		source.text_hash = _snapshot_hash(data, size);
+		source.mappings_hash = _snapshot_mappings_hash(cfg);
+		t_config_table *table = _snapshot_load(cfg, snapshotname, &source);
+		if(table){
+			_file_release(data, size, mapped);
+			return table;
+		}
+	}
+#endif
+
+	t_config_table *table = _table_parse(cfg, cfg->filename, data, size);
+	_file_release(data, size, mapped);
+
+#ifndef WIN32
+	if(table && use_snapshot){
+		// a missing, stale or corrupt snapshot is replaced
+		_snapshot_write(cfg, table, snapshotname, &source);
+	}
+#endif
+	return table;
+}
+//---------------------------------------------------------------------------
+#ifndef WIN32
+/*
+ * Apply the records of the journal named with suffix to the unpublished
+ * table. A missing journal is not an error, and a record cut short by a
+ * crash is ignored. Caller must hold the writer lock.
+ *
+ * \return the table, which may have been replaced by a larger one.
+ */
+static t_config_table *_journal_replay(t_configuration *cfg, t_config_table *table, const char *suffix){
+	char journalname[CONFIGURATION_NAME_MAX];
+	struct stat st;
+	if(!_config_name(cfg, journalname, cfg->filename, suffix) || _config_stat(cfg, journalname, &st) != 0){
+		return table;
+	}
+	size_t size = 0;
+	int mapped = 0;
+	char *data = _file_read(cfg, journalname, &size, &mapped);
+	if(!data){
+		return table;
+	}
+
+	// only complete records end in a newline
+	const char *nul = memchr(data, '\0', size);
+	size_t len = nul ? (size_t)(nul - data) : size;
+	while(len && data[len - 1] != '\n'){
+		len--;
+	}
+	if(len < size){
+		CONFIGURATION_COUNT(cfg, parse_errors);
+	}
+	table = _table_parse_more(cfg, table, journalname, data, len);
+	_file_release(data, size, mapped);
+	return table;
+}
+#endif
+//---------------------------------------------------------------------------
+#ifndef WIN32
+/*
+ * Read the system config file of the XDG config directory dir of len bytes
+ * on top of the unpublished table. Most directories have none.
+ *
+ * \return the table, which may have been replaced by a larger one.
+ */
+static t_config_table *_layer_read(t_configuration *cfg, t_config_table *table, const char *dir, int len){
+	char path[PATH_MAX];
+	if(snprintf(path, sizeof(path), "%.*s/%s/%s", len, dir, cfg->dirname, cfg->filename) >= (int)sizeof(path)){
+		return table;
+	}
+	FILE *f = fopen(path, "r");
+	if(!f){
+		return table;
+	}
+	size_t size = 0;
+	int mapped = 0;
+	char *data = _file_read_stream(cfg, f, path, &size, &mapped);
+	if(!data){
+		_log(cfg, CONFIGURATION_LOG_WARNING, "Ignoring unreadable system configfile %s.", path);
+		return table;
+	}
+	if(memchr(data, '\0', size)){
+		_log(cfg, CONFIGURATION_LOG_WARNING, "Ignoring malformed system configfile %s.", path);
+		CONFIGURATION_COUNT(cfg, parse_errors);
+	}
+	else{
+		table = _table_parse_more(cfg, table, path, data, size);
+	}
+	_file_release(data, size, mapped);
+	return table;
+}
+//---------------------------------------------------------------------------
+/*
+ * Get the table of the defaults with the system config files of
+ * XDG_CONFIG_DIRS on top. It is built by the first load and kept, so reloads
+ * of the config file only parse the config file again. Caller must hold the
+ * writer lock.
+ *
+ * \return the unpublished table, or NULL if it could not be allocated.
+ */
+static t_config_table *_layers_base(t_configuration *cfg){
+	if(cfg->layers_base){
+		return cfg->layers_base;
+	}
+	t_config_table *table = _table_parse(cfg, cfg->filename, "", 0);
+	const char *dirs = getenv("XDG_CONFIG_DIRS");
+	if(!dirs || !*dirs){
+		dirs = "/etc/xdg";
+	}
+	// the first directory is the most important, so it is read last
+	const char *end = dirs + strlen(dirs);
+	while(table && end > dirs){
+		const char *start = end;
+		while(start > dirs && start[-1] != ':'){
+			start--;
+		}
+		if(end > start){
+			table = _layer_read(cfg, table, start, end - start);
+		}
+		end = start > dirs ? start - 1 : dirs;
+	}
+	cfg->layers_base = table;
+	return table;
+}
+#endif
+//---------------------------------------------------------------------------
+// does key spell the environment variable name of len bytes
+static int _env_name_match(const char *key, const char *name, size_t len){
+	size_t i = 0;
+	for(; key[i] && i < len; i++){
+		char c = key[i];
+		if(c >= 'a' && c <= 'z'){
+			c -= 'a' - 'A';
+		}
+		else if(!(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9')){
+			c = '_';
+		}
+		if(c != name[i]){
+			return 0;
+		}
+	}
+	return !key[i] && i == len;
+}
+//---------------------------------------------------------------------------
+/*
+ * Find the key of table an environment variable name of len bytes, without
+ * the prefix, overrides. Usually the lowercased name is the key, otherwise
+ * every key is tried. A name that matches no key is a new, lowercased key.
+ *
+ * \return the interned key, or NULL if it could not be stored.
+ */
+static const char *_env_key(t_configuration *cfg, t_config_table *table, const char *name, size_t len){
+	char *lower = malloc(len + 1);
+	if(!lower){
+		return NULL;
+	}
+	for(size_t i = 0; i < len; i++){
+		lower[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + ('a' - 'A') : name[i];
+	}
+	lower[len] = '\0';
+	int i = _table_find(table, lower);
+	int num_items = atomic_load_explicit(&table->num_items, memory_order_relaxed);
+	for(int j = 0; i < 0 && j < num_items; j++){
+		if(table->items[j].key && _env_name_match(table->items[j].key, name, len)){
+			i = j;
+		}
+	}
+	const char *key = i >= 0 ? table->items[i].key : _string_intern_len(cfg, lower, len);
+	free(lower);
+	return key;
+}
+//---------------------------------------------------------------------------
+/*
+ * Override items of the unpublished table with the environment variables
+ * named env_prefix followed by their key, see configuration_ctx_use_env. The
+ * values beneath the overrides are kept for saves. Caller must hold the
+ * writer lock.
+ *
+ * \return the table, which may have been replaced by a larger one.
+ */
+static t_config_table *_env_apply(t_configuration *cfg, t_config_table *table){
+	free(cfg->env_overrides);
+	cfg->env_overrides = NULL;
+	cfg->num_env_overrides = 0;
+
+	size_t prefix_len = strlen(cfg->env_prefix);
+	int num_vars = 0;
+	for(char **env = environ; *env; env++){
+		num_vars += strncmp(*env, cfg->env_prefix, prefix_len) == 0;
+	}
+	if(!num_vars){
+		return table;
+	}
+	t_env_override *overrides = calloc(num_vars, sizeof(t_env_override));
+	if(!overrides){
+		_log(cfg, CONFIGURATION_LOG_ERROR, "Unable to allocate environment overrides.");
+		return table;
+	}
+
+	int num_items = atomic_load_explicit(&table->num_items, memory_order_relaxed);
+	int num_overrides = 0;
+	for(char **env = environ; *env && num_overrides < num_vars; env++){
+		if(strncmp(*env, cfg->env_prefix, prefix_len) != 0){
+			continue;
+		}
+		const char *name = *env + prefix_len;
+		const char *value = strchr(name, '=');
+		if(!value || value == name){
+			continue;
+		}
+		const char *key = _env_key(cfg, table, name, value - name);
+		if(!key){
+			_log(cfg, CONFIGURATION_LOG_ERROR, "No more space in configuration for %.*s.", (int)(value - name), name);
+			continue;
+		}
+		value++;
+
+		t_env_override *override = &overrides[num_overrides];
+		int i = _table_find(table, key);
+		if(i >= 0){
+			// remember the value beneath, before the override replaces it
+			override->shadow = atomic_load_explicit(&table->items[i].val, memory_order_relaxed);
+			override->has_shadow = 1;
+		}
+		else{
+			i = _mapping_index(cfg, key);
+			if(i < 0){
+				i = num_items;
+			}
+			t_config_table *grown = _table_reserve(cfg, table, i + 1);
+			if(!grown){
+				_log(cfg, CONFIGURATION_LOG_ERROR, "No more space in configuration for %s.", key);
+				continue;
+			}
+			if(grown != table){
+				_table_free(table);
+				table = grown;
+			}
+			table->items[i].key = key;
+			_index_insert(table, i);
+			if(i == num_items){
+				num_items++;
+				atomic_store_explicit(&table->num_items, num_items, memory_order_relaxed);
+			}
+		}
+
+		t_config_value parsed;
+		if(_value_parse(value, strlen(value), &parsed) == CONFIGURATION_VAL_STR){
+			const char *str = _string_intern(cfg, value);
+			parsed = _value_from_str(str ? str : configuration_empty_str);
+		}
+		atomic_store_explicit(&table->items[i].val, parsed, memory_order_relaxed);
+		override->key = key;
+		override->value = parsed;
+		num_overrides++;
+	}
+	cfg->env_overrides = overrides;
+	cfg->num_env_overrides = num_overrides;
+	return table;
+}
+//---------------------------------------------------------------------------
+/*
+ * Get the value of key that belongs in the config file, which is not an
+ * environment override and not what the layers below already hold. Caller
+ * must hold the writer lock.
+ *
+ * \return 1 with the value in value, or 0 if the key should not be saved.
+ */
+static int _layer_value(t_configuration *cfg, const char *key, t_config_value *value){
+	for(int i = 0; i < cfg->num_env_overrides; i++){
+		t_env_override *override = &cfg->env_overrides[i];
+		if(override->key == key){
+			if(_value_equal(*value, override->value)){
+				// not set since the load
+				if(!override->has_shadow){
+					return 0;
+				}
+				*value = override->shadow;
+			}
+			break;
+		}
+	}
+	if(cfg->layers_base){
+		int i = _table_find(cfg->layers_base, key);
+		if(i >= 0 && _value_equal(*value, atomic_load_explicit(&cfg->layers_base->items[i].val, memory_order_relaxed))){
+			return 0;
+		}
+	}
+	return 1;
+}
+//---------------------------------------------------------------------------
+/*
+ * Read the config file and replay the journal on top of it into a new,
+ * unpublished table. Caller must hold the writer lock.
+ *
+ * \return the new table, or NULL if the file could not be read or is malformed.
+ */
+static t_config_table *_table_load_user(t_configuration *cfg){
+#ifdef WIN32
+	return _table_load_file(cfg);
+#else
+	if(!cfg->use_journal && !cfg->layers_base){
+		return _table_load_file(cfg);
+	}
+	char name[CONFIGURATION_NAME_MAX];
+	struct stat st;
+	int file_exists = _config_stat(cfg, cfg->filename, &st) == 0;
+	int journal_exists = 0;
+	if(cfg->use_journal){
+		journal_exists = _config_name(cfg, name, cfg->filename, CONFIGURATION_JOURNAL_SUFFIX) && _config_stat(cfg, name, &st) == 0;
+		journal_exists = journal_exists
+				|| (_config_name(cfg, name, cfg->filename, CONFIGURATION_JOURNAL_OLD_SUFFIX) && _config_stat(cfg, name, &st) == 0);
+	}
+
+	t_config_table *table;
+	if(!file_exists && (journal_exists || cfg->layers_base)){
+		// sets were journaled before the config file was first saved, or the layers below have the values
+		table = _table_parse(cfg, cfg->filename, "", 0);
+	}
+	else{
+		table = _table_load_file(cfg);
+	}
+	if(table && cfg->use_journal){
+		// a journal left by an interrupted save holds the older records
+		table = _journal_replay(cfg, table, CONFIGURATION_JOURNAL_OLD_SUFFIX);
+		table = _journal_replay(cfg, table, CONFIGURATION_JOURNAL_SUFFIX);
+	}
+	return table;
+#endif
+}
+//---------------------------------------------------------------------------
+/*
+ * Stack the layers into a new, unpublished table: defaults, the system config
+ * files when enabled, the config file with its journal and the environment
+ * overrides when enabled. Caller must hold the writer lock.
+ *
+ * \return the new table, or NULL if the file could not be read or is malformed.
+ */
+static t_config_table *_table_load(t_configuration *cfg){
+#ifndef WIN32
+	if(cfg->use_system_config && !_layers_base(cfg)){
+		return NULL;
+	}
+#endif
+	t_config_table *table = _table_load_user(cfg);
+	if(table && cfg->env_prefix[0]){
+		table = _env_apply(cfg, table);
+	}
+	return table;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_use_system_config(configuration_t *cfg, int enable){
+#ifndef WIN32
+	pthread_mutex_lock(&cfg->lock);
+	cfg->use_system_config = enable;
+	_layers_free(cfg);
+	pthread_mutex_unlock(&cfg->lock);
+	return 1;
+#else
+	_error(cfg, CONFIGURATION_ERROR_UNSUPPORTED, "System configuration is not supported on this platform.");
+	return 0;
+#endif
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_use_env(configuration_t *cfg, const char *prefix){
+	if(prefix && (!prefix[0] || strlen(prefix) >= sizeof(cfg->env_prefix))){
+		_error_str(cfg, CONFIGURATION_ERROR_INVALID, "Invalid environment prefix %s.", prefix);
+		return 0;
+	}
+	pthread_mutex_lock(&cfg->lock);
+	snprintf(cfg->env_prefix, sizeof(cfg->env_prefix), "%s", prefix ? prefix : "");
+	_layers_free(cfg);
+	pthread_mutex_unlock(&cfg->lock);
+	return 1;
+}
+//---------------------------------------------------------------------------
+void configuration_ctx_use_snapshot(configuration_t *cfg, int enable){
+	cfg->use_snapshot = enable;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_use_journal(configuration_t *cfg, int enable){
+#ifndef WIN32
+	pthread_mutex_lock(&cfg->lock);
+	cfg->use_journal = enable;
+	if(!enable){
+		_journal_close(cfg);
+	}
+	pthread_mutex_unlock(&cfg->lock);
+	return 1;
+#else
+	_error(cfg, CONFIGURATION_ERROR_UNSUPPORTED, "Configuration journal is not supported on this platform.");
+	return 0;
+#endif
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_load(configuration_t *cfg){
+
+	_configdir_init(cfg, 0);
+
+	//can't load if configdir not ok
+	if(!cfg->configdirok){
+		return 0;
+	}
+
+	//don't load more than once
+	if(cfg->loaded){
+		return 1;
+	}
+
+	// the file is read into a private table which is published when complete
+	pthread_mutex_lock(&cfg->lock);
+	CONFIGURATION_TIME_START(start);
+	t_config_table *table = _table_load(cfg);
+	CONFIGURATION_TIME_END(cfg, load_ns, start);
+	CONFIGURATION_COUNT(cfg, loads);
+	if(table){
+		_changes_diff(cfg, atomic_load_explicit(&cfg->table, memory_order_relaxed), table);
+		_table_publish(cfg, table);
+		cfg->loaded = 1;
+		atomic_store(&cfg->saved, atomic_load(&cfg->changes));
+	}
+	else{
+		CONFIGURATION_COUNT(cfg, load_failures);
+	}
+	pthread_mutex_unlock(&cfg->lock);
+	_notify(cfg);
+	return table != NULL;
+}
+//---------------------------------------------------------------------------
+#ifdef __linux__
+/*
+ * Replace the published table with the current contents of the config file.
+ * A file that cannot be read keeps the current table.
+ */
+static void _watch_reload(t_configuration *cfg){
+	pthread_mutex_lock(&cfg->lock);
+	struct stat st;
+	if(cfg->has_written && _config_stat(cfg, cfg->filename, &st) == 0 && st.st_dev == cfg->written.st_dev && st.st_ino == cfg->written.st_ino
+			&& st.st_size == cfg->written.st_size && st.st_mtim.tv_sec == cfg->written.st_mtim.tv_sec && st.st_mtim.tv_nsec == cfg->written.st_mtim.tv_nsec){
+		// written by our own save, memory already holds it and maybe newer sets
+		pthread_mutex_unlock(&cfg->lock);
+		return;
+	}
+	if(!cfg->use_journal && atomic_load(&cfg->changes) != atomic_load(&cfg->saved)){
+		// without a journal to replay, reloading would drop the unsaved sets
+		_log(cfg, CONFIGURATION_LOG_WARNING, "Not reloading %s, it changed while there are unsaved changes.", cfg->filename);
+		pthread_mutex_unlock(&cfg->lock);
+		return;
+	}
+	CONFIGURATION_TIME_START(start);
+	t_config_table *table = _table_load(cfg);
+	CONFIGURATION_TIME_END(cfg, load_ns, start);
+	CONFIGURATION_COUNT(cfg, loads);
+	if(table){
+		_changes_diff(cfg, atomic_load_explicit(&cfg->table, memory_order_relaxed), table);
+		_table_publish(cfg, table);
+		cfg->loaded = 1;
+		atomic_store(&cfg->saved, atomic_load(&cfg->changes));
+	}
+	else{
+		CONFIGURATION_COUNT(cfg, load_failures);
+		// nobody calls get_error on the watch thread
+		_log(cfg, CONFIGURATION_LOG_WARNING, "Unable to reload configuration: %s", configuration_ctx_get_error(cfg));
+	}
+	pthread_mutex_unlock(&cfg->lock);
+	_notify(cfg);
+}
+//---------------------------------------------------------------------------
+/*
+ * Wait for changes to the config file and reload it. Changes are debounced,
+ * so a burst of writes is reloaded once when the file has been quiet for
+ * CONFIGURATION_WATCH_DEBOUNCE_MS.
+ */
+static void *_watch_thread(void *arg){
+	t_configuration *cfg = arg;
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = {
+		{ .fd = cfg->watch_fd, .events = POLLIN },
+		{ .fd = cfg->watch_wake[0], .events = POLLIN }
+	};
+	int pending = 0;
+
+	for(;;){
+		int ready = poll(fds, 2, pending ? CONFIGURATION_WATCH_DEBOUNCE_MS : -1);
+		if(ready < 0 && errno == EINTR){
+			continue;
+		}
+		if(ready < 0 || fds[1].revents){
+			// stopped by configuration_ctx_unwatch
+			break;
+		}
+		if(ready == 0){
+			pending = 0;
+			_watch_reload(cfg);
+			continue;
+		}
+
+		ssize_t len = read(cfg->watch_fd, events, sizeof(events));
+		for(char *p = events; len > 0 && p < events + len; ){
+			struct inotify_event *event = (struct inotify_event *)p;
+			if(event->len && strcmp(event->name, cfg->filename) == 0){
+				pending = 1;
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	return NULL;
+}
+#endif
+//---------------------------------------------------------------------------
+int configuration_ctx_watch(configuration_t *cfg){
+#ifdef __linux__
+	if(cfg->watching){
+		return 1;
+	}
+
+	_configdir_init(cfg, 0);
+	if(!cfg->configdirok){
+		return 0;
+	}
+
+	// watch the directory, editors and atomic saves replace the file itself
+	cfg->watch_fd = inotify_init1(IN_CLOEXEC);
+	if(cfg->watch_fd < 0){
+		_error_str(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to watch configuration directory %s.", cfg->configdir);
+		return 0;
+	}
+	if(inotify_add_watch(cfg->watch_fd, cfg->configdir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 || pipe(cfg->watch_wake) != 0){
+		_error_str(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to watch configuration directory %s.", cfg->configdir);
+		close(cfg->watch_fd);
+		return 0;
+	}
+	int err = pthread_create(&cfg->watch_thread, NULL, _watch_thread, cfg);
+	if(err != 0){
+		errno = err;
+		_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to start configuration watch thread.");
+		close(cfg->watch_fd);
+		close(cfg->watch_wake[0]);
+		close(cfg->watch_wake[1]);
+		return 0;
+	}
+	cfg->watching = 1;
+	return 1;
+#else
+	_error(cfg, CONFIGURATION_ERROR_UNSUPPORTED, "Watching configuration is not supported on this platform.");
+	return 0;
+#endif
+}
+//---------------------------------------------------------------------------
+void configuration_ctx_unwatch(configuration_t *cfg){
+#ifdef __linux__
+	if(!cfg->watching){
+		return;
+	}
+	close(cfg->watch_wake[1]);
+	pthread_join(cfg->watch_thread, NULL);
+	close(cfg->watch_wake[0]);
+	close(cfg->watch_fd);
+	cfg->watching = 0;
+#endif
+}
+//---------------------------------------------------------------------------
+#ifndef WIN32
+/*
+ * Flush the entries of configdir to disk, so a file renamed into it survives
+ * a crash. Filesystems that can not sync directories are ignored.
+ *
+ * \return 1 if synced.
+ */
+static int _configdir_sync(t_configuration *cfg){
+	return fsync(_configdir_fd(cfg)) == 0 || errno == EINVAL;
+}
+#endif
+//---------------------------------------------------------------------------
+int configuration_ctx_save(configuration_t *cfg){
+	FILE *configfile;
+	int i = 0;
+	char tmpname[CONFIGURATION_NAME_MAX];
+	char journalname[CONFIGURATION_NAME_MAX];
+	char oldjournalname[CONFIGURATION_NAME_MAX];
+
+	_configdir_init(cfg, 1);
+
+	//cfg->configdirok?
+	if(!cfg->configdirok){
+		return 0;
+	}
+	if(!_config_name(cfg, tmpname, cfg->filename, ".tmp")
+			|| !_config_name(cfg, journalname, cfg->filename, CONFIGURATION_JOURNAL_SUFFIX)
+			|| !_config_name(cfg, oldjournalname, cfg->filename, CONFIGURATION_JOURNAL_OLD_SUFFIX)){
+		CONFIGURATION_COUNT(cfg, save_failures);
+		return 0;
+	}
+
+	pthread_mutex_lock(&cfg->save_lock);
+	// values read after this include every change counted so far
+	unsigned long changes = atomic_load_explicit(&cfg->changes, memory_order_acquire);
+	if(changes == atomic_load(&cfg->saved)){
+		// nothing changed since the config file was last loaded or saved
+		pthread_mutex_unlock(&cfg->save_lock);
+		CONFIGURATION_COUNT(cfg, saves_skipped);
+		return 1;
+	}
+	CONFIGURATION_TIME_START(start);
+
+#ifndef WIN32
+	if(cfg->use_journal){
+		// sets from here on go to a new journal, the current one is folded into the file
+		pthread_mutex_lock(&cfg->lock);
+		_journal_close(cfg);
+		struct stat old;
+		if(_config_stat(cfg, oldjournalname, &old) != 0){
+			// after a failed save the old journal is kept, and both stay until the next save
+			_config_rename(cfg, journalname, oldjournalname);
+		}
+		pthread_mutex_unlock(&cfg->lock);
+	}
+#endif
+
+	// write a new file and rename it over the config file, so a crash leaves either the old or the new file
+	configfile = _config_fopen(cfg, tmpname, "w");
+
+	if(configfile == NULL){
+		_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to open configfile for save.");
+		_log(cfg, CONFIGURATION_LOG_ERROR, "%s", configuration_ctx_get_error(cfg));
+		pthread_mutex_unlock(&cfg->save_lock);
+		CONFIGURATION_COUNT(cfg, save_failures);
+		return 0;
+	}
+#ifndef WIN32
+	// keep the permissions of the file being replaced
+	struct stat st;
+	if(_config_stat(cfg, cfg->filename, &st) == 0){
+		fchmod(fileno(configfile), st.st_mode & 07777);
+	}
+#endif
+
+	char floatbuf[64];
+	// values of other layers are left out, and those are only stable under the writer lock
+	int layered = cfg->use_system_config || cfg->env_prefix[0];
+	if(layered){
+		pthread_mutex_lock(&cfg->lock);
+	}
+	t_config_reader *reader = _read_begin(cfg);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_acquire);
+	int num_items = table ? atomic_load_explicit(&table->num_items, memory_order_acquire) : 0;
+	for(i = 0; i < num_items; i++){
+		if(!table->items[i].key){
+			// unused item between mapped indexes
+			continue;
+		}
+		t_config_value value = atomic_load_explicit(&table->items[i].val, memory_order_acquire);
+		if(layered && !_layer_value(cfg, table->items[i].key, &value)){
+			continue;
+		}
+		if(_entry_is_section(table->items[i].key, value)){
+			// a mapping or schema default, it would read back as a section
+			_log(cfg, CONFIGURATION_LOG_WARNING, "Not saving %s, its empty value would read back as a section.", table->items[i].key);
+			continue;
+		}
+		switch(_value_type(value)){
+			case CONFIGURATION_VAL_INT:
+				fprintf(configfile, "%s %d\n", table->items[i].key, _value_int(value));
+				break;
+			case CONFIGURATION_VAL_FLOAT:
+				_value_format_float(floatbuf, sizeof(floatbuf), _value_float(value));
+				fprintf(configfile, "%s %s\n", table->items[i].key, floatbuf);
+				break;
+			case CONFIGURATION_VAL_STR:
+				fprintf(configfile, "%s %s\n", table->items[i].key, _value_str(value));
+				break;
+		}
+	}
+	_read_end(cfg, reader);
+	if(layered){
+		pthread_mutex_unlock(&cfg->lock);
+	}
+
+	int ok = fflush(configfile) == 0 && !ferror(configfile);
+#ifndef WIN32
+	CONFIGURATION_TIME_START(fsync_start);
+	ok = ok && fsync(fileno(configfile)) == 0;
+	CONFIGURATION_TIME_END(cfg, fsync_ns, fsync_start);
+#endif
+#ifdef __linux__
+	// recorded before the rename, which the watch thread sees
+	struct stat written;
+	int has_written = ok && fstat(fileno(configfile), &written) == 0;
+	pthread_mutex_lock(&cfg->lock);
+	cfg->written = written;
+	cfg->has_written = has_written;
+	pthread_mutex_unlock(&cfg->lock);
+#endif
+	ok = fclose(configfile) == 0 && ok;
+#ifdef WIN32
+	// rename does not replace an existing file here
+	ok = ok && (_config_remove(cfg, cfg->filename) == 0 || errno == ENOENT);
+#endif
+	ok = ok && _config_rename(cfg, tmpname, cfg->filename) == 0;
+	if(!ok){
+		_config_remove(cfg, tmpname);
+		_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to write configfile for save.");
+		_log(cfg, CONFIGURATION_LOG_ERROR, "%s", configuration_ctx_get_error(cfg));
+		pthread_mutex_unlock(&cfg->save_lock);
+		CONFIGURATION_COUNT(cfg, save_failures);
+		return 0;
+	}
+#ifndef WIN32
+	CONFIGURATION_TIME_START(dir_sync_start);
+	int dir_synced = _configdir_sync(cfg);
+	CONFIGURATION_TIME_END(cfg, fsync_ns, dir_sync_start);
+	if(!dir_synced){
+		_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to sync configdir after save.");
+		_log(cfg, CONFIGURATION_LOG_ERROR, "%s", configuration_ctx_get_error(cfg));
+		pthread_mutex_unlock(&cfg->save_lock);
+		CONFIGURATION_COUNT(cfg, save_failures);
+		return 0;
+	}
+#endif
+	// the file now holds every journaled set
+	_config_remove(cfg, oldjournalname);
+	if(!cfg->use_journal){
+		_config_remove(cfg, journalname);
+	}
+
+	atomic_store(&cfg->saved, changes);
+	pthread_mutex_unlock(&cfg->save_lock);
+	CONFIGURATION_TIME_END(cfg, save_ns, start);
+	CONFIGURATION_COUNT(cfg, saves);
+	return 1;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_save_async(configuration_t *cfg, config_saved_t *callback, void *ctx){
+	t_save_request *request = NULL;
+	if(callback){
+		request = malloc(sizeof(t_save_request));
+		if(!request){
+			_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration save request.");
+			return 0;
+		}
+		request->callback = callback;
+		request->ctx = ctx;
+	}
+
+	pthread_mutex_lock(&cfg->save_async_lock);
+	if(!cfg->save_thread_running){
+		int err = pthread_create(&cfg->save_thread, NULL, _save_thread, cfg);
+		if(err != 0){
+			pthread_mutex_unlock(&cfg->save_async_lock);
+			free(request);
+			errno = err;
+			_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to start configuration save thread.");
+			return 0;
+		}
+		cfg->save_thread_running = 1;
+	}
+	if(request){
+		request->next = cfg->save_waiting;
+		cfg->save_waiting = request;
+	}
+	cfg->save_requests++;
+	pthread_cond_signal(&cfg->save_wanted);
+	pthread_mutex_unlock(&cfg->save_async_lock);
+	return 1;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_flush(configuration_t *cfg){
+	pthread_mutex_lock(&cfg->save_async_lock);
+	unsigned long requests = cfg->save_requests;
+	while(cfg->save_requests_done < requests){
+		pthread_cond_wait(&cfg->save_done, &cfg->save_async_lock);
+	}
+	int saved = cfg->save_result;
+	pthread_mutex_unlock(&cfg->save_async_lock);
+	if(!saved){
+		_error(cfg, CONFIGURATION_ERROR_SYSTEM, "Background configuration save failed.");
+	}
+	return saved;
+}
+//---------------------------------------------------------------------------
+const char *configuration_ctx_get_configdir(configuration_t *cfg){
+	if(!cfg->configdirok){
+		return "";
+	}
+	return cfg->configdir;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_get_by_index_int_value(configuration_t *cfg, const unsigned int index, int *value){
+	if(!value){
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
+		return 0;
+	}
+
+	t_config_value item;
+	if(!_value_at(cfg, index, &item, NULL, 0)){
+		_error(cfg, CONFIGURATION_ERROR_INDEX, "Configuration index out of bounds.");
+		value = 0;
+		return 0;
+	}
+
+	if(_value_type(item) != CONFIGURATION_VAL_INT){
+		_error(cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type int.");
+		value = 0;
+		return 0;
 	}
 
-	if(index >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration index out of bounds.");
-		value = 0;
+	*value = _value_int(item);
+	return 1;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_get_int_value(configuration_t *cfg, const char *key, int *value){
+	if(!value){
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
+		return 0;
+	}
+
+	t_config_value item;
+	if(_value_find(cfg, key, &item, NULL, 0)){
+		if(_value_type(item) != CONFIGURATION_VAL_INT){
+			_error(cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type int.");
+			value = 0;
+			return 0;
+		}
+		*value = _value_int(item);
+		return 1;
+	}
+
+	//not found
+	_error_str(cfg, CONFIGURATION_ERROR_NOT_FOUND, "Configuration key %s not found.", key);
+	*value = 0;
+	return 0;
+}
+//---------------------------------------------------------------------------
+/*
+ * Release the writer lock after a set, then fold the journal into the config
+ * file if it has grown past CONFIGURATION_JOURNAL_COMPACT_SIZE and tell
+ * subscribers about the change.
+ */
+static void _set_unlock(t_configuration *cfg){
+	int compact = cfg->journal_fd >= 0 && cfg->journal_size >= CONFIGURATION_JOURNAL_COMPACT_SIZE;
+	pthread_mutex_unlock(&cfg->lock);
+	if(compact){
+		configuration_ctx_save(cfg);
+	}
+	_notify(cfg);
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_set_by_index_int_value(configuration_t *cfg, const unsigned int index, int value){
+	pthread_mutex_lock(&cfg->lock);
+	int ok = _item_set_by_index(cfg, index, _value_from_int(value));
+	_set_unlock(cfg);
+	return ok;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_set_int_value(configuration_t *cfg, const char *key, int value){
+	pthread_mutex_lock(&cfg->lock);
+	int ok = _item_set(cfg, key, _value_from_int(value));
+	_set_unlock(cfg);
+	return ok;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_get_by_index_float_value(configuration_t *cfg, const unsigned int index, float *value){
+	if(!value){
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
+		return 0;
+	}
+
+	t_config_value item;
+	if(!_value_at(cfg, index, &item, NULL, 0)){
+		_error_int(cfg, CONFIGURATION_ERROR_INDEX, "Configuration index %lld out of bounds.", index);
+		return 0;
+	}
+
+	if(_value_type(item) != CONFIGURATION_VAL_FLOAT){
+		_error(cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type float.");
+		*value = 0.0f;
+		return 0;
+	}
+	
+	*value = _value_float(item);
+	return 1;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_get_float_value(configuration_t *cfg, const char *key, float *value){
+	if(!value){
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
+		return 0;
+	}
+
+	t_config_value item;
+	if(_value_find(cfg, key, &item, NULL, 0)){
+		if(_value_type(item) != CONFIGURATION_VAL_FLOAT){
+			_error(cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type float.");
+			*value = 0.0f;
+			return 0;
+		}
+
+		*value = _value_float(item);
+		return 1;
+	}
+
+	//not found
+	_error_str(cfg, CONFIGURATION_ERROR_NOT_FOUND, "Configuration key %s not found.", key);
+	*value = 0.0f;
+	return 0;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_set_by_index_float_value(configuration_t *cfg, const unsigned int index, float value){
+	pthread_mutex_lock(&cfg->lock);
+	int ok = _item_set_by_index(cfg, index, _value_from_float(value));
+	_set_unlock(cfg);
+	return ok;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_set_float_value(configuration_t *cfg, const char *key, float value){
+	pthread_mutex_lock(&cfg->lock);
+	int ok = _item_set(cfg, key, _value_from_float(value));
+	_set_unlock(cfg);
+	return ok;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_get_by_index_str_value(configuration_t *cfg, const unsigned int index, char *value, int size){
+	if(!value){
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
+		return 0;
+	}
+
+
+	t_config_value item;
+	if(!_value_at(cfg, index, &item, value, size)){
+		_error(cfg, CONFIGURATION_ERROR_INDEX, "Index out of bounds.");
 		return 0;
 	}
 
-	if(configuration.items[index].val_type != CONFIGURATION_VAL_INT){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration item is not of type int.");
-		value = 0;
+	if(_value_type(item) != CONFIGURATION_VAL_STR){
+		_error(cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type str.");
 		return 0;
 	}
-
-	*value = configuration.items[index].val.int_value;
 	return 1;
 }
 //---------------------------------------------------------------------------
-int configuration_get_int_value(const char *key, int *value){
+int configuration_ctx_get_str_value(configuration_t *cfg, const char *key, char *value, int size){
 	if(!value){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Value is null.");
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
 		return 0;
 	}
 
-	for(int i = 0; i < configuration.num_items; i++){
-		if(strcmp(configuration.items[i].key, key) == 0){
-			if(configuration.items[i].val_type != CONFIGURATION_VAL_INT){
-				snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration item is not of type int.");
-				value = 0;
-				return 0;
-			}
-			*value = configuration.items[i].val.int_value;
-			return 1;
+	t_config_value item;
+	if(_value_find(cfg, key, &item, value, size)){
+		if(_value_type(item) != CONFIGURATION_VAL_STR){
+			_error(cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type str.");
+			return 0;
 		}
+		return 1;
 	}
 
 	//not found
-	snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration key %s not found.", key);
-	*value = 0;
+	_error_str(cfg, CONFIGURATION_ERROR_NOT_FOUND, "Configuration key %s not found.", key);
 	return 0;
 }
 //---------------------------------------------------------------------------
-int configuration_set_by_index_int_value(const unsigned int index, int value){
-	if(index >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration index %d out of bounds.", index);
+int configuration_ctx_set_by_index_str_value(configuration_t *cfg, const unsigned int index, const char *value){
+	pthread_mutex_lock(&cfg->lock);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	if(!table || index >= (unsigned int)atomic_load_explicit(&table->num_items, memory_order_relaxed)){
+		_error_int(cfg, CONFIGURATION_ERROR_INDEX, "Configuration index %lld out of bounds.", index);
+		pthread_mutex_unlock(&cfg->lock);
 		return 0;
 	}
 
-	configuration.items[index].val_type = CONFIGURATION_VAL_INT;
-	configuration.items[index].val.int_value = value;
-	configuration.saved = 0;
-	return 1;
+	t_config_value str = _str_new(cfg, value);
+	int ok = str && _item_set_by_index(cfg, index, str);
+	if(str && !ok){
+		free(_value_owned(str));
+	}
+	_set_unlock(cfg);
+	return ok;
 }
 //---------------------------------------------------------------------------
-int configuration_set_int_value(const char *key, int value){
+int configuration_ctx_set_str_value(configuration_t *cfg, const char *key, const char *value){
+	pthread_mutex_lock(&cfg->lock);
+	t_config_value str = _str_new(cfg, value);
+	int ok = str && _item_set(cfg, key, str);
+	if(str && !ok){
+		free(_value_owned(str));
+	}
+	_set_unlock(cfg);
+	return ok;
+}
+//---------------------------------------------------------------------------
+configuration_handle_t *configuration_ctx_lookup(configuration_t *cfg, const char *key){
+	t_config_reader *reader = _read_begin(cfg);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_acquire);
+	int i = _table_find(table, key);
+	uint64_t slot = i >= 0 ? (uint64_t)table->generation << 32 | (unsigned int)i : 0;
+	_read_end(cfg, reader);
+	if(i < 0){
+		_error_str(cfg, CONFIGURATION_ERROR_NOT_FOUND, "Configuration key %s not found.", key);
+		return NULL;
+	}
 
-	// try to find existing key
-	int key_found = 0;
-	int i = 0;
-	for(i = 0; i < configuration.num_items; i++){
-		if(strcmp(configuration.items[i].key, key) == 0){
-			key_found = 1;
-			break;
+	size_t len = strlen(key);
+	t_configuration_handle *handle = malloc(sizeof(t_configuration_handle) + len + 1);
+	if(!handle){
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration handle.");
+		return NULL;
+	}
+	handle->cfg = cfg;
+	atomic_init(&handle->slot, slot);
+	memcpy(handle->key, key, len + 1);
+	return handle;
+}
+//---------------------------------------------------------------------------
+void configuration_handle_free(configuration_handle_t *handle){
+	free(handle);
+}
+//---------------------------------------------------------------------------
+/*
+ * Read the value of the handle's key from the published table, using the
+ * cached index while the table generation matches and finding the key again
+ * otherwise.
+ *
+ * \return 1 if the key was found.
+ */
+static int _value_by_handle(t_configuration_handle *handle, t_config_value *value, char *str, int size){
+	t_configuration *cfg = handle->cfg;
+	t_config_reader *reader = _read_begin(cfg);
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_acquire);
+	uint64_t slot = atomic_load_explicit(&handle->slot, memory_order_relaxed);
+	int i = -1;
+	if(table && (unsigned int)(slot >> 32) == table->generation){
+		i = (unsigned int)slot;
+	}
+	else if(table){
+		i = _table_find(table, handle->key);
+		if(i >= 0){
+			atomic_store_explicit(&handle->slot, (uint64_t)table->generation << 32 | (unsigned int)i, memory_order_relaxed);
 		}
 	}
-
-	if(i >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "No more space in configuration.");
-		printf("ERROR: no more space in configuration.\n");
+	if(i >= 0){
+		*value = atomic_load_explicit(&table->items[i].val, memory_order_acquire);
+		_value_copy_str(*value, str, size);
+	}
+	_read_end(cfg, reader);
+	CONFIGURATION_COUNT(cfg, gets);
+	if(i < 0){
+		CONFIGURATION_COUNT(cfg, get_misses);
+		_error_str(cfg, CONFIGURATION_ERROR_NOT_FOUND, "Configuration key %s not found.", handle->key);
+	}
+	return i >= 0;
+}
+//---------------------------------------------------------------------------
+int configuration_get_int_by_handle(configuration_handle_t *handle, int *value){
+	if(!value){
+		_error(handle->cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
 		return 0;
 	}
 
-	if(!key_found){ //add new item
-		snprintf(configuration.items[i].key, 32, "%s", key);
-		configuration.num_items = configuration.num_items + 1;
+	t_config_value item;
+	if(!_value_by_handle(handle, &item, NULL, 0)){
+		*value = 0;
+		return 0;
 	}
-
-	configuration.items[i].val_type = CONFIGURATION_VAL_INT;
-	configuration.items[i].val.int_value = value;
-	configuration.saved = 0;
+	if(_value_type(item) != CONFIGURATION_VAL_INT){
+		_error(handle->cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type int.");
+		return 0;
+	}
+	*value = _value_int(item);
 	return 1;
 }
 //---------------------------------------------------------------------------
-int configuration_get_by_index_float_value(const unsigned int index, float *value){
+int configuration_get_float_by_handle(configuration_handle_t *handle, float *value){
 	if(!value){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Value is null.");
+		_error(handle->cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
 		return 0;
 	}
 
-	if(index >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration index %d out of bounds.", index);
+	t_config_value item;
+	if(!_value_by_handle(handle, &item, NULL, 0)){
+		*value = 0.0f;
 		return 0;
 	}
-
-	if(configuration.items[index].val_type != CONFIGURATION_VAL_FLOAT){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration item is not of type float.");
+	if(_value_type(item) != CONFIGURATION_VAL_FLOAT){
+		_error(handle->cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type float.");
 		*value = 0.0f;
 		return 0;
 	}
-	
-	*value = configuration.items[index].val.float_value;
+	*value = _value_float(item);
 	return 1;
 }
 //---------------------------------------------------------------------------
-int configuration_get_float_value(const char *key, float *value){
+int configuration_get_str_by_handle(configuration_handle_t *handle, char *value, int size){
 	if(!value){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Value is null.");
+		_error(handle->cfg, CONFIGURATION_ERROR_NULL_VALUE, "Value is null.");
 		return 0;
 	}
 
-	for(int i = 0; i < configuration.num_items; i++){
-		if(strcmp(configuration.items[i].key, key) == 0){
-			if(configuration.items[i].val_type != CONFIGURATION_VAL_FLOAT){
-				snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration item is not of type float.");
-				*value = 0.0f;
-				return 0;
-			}
+	t_config_value item;
+	if(!_value_by_handle(handle, &item, value, size)){
+		return 0;
+	}
+	if(_value_type(item) != CONFIGURATION_VAL_STR){
+		_error(handle->cfg, CONFIGURATION_ERROR_TYPE, "Configuration item is not of type str.");
+		return 0;
+	}
+	return 1;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_subscribe(configuration_t *cfg, const char *prefix, config_changed_t *callback, void *ctx){
+	if(!prefix || !callback){
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Configuration subscription needs a prefix and a callback.");
+		return 0;
+	}
+	size_t len = strlen(prefix);
+	t_subscription *subscription = malloc(sizeof(t_subscription) + len + 1);
+	if(!subscription){
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration subscription.");
+		return 0;
+	}
+	atomic_init(&subscription->active, 1);
+	subscription->callback = callback;
+	subscription->ctx = ctx;
+	memcpy(subscription->prefix, prefix, len + 1);
 
-			*value = configuration.items[i].val.float_value;
+	pthread_mutex_lock(&cfg->lock);
+	subscription->id = ++cfg->last_subscription_id;
+	subscription->next = atomic_load_explicit(&cfg->subscriptions, memory_order_relaxed);
+	atomic_store_explicit(&cfg->subscriptions, subscription, memory_order_release);
+	pthread_mutex_unlock(&cfg->lock);
+	return subscription->id;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_unsubscribe(configuration_t *cfg, int id){
+	// a delivery in progress may still be using the subscription, so it is kept until reset
+	for(t_subscription *subscription = atomic_load(&cfg->subscriptions); subscription; subscription = subscription->next){
+		if(subscription->id == id && atomic_exchange(&subscription->active, 0)){
 			return 1;
 		}
 	}
-
-	//not found
-	snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration key %s not found.", key);
-	*value = 0.0f;
+	_error_int(cfg, CONFIGURATION_ERROR_NOT_FOUND, "Configuration subscription %lld not found.", id);
 	return 0;
 }
 //---------------------------------------------------------------------------
-int configuration_set_by_index_float_value(const unsigned int index, float value){
-
-	if(index >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration index %d out of bounds.", index);
-		return 0;
+int configuration_ctx_foreach_prefix(configuration_t *cfg, const char *prefix, config_foreach_t *callback, void *ctx){
+	if(!prefix || !callback){
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Configuration prefix query needs a prefix and a callback.");
+		return -1;
 	}
-
-	configuration.items[index].val_type = CONFIGURATION_VAL_FLOAT;
-	configuration.items[index].val.float_value = value;
-	configuration.saved = 0;
-	return 1;
+	t_config_reader *reader = _read_begin(cfg);
+	int num_visited = _table_foreach_prefix(cfg, atomic_load_explicit(&cfg->table, memory_order_acquire), prefix, callback, ctx);
+	_read_end(cfg, reader);
+	return num_visited;
 }
 //---------------------------------------------------------------------------
-int configuration_set_float_value(const char *key, float value){
-	int key_found = 0;
-	int i = 0;
-	for(i = 0; i < configuration.num_items; i++){
-		if(strcmp(configuration.items[i].key, key) == 0){
-			key_found = 1;
+long long configuration_ctx_stream(configuration_t *cfg, const char *path, config_entry_t *on_entry, void *ctx){
+	if(!path || !on_entry){
+		_error(cfg, CONFIGURATION_ERROR_NULL_VALUE, "Configuration stream needs a path and a callback.");
+		return -1;
+	}
+	FILE *f = fopen(path, "r");
+	if(!f){
+		_error_str(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to open %s for streaming.", path);
+		return -1;
+	}
+#ifndef WIN32
+	posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	pthread_once(&configuration_scan_once, _scan_init);
+	// one more byte to terminate a last line without a newline
+	char *chunk = malloc(CONFIGURATION_STREAM_CHUNK + 1);
+	if(!chunk){
+		fclose(f);
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration stream.");
+		return -1;
+	}
+	char section[CONFIGURATION_SECTION_KEY_MAX];
+	size_t section_len = 0;
+	char section_key[CONFIGURATION_SECTION_KEY_MAX];
+
+	long long num_entries = 0;
+	long long line = 0;
+	int failed = 0;
+	int more = 1;
+	int eof = 0;
+	int skipping = 0; // the rest of a line longer than a chunk
+	size_t used = 0; // start of a line carried over from the previous chunk
+	while(more && !eof){
+		size_t got = fread(chunk + used, 1, CONFIGURATION_STREAM_CHUNK - used, f);
+		if(got < CONFIGURATION_STREAM_CHUNK - used){
+			if(ferror(f)){
+				_error_str(cfg, CONFIGURATION_ERROR_SYSTEM, "Unable to read %s.", path);
+				failed = 1;
+				break;
+			}
+			eof = 1;
+		}
+		if(memchr(chunk + used, '\0', got)){
+			_error_set(cfg, CONFIGURATION_ERROR_MALFORMED, "Configfile %s is malformed after line %lld.", path, 1, line);
+			CONFIGURATION_COUNT(cfg, parse_errors);
+			failed = 1;
 			break;
 		}
-	}
+		char *end = chunk + used + got;
+		char *p = chunk;
+		while(more && p < end){
+			char *eol = memchr(p, '\n', end - p);
+			if(!eol && !eof){
+				break;
+			}
+			if(!eol){
+				eol = end;
+			}
+			char *next = eol + 1;
+			if(skipping){
+				skipping = 0;
+				p = next;
+				continue;
+			}
 
-	if(i >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "No more space in configuration.");
-		printf("ERROR: no more space in configuration.\n");
-		return 0;
-	}
+			t_config_line tokens;
+			int kind = _line_split(p, eol, &tokens);
+			p = next;
+			if(kind == CONFIGURATION_LINE_BLANK){
+				continue;
+			}
+			if(kind == CONFIGURATION_LINE_SECTION){
+				// too long a name leaves its keys too long as well
+				section_len = tokens.key_len < sizeof(section) ? tokens.key_len : sizeof(section);
+				memcpy(section, tokens.key, section_len);
+				continue;
+			}
+			line++;
 
-	if(!key_found){ //add new item
-		snprintf(configuration.items[i].key, CONFIGURATION_KEY_MAX, "%s", key);
-		configuration.num_items = configuration.num_items + 1;
-	}
+			// keys and string values are terminated in place
+			t_configuration_value value;
+			t_config_value packed;
+			if(_value_parse(tokens.value, tokens.value_len, &packed) == CONFIGURATION_VAL_STR){
+				value.type = CONFIGURATION_VAL_STR;
+				value.str_value = tokens.value;
+			}
+			else{
+				_value_unpack(packed, &value);
+			}
+			((char *)tokens.value)[tokens.value_len] = '\0';
+			const char *key = tokens.key;
+			if(section_len){
+				if(!_section_key(section_key, sizeof(section_key), section, section_len, tokens.key, tokens.key_len)){
+					_log(cfg, CONFIGURATION_LOG_ERROR, "Key of entry %lld from %s is too long.", line, path);
+					CONFIGURATION_COUNT(cfg, parse_errors);
+					continue;
+				}
+				key = section_key;
+			}
+			else{
+				((char *)tokens.key)[tokens.key_len] = '\0';
+			}
+			num_entries++;
+			more = on_entry(cfg, key, &value, ctx);
+		}
 
-	configuration.items[i].val_type = CONFIGURATION_VAL_FLOAT;
-	configuration.items[i].val.float_value = value;
-	configuration.saved = 0;
+		// carry the start of an unfinished line over to the next chunk
+		used = p < end ? end - p : 0;
+		if(used == CONFIGURATION_STREAM_CHUNK){
+			if(!skipping){
+				_log(cfg, CONFIGURATION_LOG_ERROR, "Entry %lld from %s is longer than %d bytes.", line + 1, path, CONFIGURATION_STREAM_CHUNK);
+				CONFIGURATION_COUNT(cfg, parse_errors);
+			}
+			skipping = 1;
+			used = 0;
+		}
+		else if(used){
+			memmove(chunk, p, used);
+		}
+	}
+	free(chunk);
+	fclose(f);
+	return failed ? -1 : num_entries;
+}
+//---------------------------------------------------------------------------
+int configuration_ctx_get_stats(configuration_t *cfg, t_configuration_stats *stats){
+#ifdef CONFIGURATION_METRICS
+	t_config_metrics *metrics = &cfg->metrics;
+	stats->gets = atomic_load_explicit(&metrics->gets, memory_order_relaxed);
+	stats->get_misses = atomic_load_explicit(&metrics->get_misses, memory_order_relaxed);
+	stats->sets = atomic_load_explicit(&metrics->sets, memory_order_relaxed);
+	stats->loads = atomic_load_explicit(&metrics->loads, memory_order_relaxed);
+	stats->load_failures = atomic_load_explicit(&metrics->load_failures, memory_order_relaxed);
+	stats->saves = atomic_load_explicit(&metrics->saves, memory_order_relaxed);
+	stats->saves_skipped = atomic_load_explicit(&metrics->saves_skipped, memory_order_relaxed);
+	stats->save_failures = atomic_load_explicit(&metrics->save_failures, memory_order_relaxed);
+	stats->parse_errors = atomic_load_explicit(&metrics->parse_errors, memory_order_relaxed);
+	_histogram_copy(&stats->load_ns, &metrics->load_ns);
+	_histogram_copy(&stats->save_ns, &metrics->save_ns);
+	_histogram_copy(&stats->fsync_ns, &metrics->fsync_ns);
 	return 1;
+#else
+	memset(stats, 0, sizeof(t_configuration_stats));
+	_error(cfg, CONFIGURATION_ERROR_UNSUPPORTED, "Configuration metrics are not built in.");
+	return 0;
+#endif
 }
 //---------------------------------------------------------------------------
-int configuration_get_by_index_str_value(const unsigned int index, char *value, int size){
-	if(!value){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Value is null.");
+int configuration_ctx_begin(configuration_t *cfg){
+	pthread_mutex_lock(&cfg->lock);
+	if(cfg->txn_active){
+		_error(cfg, CONFIGURATION_ERROR_TRANSACTION, "Configuration transaction already in progress.");
+		pthread_mutex_unlock(&cfg->lock);
 		return 0;
 	}
-
-
-	if(index >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Index out of bounds.");
+	cfg->txn_active = 1;
+	cfg->txn_owner = pthread_self();
+	pthread_mutex_unlock(&cfg->lock);
+	return 1;
+}
+//---------------------------------------------------------------------------
+#ifndef WIN32
+/*
+ * Append the records of the staged sets to the journal with a single write.
+ * Caller must hold the writer lock.
+ *
+ * \return 1 if appended or journaling is off.
+ */
+static int _txn_journal(t_configuration *cfg){
+	if(!cfg->use_journal){
+		return 1;
+	}
+	char buf[64];
+	size_t len = 0;
+	for(int i = 0; i < cfg->txn_num_sets; i++){
+		t_txn_set *set = &cfg->txn_sets[i];
+		if(set->key){
+			len += strlen(set->key) + strlen(_value_text(buf, sizeof(buf), set->value)) + 2;
+		}
+	}
+	char *records = malloc(len ? len : 1);
+	if(!records){
+		_error(cfg, CONFIGURATION_ERROR_NO_MEMORY, "Unable to allocate configuration journal records.");
 		return 0;
 	}
- 
-	snprintf(value, size, "%s", &configuration.items[index].val.str_value[0]);
-	return 1;
+	char *p = records;
+	for(int i = 0; i < cfg->txn_num_sets; i++){
+		t_txn_set *set = &cfg->txn_sets[i];
+		if(set->key){
+			const char *str = _value_text(buf, sizeof(buf), set->value);
+			p = stpcpy(p, set->key);
+			*p++ = ' ';
+			p = stpcpy(p, str);
+			*p++ = '\n';
+		}
+	}
+	struct iovec record = { records, len };
+	int ok = !len || _journal_write(cfg, &record, 1, len);
+	free(records);
+	return ok;
 }
+#endif
 //---------------------------------------------------------------------------
-int configuration_get_str_value(const char *key, char *value, int size){
-	if(!value){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Value is null.");
+int configuration_ctx_commit(configuration_t *cfg){
+	pthread_mutex_lock(&cfg->lock);
+	if(!_txn_owned(cfg)){
+		_error(cfg, CONFIGURATION_ERROR_TRANSACTION, "No configuration transaction in progress.");
+		pthread_mutex_unlock(&cfg->lock);
 		return 0;
 	}
+	if(!cfg->txn_num_sets){
+		_txn_end(cfg);
+		pthread_mutex_unlock(&cfg->lock);
+		return 1;
+	}
 
-	for(int i = 0; i < configuration.num_items; i++){
-		if(strcmp(configuration.items[i].key, key) == 0){
-			if(configuration.items[i].val_type != CONFIGURATION_VAL_STR){
-				snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration item is not of type str.");
-				return 0;
-			}
-			snprintf(value, size, "%s", &configuration.items[i].val.str_value[0]);
-			return 1;
+	// apply every staged set to a copy, so readers see all of them or none
+	t_config_table *table = atomic_load_explicit(&cfg->table, memory_order_relaxed);
+	int num_items = table ? atomic_load_explicit(&table->num_items, memory_order_relaxed) : 0;
+	unsigned int generation = table ? table->generation : 0;
+	// keys staged by index before a reload or load replaced the table may be new to it
+	int num_new = cfg->txn_num_new;
+	for(int i = 0; i < cfg->txn_num_sets; i++){
+		num_new += cfg->txn_sets[i].index >= 0 && cfg->txn_sets[i].generation != generation;
+	}
+	t_config_table *copy = _table_copy(cfg, table, num_items, num_items + num_new);
+	int ok = copy != NULL;
+	for(int i = 0; ok && i < cfg->txn_num_sets; i++){
+		t_txn_set *set = &cfg->txn_sets[i];
+		int index = set->index;
+		if(index >= 0 && set->generation != generation && set->key){
+			// the table was replaced, the key may be at another item or gone
+			index = -1;
+		}
+		else if(index >= num_items){
+			// an unused item staged by index that the replaced table no longer has
+			continue;
+		}
+		if(index < 0){
+			// the key may have been added since it was staged
+			index = _table_find(copy, set->key);
 		}
+		if(index < 0){
+			index = num_items++;
+			copy->items[index].key = set->key;
+			_index_insert(copy, index);
+		}
+		atomic_store_explicit(&copy->items[index].val, set->value, memory_order_relaxed);
 	}
-
-	//not found
-	snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration key %s not found.", key);
-	return 0;
+#ifndef WIN32
+	ok = ok && _txn_journal(cfg);
+#endif
+	if(ok){
+		atomic_store_explicit(&copy->num_items, num_items, memory_order_relaxed);
+		_changes_diff(cfg, table, copy);
+		_table_publish(cfg, copy);
+		atomic_fetch_add_explicit(&cfg->changes, 1, memory_order_release);
+	}
+	else{
+		_table_free(copy);
+	}
+	_txn_end(cfg);
+	_set_unlock(cfg);
+	return ok;
 }
 //---------------------------------------------------------------------------
-int configuration_set_by_index_str_value(const unsigned int index, const char *value){
-
-	if(index >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "Configuration index %d out of bounds.", index);
+int configuration_ctx_abort(configuration_t *cfg){
+	pthread_mutex_lock(&cfg->lock);
+	if(!_txn_owned(cfg)){
+		_error(cfg, CONFIGURATION_ERROR_TRANSACTION, "No configuration transaction in progress.");
+		pthread_mutex_unlock(&cfg->lock);
 		return 0;
 	}
-
-	configuration.items[index].val_type = CONFIGURATION_VAL_STR;
-	snprintf(configuration.items[index].val.str_value, CONFIGURATION_VAL_STR_LEN, "%s", value);
-	configuration.saved = 0;
+	_txn_end(cfg);
+	pthread_mutex_unlock(&cfg->lock);
 	return 1;
 }
 //---------------------------------------------------------------------------
-int configuration_set_str_value(const char *key, const char *value){
-	int key_found = 0;
-	int i = 0;
-	for(i = 0; i < configuration.num_items; i++){
-		if(strcmp(configuration.items[i].key, key) == 0){
-			key_found = 1;
-			break;
-		}
+const char *configuration_ctx_get_error(configuration_t *cfg){
+	static _Thread_local char msg[CONFIGURATION_ERROR_MSG_LEN];
+	t_config_error *error = &_last_error;
+	if(error->cfg != cfg || error->code == CONFIGURATION_OK){
+		return "";
 	}
-
-	if(i >= CONFIGURATION_ITEMS_MAX){
-		snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "No more space in configuration.");
-		printf("ERROR: no more space in configuration.\n");
-		return 0;
+	int len;
+	if(error->has_str && error->has_number){
+		len = snprintf(msg, sizeof(msg), error->format, error->str, error->number);
 	}
-
-	if(!key_found){ //add new item
-		snprintf(configuration.items[i].key, CONFIGURATION_KEY_MAX, "%s", key);
-		configuration.num_items = configuration.num_items + 1;
+	else if(error->has_str){
+		len = snprintf(msg, sizeof(msg), error->format, error->str);
 	}
-
-	configuration.items[i].val_type = CONFIGURATION_VAL_STR;
-	snprintf(configuration.items[i].val.str_value, CONFIGURATION_VAL_STR_LEN, "%s", value);
-	configuration.saved = 0;
-	return 1;
+	else if(error->has_number){
+		len = snprintf(msg, sizeof(msg), error->format, error->number);
+	}
+	else{
+		len = snprintf(msg, sizeof(msg), "%s", error->format);
+	}
+	if(error->sys_errno && len >= 0 && (size_t)len < sizeof(msg)){
+		snprintf(msg + len, sizeof(msg) - len, " %s.", strerror(error->sys_errno));
+	}
+	return msg;
+}
+//---------------------------------------------------------------------------
+t_configuration_error configuration_ctx_get_error_code(configuration_t *cfg){
+	return _last_error.cfg == cfg ? _last_error.code : CONFIGURATION_OK;
+}
+//---------------------------------------------------------------------------
+void configuration_ctx_set_log(configuration_t *cfg, config_log_t *callback, void *ctx){
+	cfg->log = callback;
+	cfg->log_ctx = ctx;
+}
+//---------------------------------------------------------------------------
+// Default configuration wrappers
+//---------------------------------------------------------------------------
+void configuration_reset(){
+	configuration_ctx_reset(&configuration);
+}
+//---------------------------------------------------------------------------
+int configuration_init(char config_dirname[], char config_filename[]){
+	return configuration_ctx_init(&configuration, config_dirname, config_filename);
+}
+//---------------------------------------------------------------------------
+int configuration_init_schema(const t_configuration_schema *schema){
+	return configuration_ctx_init_schema(&configuration, schema);
+}
+//---------------------------------------------------------------------------
+int configuration_init_indexes(const t_configuration_index_mapping mappings[], int num_mappings){
+	return configuration_ctx_init_indexes(&configuration, mappings, num_mappings);
+}
+//---------------------------------------------------------------------------
+int configuration_load(){
+	return configuration_ctx_load(&configuration);
+}
+//---------------------------------------------------------------------------
+void configuration_use_snapshot(int enable){
+	configuration_ctx_use_snapshot(&configuration, enable);
+}
+//---------------------------------------------------------------------------
+int configuration_use_journal(int enable){
+	return configuration_ctx_use_journal(&configuration, enable);
+}
+//---------------------------------------------------------------------------
+int configuration_watch(){
+	return configuration_ctx_watch(&configuration);
+}
+//---------------------------------------------------------------------------
+void configuration_unwatch(){
+	configuration_ctx_unwatch(&configuration);
+}
+//---------------------------------------------------------------------------
+int configuration_save(){
+	return configuration_ctx_save(&configuration);
+}
+//---------------------------------------------------------------------------
+int configuration_use_system_config(int enable){
+	return configuration_ctx_use_system_config(&configuration, enable);
+}
+//---------------------------------------------------------------------------
+int configuration_use_env(const char *prefix){
+	return configuration_ctx_use_env(&configuration, prefix);
+}
+//---------------------------------------------------------------------------
+int configuration_save_async(config_saved_t *callback, void *ctx){
+	return configuration_ctx_save_async(&configuration, callback, ctx);
+}
+//---------------------------------------------------------------------------
+int configuration_flush(){
+	return configuration_ctx_flush(&configuration);
+}
+//---------------------------------------------------------------------------
+const char * configuration_get_configdir(){
+	return configuration_ctx_get_configdir(&configuration);
+}
+//---------------------------------------------------------------------------
+int configuration_get_by_index_int_value(const unsigned int index, int *value){
+	return configuration_ctx_get_by_index_int_value(&configuration, index, value);
+}
+//---------------------------------------------------------------------------
+int configuration_get_int_value(const char *key, int *value){
+	return configuration_ctx_get_int_value(&configuration, key, value);
+}
+//---------------------------------------------------------------------------
+int configuration_set_by_index_int_value(const unsigned int index, int value){
+	return configuration_ctx_set_by_index_int_value(&configuration, index, value);
+}
+//---------------------------------------------------------------------------
+int configuration_set_int_value(const char *key, int value){
+	return configuration_ctx_set_int_value(&configuration, key, value);
+}
+//---------------------------------------------------------------------------
+int configuration_get_by_index_float_value(const unsigned int index, float *value){
+	return configuration_ctx_get_by_index_float_value(&configuration, index, value);
+}
+//---------------------------------------------------------------------------
+int configuration_get_float_value(const char *key, float *value){
+	return configuration_ctx_get_float_value(&configuration, key, value);
+}
+//---------------------------------------------------------------------------
+int configuration_set_by_index_float_value(const unsigned int index, float value){
+	return configuration_ctx_set_by_index_float_value(&configuration, index, value);
+}
+//---------------------------------------------------------------------------
+int configuration_set_float_value(const char *key, float value){
+	return configuration_ctx_set_float_value(&configuration, key, value);
+}
+//---------------------------------------------------------------------------
+int configuration_get_by_index_str_value(const unsigned int index, char *value, int size){
+	return configuration_ctx_get_by_index_str_value(&configuration, index, value, size);
+}
+//---------------------------------------------------------------------------
+int configuration_get_str_value(const char *key, char *value, int size){
+	return configuration_ctx_get_str_value(&configuration, key, value, size);
+}
+//---------------------------------------------------------------------------
+int configuration_set_by_index_str_value(const unsigned int index, const char *value){
+	return configuration_ctx_set_by_index_str_value(&configuration, index, value);
+}
+//---------------------------------------------------------------------------
+int configuration_set_str_value(const char *key, const char *value){
+	return configuration_ctx_set_str_value(&configuration, key, value);
+}
+//---------------------------------------------------------------------------
+configuration_handle_t *configuration_lookup(const char *key){
+	return configuration_ctx_lookup(&configuration, key);
+}
+//---------------------------------------------------------------------------
+int configuration_subscribe(const char *prefix, config_changed_t *callback, void *ctx){
+	return configuration_ctx_subscribe(&configuration, prefix, callback, ctx);
+}
+//---------------------------------------------------------------------------
+int configuration_unsubscribe(int id){
+	return configuration_ctx_unsubscribe(&configuration, id);
+}
+//---------------------------------------------------------------------------
+int configuration_foreach_prefix(const char *prefix, config_foreach_t *callback, void *ctx){
+	return configuration_ctx_foreach_prefix(&configuration, prefix, callback, ctx);
+}
+//---------------------------------------------------------------------------
+long long configuration_stream(const char *path, config_entry_t *on_entry, void *ctx){
+	return configuration_ctx_stream(&configuration, path, on_entry, ctx);
+}
+//---------------------------------------------------------------------------
+int configuration_get_stats(t_configuration_stats *stats){
+	return configuration_ctx_get_stats(&configuration, stats);
+}
+//---------------------------------------------------------------------------
+int configuration_begin(){
+	return configuration_ctx_begin(&configuration);
+}
+//---------------------------------------------------------------------------
+int configuration_commit(){
+	return configuration_ctx_commit(&configuration);
+}
+//---------------------------------------------------------------------------
+int configuration_abort(){
+	return configuration_ctx_abort(&configuration);
 }
 //---------------------------------------------------------------------------
 const char *configuration_get_error(){
-	return configuration.error_msg;
+	return configuration_ctx_get_error(&configuration);
+}
+//---------------------------------------------------------------------------
+t_configuration_error configuration_get_error_code(){
+	return configuration_ctx_get_error_code(&configuration);
+}
+//---------------------------------------------------------------------------
+void configuration_set_log(config_log_t *callback, void *ctx){
+	configuration_ctx_set_log(&configuration, callback, ctx);
 }
 //---------------------------------------------------------------------------
@@ -4,20 +4,141 @@
 #ifndef CONFIGURATION_H
 #define CONFIGURATION_H
 
+/**
+ * Opaque configuration context. Each context holds an independent set of
+ * configuration items, file location and error message.
+ *
+ * The configuration_* functions without a context operate on a default
+ * context, see configuration_default().
+ *
+ * Gets may run concurrently with each other and with sets from any number of
+ * threads. Gets never block. Reset and destroy must not race other calls on
+ * the same context.
+ */
+typedef struct s_configuration configuration_t;
+
+/**
+ * Opaque handle of a configuration key, see configuration_lookup().
+ */
+typedef struct s_configuration_handle configuration_handle_t;
+
+/**
+ * Type of a configuration value.
+ */
+typedef enum config_val_type { CONFIGURATION_VAL_INT, CONFIGURATION_VAL_FLOAT, CONFIGURATION_VAL_STR } t_conf_val_type;
+
+/**
+ * Kind of the most recent error, see configuration_get_error_code().
+ */
+typedef enum configuration_error {
+	CONFIGURATION_OK = 0,
+	CONFIGURATION_ERROR_NOT_FOUND, // key or subscription
+	CONFIGURATION_ERROR_INDEX, // index out of bounds
+	CONFIGURATION_ERROR_TYPE, // item has a value of another type
+	CONFIGURATION_ERROR_NULL_VALUE,
+	CONFIGURATION_ERROR_NO_MEMORY,
+	CONFIGURATION_ERROR_INVALID, // empty names or invalid mappings
+	CONFIGURATION_ERROR_CONFIGDIR, // config directory not found or created
+	CONFIGURATION_ERROR_SYSTEM, // file or thread operation failed
+	CONFIGURATION_ERROR_MALFORMED, // config file is not text
+	CONFIGURATION_ERROR_TRANSACTION,
+	CONFIGURATION_ERROR_UNSUPPORTED // on this platform or in this build
+} t_configuration_error;
+
+/**
+ * Severity of a log message, see configuration_set_log().
+ */
+typedef enum configuration_log_level { CONFIGURATION_LOG_ERROR, CONFIGURATION_LOG_WARNING } t_configuration_log_level;
+
+/**
+ * Function called with messages the library would otherwise write to stderr.
+ *
+ * \param cfg Context the message is about.
+ * \param level Severity of the message.
+ * \param msg Message without a trailing newline, valid during the call.
+ * \param ctx Pointer given to configuration_set_log().
+ */
+typedef void (config_log_t)(configuration_t *cfg, t_configuration_log_level level, const char *msg, void *ctx);
+
+/**
+ * Item of a configuration schema, with its type and default value.
+ */
+typedef struct configuration_schema_item {
+	const char *key;
+	t_conf_val_type val_type;
+	int int_default;
+	float float_default;
+	const char *str_default;
+} t_configuration_schema_item;
+
+/**
+ * Fixed set of configuration items, each kept at its position in items.
+ * Schemas are generated from a schema file by tools/configuration_schema,
+ * together with an enum of the item indexes.
+ *
+ * Keys are found with a minimal perfect hash: the FNV-1a hash of a key picks
+ * one of num_buckets buckets, and the bucket's displacement picks one of
+ * num_items slots, which holds the index of the only item the key can be.
+ */
+typedef struct configuration_schema {
+	const t_configuration_schema_item *items;
+	unsigned int num_items;
+	const unsigned short *displacements;
+	unsigned int num_buckets; // power of two
+	const unsigned int *slots;
+} t_configuration_schema;
+
+/**
+ * Create a new, empty configuration context.
+ *
+ * \return New context, or NULL if it could not be allocated.
+ */
+configuration_t *configuration_create();
+
+/**
+ * Release a configuration context and all of its items.
+ *
+ * \param cfg Context created with configuration_create().
+ */
+void configuration_destroy(configuration_t *cfg);
+
+/**
+ * Get the default configuration context used by the functions without a context.
+ *
+ * \return The default context.
+ */
+configuration_t *configuration_default();
+
 /**
  * Reset the configuration data and initialization.
+ * The options set by configuration_use_snapshot(), configuration_use_journal(),
+ * configuration_use_system_config(), configuration_use_env() and
+ * configuration_set_log() go back to their defaults. The dirname and filename
+ * are kept until the next init.
+ * No other thread may be using the configuration.
  */
 void configuration_reset();
 
 /**
  * Initialize the configuration, find location for config file.
  *
- * \param config_dirname The directory name to contain configuration.
- * \param config_filename The configuration filename.
+ * \param config_dirname The directory name to contain configuration, at most 31 characters.
+ * \param config_filename The configuration filename, at most 31 characters.
  * \return 1 if suitable configuration directory was found.
  */
 int configuration_init(char config_dirname[], char config_filename[]);
 
+/**
+ * Set up the items of a generated schema at their indexes, with their
+ * default values. Default values are used as generated, without parsing, and
+ * keys in a loaded file are matched to their index with the schema's perfect
+ * hash. The schema must stay valid until reset.
+ *
+ * \param schema Schema generated by tools/configuration_schema.
+ * \return 1 if the schema items were set up.
+ */
+int configuration_init_schema(const t_configuration_schema *schema);
+
 /**
  * Load the configuration file.
  *
@@ -25,13 +146,157 @@ int configuration_init(char config_dirname[], char config_filename[]);
  */
 int configuration_load();
 
+/**
+ * Keep a binary snapshot of the loaded configuration next to the
+ * configuration file, named after it with .cache appended. While the file is
+ * unchanged, loads map the snapshot instead of parsing the file. A stale or
+ * corrupt snapshot is ignored and rewritten after the file is parsed.
+ *
+ * \param enable 1 to use snapshots, 0 to always parse the file.
+ */
+void configuration_use_snapshot(int enable);
+
+/**
+ * Append every set to a journal next to the configuration file, named after
+ * it with .journal appended, so a changed value is persisted without
+ * rewriting the file. Load replays the journal on top of the file, and save
+ * folds it into the file. A set folds it in once the journal grows past
+ * CONFIGURATION_JOURNAL_COMPACT_SIZE bytes.
+ *
+ * Journaled sets survive the process exiting or crashing, but are not synced
+ * to disk until the next save.
+ *
+ * \param enable 1 to journal sets, 0 to only persist values on save.
+ * \return 1 if the journal setting was applied.
+ */
+int configuration_use_journal(int enable);
+
+/**
+ * Read system-wide config files beneath the user's config file. For each
+ * directory of XDG_CONFIG_DIRS, or /etc/xdg if it is not set, the file with
+ * the same dirname and filename is read, the first directory taking
+ * precedence. The user's config file takes precedence over all of them and
+ * need not exist.
+ *
+ * The defaults and system files are read once by the first load and reused
+ * by reloads of the user's config file, until configuration_reset() or a
+ * change of file, mappings or schema. Save leaves out values the system
+ * files or defaults already hold.
+ *
+ * \param enable 1 to read system config files.
+ * \return 1 if the setting was applied, it takes effect on the next load.
+ */
+int configuration_use_system_config(int enable);
+
+/**
+ * Override values with environment variables, read on every load. A
+ * variable named prefix followed by a key, uppercased with any character but
+ * letters and digits replaced by '_', overrides that key. A variable matching
+ * no key adds the rest of its name, lowercased, as a key.
+ *
+ * Overrides are not saved. Save keeps the value beneath an override unless
+ * the key was set since the load.
+ *
+ * \param prefix Variable name prefix such as "MYAPP_", or NULL for no overrides.
+ * \return 1 if the setting was applied, it takes effect on the next load.
+ */
+int configuration_use_env(const char *prefix);
+
+/**
+ * Start reloading the configuration file in the background whenever it changes.
+ * Changes are debounced and the new contents are swapped in atomically, so
+ * readers always see either the old or the new configuration. A file that
+ * cannot be read or is malformed keeps the previous configuration.
+ * Files written by save are not reloaded. Without a journal, a change made
+ * while there are unsaved sets is not reloaded and a warning is logged; with
+ * the journal the unsaved sets are replayed over the reloaded file.
+ * Only supported on Linux.
+ *
+ * \return 1 if the configuration file is being watched.
+ */
+int configuration_watch();
+
+/**
+ * Stop reloading the configuration file in the background.
+ */
+void configuration_unwatch();
+
 /**
  * Save the configuration file.
  *
+ * The file is written beside the configuration file, synced to disk and
+ * renamed over it, so a crash during save leaves either the old or the new
+ * file. If no value changed since the file was last loaded or saved, nothing
+ * is written.
+ *
  * \return 1 if configuration was saved successfully.
  */
 int configuration_save();
 
+/**
+ * Function called when a save requested with configuration_save_async() has
+ * finished.
+ *
+ * \param cfg Context that was saved.
+ * \param saved 1 if the configuration was saved successfully, see configuration_get_error() otherwise.
+ * \param ctx Pointer given to configuration_save_async().
+ */
+typedef void (config_saved_t)(configuration_t *cfg, int saved, void *ctx);
+
+/**
+ * Save the configuration file on a background thread, like
+ * configuration_save(). Requests made while a save is running are served
+ * together by one more save. A save writes the values as they are when it
+ * runs, not as they were when it was requested, so it includes every change
+ * made before the request and may include later ones. To save a consistent
+ * set of changes, make them in a transaction before requesting the save.
+ *
+ * The callback runs on the save thread, once per request, oldest first. It
+ * may call configuration_get_error() and any function except
+ * configuration_flush(). configuration_reset() finishes the requested saves
+ * and stops the thread.
+ *
+ * \param callback Function to call when the save has finished, or NULL.
+ * \param ctx Pointer passed to callback.
+ * \return 1 if the save was requested.
+ */
+int configuration_save_async(config_saved_t *callback, void *ctx);
+
+/**
+ * Wait until every save requested with configuration_save_async() so far has
+ * finished, for example before exiting.
+ *
+ * \return 1 if the last background save succeeded, or none was requested.
+ */
+int configuration_flush();
+
+/**
+ * Start a transaction. Until it is committed or aborted, sets by the calling
+ * thread are staged instead of applied, and gets by it still return the
+ * values from before the transaction. Sets by other threads are applied as
+ * usual. One transaction can be in progress at a time.
+ *
+ * \return 1 if the transaction was started.
+ */
+int configuration_begin();
+
+/**
+ * Apply the sets staged since configuration_begin in one step. Readers see
+ * either all of them or none, and with the journal enabled they are appended
+ * with a single write. On failure none of the sets are applied. Either way
+ * the transaction ends.
+ *
+ * \return 1 if the staged sets were applied.
+ */
+int configuration_commit();
+
+/**
+ * Discard the sets staged since configuration_begin and end the transaction.
+ *
+ * \return 1 if a transaction was in progress.
+ */
+int configuration_abort();
+
 /**
  * Get the current configuration directory.
  *
@@ -120,6 +385,53 @@ int configuration_set_by_index_str_value(const unsigned int index, const char *v
  */
 int configuration_set_str_value(const char *key, const char *value);
 
+/**
+ * Resolve a key once for repeated reads. Reads through the handle skip the
+ * key search as long as the items keep their places, and find the key again
+ * after a load, reload or index mapping has moved them. A handle may be
+ * shared between threads and must be freed before its configuration is
+ * destroyed.
+ *
+ * \param key Key to resolve, which does not have to be mapped to an index.
+ * \return Handle to free with configuration_handle_free(), or NULL if key was not found.
+ */
+configuration_handle_t *configuration_lookup(const char *key);
+
+/**
+ * Free a handle returned by configuration_lookup().
+ *
+ * \param handle Handle to free, may be NULL.
+ */
+void configuration_handle_free(configuration_handle_t *handle);
+
+/**
+ * Get the integer value of the key resolved by handle.
+ *
+ * \param handle Handle returned by configuration_lookup().
+ * \param value Pointer to integer value fetched from configuration.
+ * \return 1 if a valid integer value was found.
+ */
+int configuration_get_int_by_handle(configuration_handle_t *handle, int *value);
+
+/**
+ * Get the float value of the key resolved by handle.
+ *
+ * \param handle Handle returned by configuration_lookup().
+ * \param value Pointer to float value fetched from configuration.
+ * \return 1 if a valid float value was found.
+ */
+int configuration_get_float_by_handle(configuration_handle_t *handle, float *value);
+
+/**
+ * Get the string value of the key resolved by handle.
+ *
+ * \param handle Handle returned by configuration_lookup().
+ * \param value Pointer to caller-provided char buffer fetched from configuration.
+ * \param size of provided caller-provided char buffer.
+ * \return 1 if a valid string value was found.
+ */
+int configuration_get_str_by_handle(configuration_handle_t *handle, char *value, int size);
+
 /* function prototypes for getting and setting */
 typedef int (config_get_int_t)(const char *key, int *value);
 typedef int (config_get_float_t)(const char *key, float *value);
@@ -128,10 +440,216 @@ typedef int (config_set_int_t)(const char *key, int value);
 typedef int (config_set_float_t)(const char *key, float value);
 typedef int (config_set_str_t)(const char *key, const char *value);
 
+#define CONFIGURATION_HISTOGRAM_BUCKETS 32
+
+/**
+ * Latency histogram. Bucket i counts durations from 2^i up to 2^(i+1) ns,
+ * the last bucket also counts anything longer.
+ */
+typedef struct configuration_histogram {
+	unsigned long count;
+	unsigned long long total_ns;
+	unsigned long buckets[CONFIGURATION_HISTOGRAM_BUCKETS];
+} t_configuration_histogram;
+
+/**
+ * Counters and latencies since the configuration was created or reset.
+ */
+typedef struct configuration_stats {
+	unsigned long gets; // by key, index or handle
+	unsigned long get_misses; // of keys or indexes not found
+	unsigned long sets; // including sets staged by transactions
+	unsigned long loads; // including reloads
+	unsigned long load_failures;
+	unsigned long saves; // that wrote the config file
+	unsigned long saves_skipped; // with nothing changed
+	unsigned long save_failures;
+	unsigned long parse_errors; // malformed files, entries that could not be stored and torn journal records
+	t_configuration_histogram load_ns;
+	t_configuration_histogram save_ns;
+	t_configuration_histogram fsync_ns; // of the config file and its directory
+} t_configuration_stats;
+
+/**
+ * Get a snapshot of the runtime metrics. Metrics are only kept when the
+ * library is built with CONFIGURATION_METRICS defined, otherwise they cost
+ * nothing and this fails. Counters are updated independently, so a snapshot
+ * taken while other threads are busy may be slightly inconsistent.
+ *
+ * \param stats Stats to fill in, zeroed if metrics are not built in.
+ * \return 1 if metrics are built in.
+ */
+int configuration_get_stats(t_configuration_stats *stats);
+
+/**
+ * Function called with the keys that changed, see configuration_subscribe().
+ *
+ * \param cfg Context the keys changed in.
+ * \param keys Changed keys starting with the subscribed prefix, sorted, valid during the call.
+ * \param num_keys Number of keys, at least one.
+ * \param ctx Pointer given to configuration_subscribe().
+ */
+typedef void (config_changed_t)(configuration_t *cfg, const char *const keys[], int num_keys, void *ctx);
+
+/**
+ * Call callback when values of keys starting with prefix change, through a
+ * set, a transaction commit, a load or a reload. Changed keys are found by
+ * comparing values, so setting a key to its current value is not a change,
+ * and a reload reports only the keys whose values differ or that were added
+ * or removed. Changes made while callbacks are running, by them or by other
+ * threads, are coalesced into one more call per subscriber after they
+ * return. Callbacks run one at a time on a thread that made a change, and
+ * may get and set values. Subscriptions end with configuration_reset().
+ *
+ * \param prefix Key prefix to watch, a whole key to watch just that key or "" for all keys.
+ * \param callback Function to call with the changed keys.
+ * \param ctx Pointer passed to callback.
+ * \return Subscription id for configuration_unsubscribe(), or 0 on failure.
+ */
+int configuration_subscribe(const char *prefix, config_changed_t *callback, void *ctx);
+
+/**
+ * Stop calling the callback of a subscription.
+ *
+ * \param id Subscription id returned by configuration_subscribe().
+ * \return 1 if the subscription was active.
+ */
+int configuration_unsubscribe(int id);
+
+/**
+ * Value of an item passed to a config_foreach_t callback.
+ */
+typedef struct configuration_value {
+	t_conf_val_type type;
+	union {
+		int int_value;
+		float float_value;
+		const char *str_value; // valid during the callback
+	};
+} t_configuration_value;
+
 /**
- * Get the most recent error.
+ * Function called for each item of a prefix query, see configuration_foreach_prefix().
  *
- * \return Error string.
+ * \param cfg Context of the item.
+ * \param key Key of the item, valid until configuration_reset().
+ * \param value Value of the item, valid during the call.
+ * \param ctx Pointer given to configuration_foreach_prefix().
+ * \return 1 to continue with the next item, 0 to stop.
+ */
+typedef int (config_foreach_t)(configuration_t *cfg, const char *key, const t_configuration_value *value, void *ctx);
+
+/**
+ * Call callback for each item with a key starting with prefix, in key order.
+ * Keys may be dotted, and keys following a [section] line of the config file
+ * are read as section.key, so "db.pool." enumerates the items beneath db.pool
+ * however the file groups them. Keys are kept sorted, so the time taken grows with the number of
+ * matching items rather than the size of the configuration, and keys and
+ * values are passed without being copied. Like a get, the query does not
+ * block. It passes the items that existed when it started, each with its value
+ * at the time it is passed. The callback may get and set values, keys added by
+ * its sets are not passed to it.
+ *
+ * \param prefix Key prefix, "" for all items.
+ * \param callback Function to call with each matching item.
+ * \param ctx Pointer passed to callback.
+ * \return Number of items passed to callback, or -1 on failure.
+ */
+int configuration_foreach_prefix(const char *prefix, config_foreach_t *callback, void *ctx);
+
+/**
+ * Function called for each entry of a streamed file, see configuration_stream().
+ *
+ * \param cfg Context streaming the file.
+ * \param key Key of the entry, with its section, valid during the call.
+ * \param value Value of the entry, valid during the call.
+ * \param ctx Pointer given to configuration_stream().
+ * \return 1 to continue with the next entry, 0 to stop.
+ */
+typedef int (config_entry_t)(configuration_t *cfg, const char *key, const t_configuration_value *value, void *ctx);
+
+/**
+ * Pass each entry of a file in the config file format to on_entry, parsed
+ * and typed as a load would, without storing it. The file is read in fixed
+ * size chunks, so memory use does not grow with the file, which may be larger
+ * than memory. Entries are passed in file order, repeated keys included.
+ * Lines longer than a chunk (64 KiB) are skipped. The configuration is not
+ * changed.
+ *
+ * \param path Path of the file, not relative to the config directory.
+ * \param on_entry Function to call with each entry.
+ * \param ctx Pointer passed to on_entry.
+ * \return Number of entries passed to on_entry, which may be more than fit in an int, or -1 on failure, which may come after some entries were passed.
+ */
+long long configuration_stream(const char *path, config_entry_t *on_entry, void *ctx);
+
+/**
+ * Get the most recent error of the calling thread. The message is formatted
+ * by this call, failing calls only record what went wrong. It stays valid
+ * until the next call on the same thread.
+ *
+ * \return Error string, empty if there was no error.
  */
 const char *configuration_get_error();
+
+/**
+ * Get the kind of the most recent error of the calling thread.
+ *
+ * \return Error code, CONFIGURATION_OK if there was no error.
+ */
+t_configuration_error configuration_get_error_code();
+
+/**
+ * Send the messages of the library to a callback instead of stderr. The
+ * callback may be called from any thread that uses the configuration,
+ * including the watch thread, and must not call back into the library
+ * except for configuration_get_error(). It is removed by configuration_reset().
+ *
+ * \param callback Function to call with each message, NULL for stderr.
+ * \param ctx Pointer passed to callback.
+ */
+void configuration_set_log(config_log_t *callback, void *ctx);
+
+/*
+ * Context versions of the functions above. Each behaves like the function of
+ * the same name without _ctx, but operates on the provided context.
+ */
+void configuration_ctx_reset(configuration_t *cfg);
+int configuration_ctx_init(configuration_t *cfg, const char *config_dirname, const char *config_filename);
+int configuration_ctx_init_schema(configuration_t *cfg, const t_configuration_schema *schema);
+int configuration_ctx_load(configuration_t *cfg);
+void configuration_ctx_use_snapshot(configuration_t *cfg, int enable);
+int configuration_ctx_use_journal(configuration_t *cfg, int enable);
+int configuration_ctx_use_system_config(configuration_t *cfg, int enable);
+int configuration_ctx_use_env(configuration_t *cfg, const char *prefix);
+int configuration_ctx_watch(configuration_t *cfg);
+void configuration_ctx_unwatch(configuration_t *cfg);
+int configuration_ctx_save(configuration_t *cfg);
+int configuration_ctx_save_async(configuration_t *cfg, config_saved_t *callback, void *ctx);
+int configuration_ctx_flush(configuration_t *cfg);
+const char *configuration_ctx_get_configdir(configuration_t *cfg);
+int configuration_ctx_get_by_index_int_value(configuration_t *cfg, const unsigned int index, int *value);
+int configuration_ctx_get_int_value(configuration_t *cfg, const char *key, int *value);
+int configuration_ctx_set_by_index_int_value(configuration_t *cfg, const unsigned int index, int value);
+int configuration_ctx_set_int_value(configuration_t *cfg, const char *key, int value);
+int configuration_ctx_get_by_index_float_value(configuration_t *cfg, const unsigned int index, float *value);
+int configuration_ctx_get_float_value(configuration_t *cfg, const char *key, float *value);
+int configuration_ctx_set_by_index_float_value(configuration_t *cfg, const unsigned int index, float value);
+int configuration_ctx_set_float_value(configuration_t *cfg, const char *key, float value);
+int configuration_ctx_get_by_index_str_value(configuration_t *cfg, const unsigned int index, char *value, int size);
+int configuration_ctx_get_str_value(configuration_t *cfg, const char *key, char *value, int size);
+int configuration_ctx_set_by_index_str_value(configuration_t *cfg, const unsigned int index, const char *value);
+int configuration_ctx_set_str_value(configuration_t *cfg, const char *key, const char *value);
+configuration_handle_t *configuration_ctx_lookup(configuration_t *cfg, const char *key);
+int configuration_ctx_subscribe(configuration_t *cfg, const char *prefix, config_changed_t *callback, void *ctx);
+int configuration_ctx_unsubscribe(configuration_t *cfg, int id);
+int configuration_ctx_foreach_prefix(configuration_t *cfg, const char *prefix, config_foreach_t *callback, void *ctx);
+long long configuration_ctx_stream(configuration_t *cfg, const char *path, config_entry_t *on_entry, void *ctx);
+int configuration_ctx_get_stats(configuration_t *cfg, t_configuration_stats *stats);
+int configuration_ctx_begin(configuration_t *cfg);
+int configuration_ctx_commit(configuration_t *cfg);
+int configuration_ctx_abort(configuration_t *cfg);
+const char *configuration_ctx_get_error(configuration_t *cfg);
+t_configuration_error configuration_ctx_get_error_code(configuration_t *cfg);
+void configuration_ctx_set_log(configuration_t *cfg, config_log_t *callback, void *ctx);
 #endif //CONFIGURATION_H
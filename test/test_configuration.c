@@ -1,7 +1,10 @@
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "../../Unity/src/unity.h"
 #include "../src/configuration.h"
+#include "test_schema.h"
 
 char *xdg_config_home_orig = NULL;
 char *home_orig = NULL;
@@ -47,6 +50,9 @@ void test_configuration_init(){
 	configuration_reset();
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_init("fail",""), "Configuration init for empty filename should fail.");
 	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(0, strnlen(configuration_get_error(), 32), "There should be an error message.");
+	configuration_reset();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_init("fail", "a_filename_longer_than_the_limit.ini"), "Configuration init for too long a filename should fail.");
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_ERROR_INVALID, configuration_get_error_code());
 
 	// test usage of XDG_CONFIG_HOME
 	configuration_reset();
@@ -148,6 +154,97 @@ void test_configuration_save(){
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, strncmp("three", strval, 32), "Retrieved strval should have been three.");
 }
 
+struct saves {
+	int calls;
+	int saved;
+};
+
+void count_save(configuration_t *cfg, int saved, void *ctx){
+	struct saves *saves = ctx;
+	saves->calls++;
+	saves->saved = saved;
+}
+
+void test_configuration_save_async(){
+	configuration_init("configurationtest", "test_configuration_saved.ini");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_flush(), "Flush without saves should succeed.");
+
+	struct saves saves = { 0 };
+	for(int i = 0; i < 10; i++){
+		configuration_set_int_value("testint", i);
+		TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save_async(count_save, &saves), "Save request should succeed.");
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_flush(), "Flush should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(10, saves.calls, "Every request should have been called back.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, saves.saved, "Background save should succeed.");
+
+	// reset finishes requested saves
+	configuration_set_str_value("teststr", "async");
+	configuration_save_async(NULL, NULL);
+	configuration_reset();
+	configuration_init("configurationtest", "test_configuration_saved.ini");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Saved configuration should have been loaded.");
+	int intval = 0;
+	configuration_get_int_value("testint", &intval);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(9, intval, "Last value should have been saved.");
+	char strval[32] = {};
+	configuration_get_str_value("teststr", &strval[0], 32);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("async", strval, "Save requested before reset should have been written.");
+}
+
+void test_configuration_layers(){
+	FILE *f = fopen("fixtures/configurationtest/test_layers.ini", "w");
+	fprintf(f, "overridden user\n");
+	fclose(f);
+	setenv("XDG_CONFIG_DIRS", "./fixtures/system1:./fixtures/system2", 1);
+	setenv("LAYERTEST_ENVKEY", "42", 1);
+	setenv("LAYERTEST_WINDOW_WIDTH", "800", 1);
+	setenv("LAYERTEST_NEW_KEY", "new", 1);
+	setenv("LAYERTEST_A_VERY_LONG_ENVIRONMENT_VARIABLE_KEY", "7", 1);
+	setenv("LAYERTEST_two words", "x y", 1);
+	configuration_init("configurationtest", "test_layers.ini");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_use_system_config(1), "System config should be enabled.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_use_env("LAYERTEST_"), "Environment overrides should be enabled.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Layers should have been loaded.");
+
+	char strval[32] = {};
+	int intval = 0;
+	configuration_get_str_value("shared", &strval[0], 32);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("system1", strval, "First system directory should take precedence.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("system2only", &intval), "Both system files should be read.");
+	configuration_get_str_value("overridden", &strval[0], 32);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("user", strval, "User file should take precedence over system files.");
+	configuration_get_int_value("envkey", &intval);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(42, intval, "Environment should take precedence over files.");
+	configuration_get_int_value("window.width", &intval);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(800, intval, "Environment name should match a dotted key.");
+	configuration_get_str_value("new_key", &strval[0], 32);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("new", strval, "Unmatched variable should add a key.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("a_very_long_environment_variable_key", &intval), "Long variable name should add a key.");
+	TEST_ASSERT_EQUAL_INT(7, intval);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value("two words", &strval[0], 32), "Variable name with a space should be the whole key.");
+	TEST_ASSERT_EQUAL_STRING("x y", strval);
+
+	// only values of the user layer are saved
+	configuration_set_int_value("userset", 5);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save should succeed.");
+	char saved[256] = {};
+	f = fopen("fixtures/configurationtest/test_layers.ini", "r");
+	fread(saved, 1, sizeof(saved) - 1, f);
+	fclose(f);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("overridden user\nuserset 5\n", saved, "Save should leave out other layers.");
+
+	unsetenv("XDG_CONFIG_DIRS");
+	unsetenv("LAYERTEST_ENVKEY");
+	unsetenv("LAYERTEST_WINDOW_WIDTH");
+	unsetenv("LAYERTEST_NEW_KEY");
+	unsetenv("LAYERTEST_A_VERY_LONG_ENVIRONMENT_VARIABLE_KEY");
+	unsetenv("LAYERTEST_two words");
+	configuration_use_system_config(0);
+	configuration_use_env(NULL);
+	unlink("fixtures/configurationtest/test_layers.ini");
+}
+
 void test_configuration_get_configdir(){
 	configuration_reset();
 	setenv("XDG_CONFIG_HOME", "./fakedir", 1);
@@ -220,6 +317,384 @@ void test_configuration_get_by_index_str_value(){
 }
 */
 
+void test_configuration_contexts(){
+	configuration_t *a = configuration_create();
+	configuration_t *b = configuration_create();
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(0, a != NULL && b != NULL, "Contexts should have been created.");
+
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_init(a, "configurationtest", "test_configuration.ini"), "Context init should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_load(a), "Context load should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_set_int_value(b, "testint", 42), "Context set should succeed.");
+
+	// each context has its own items
+	int intval = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_get_int_value(a, "testint", &intval), "Get testint from a should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, intval, "testint in a should be loaded value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_get_int_value(b, "testint", &intval), "Get testint from b should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(42, intval, "testint in b should be set value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_int_value("testint", &intval), "Default context should not see other contexts.");
+
+	// and its own error message
+	char strval[32];
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_ctx_get_str_value(b, "teststr", &strval[0], 32), "teststr should not be in b.");
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(0, strnlen(configuration_ctx_get_error(b), 32), "b should have an error message.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, strnlen(configuration_ctx_get_error(a), 32), "a should not have an error message.");
+
+	TEST_ASSERT_EQUAL_PTR_MESSAGE(configuration_default(), configuration_default(), "Default context should be stable.");
+	configuration_destroy(a);
+	configuration_destroy(b);
+}
+
+// wait up to about two seconds for key to have value
+int wait_for_int_value(configuration_t *cfg, const char *key, int value){
+	int intval = 0;
+	for(int i = 0; i < 200; i++){
+		if(configuration_ctx_get_int_value(cfg, key, &intval) && intval == value){
+			return 1;
+		}
+		usleep(10000);
+	}
+	return 0;
+}
+
+void test_configuration_watch(){
+	configuration_t *cfg = configuration_create();
+	configuration_ctx_init(cfg, "configurationtest", "test_watched.ini");
+	char path[300];
+	snprintf(path, sizeof(path), "%s/test_watched.ini", configuration_ctx_get_configdir(cfg));
+	FILE *f = fopen(path, "w");
+	fprintf(f, "watched 1\n");
+	fclose(f);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_load(cfg), "Load should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_watch(cfg), "Watch should succeed.");
+
+	// rewritten file is reloaded
+	f = fopen(path, "w");
+	fprintf(f, "watched 2\nadded 3\n");
+	fclose(f);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, wait_for_int_value(cfg, "watched", 2), "Changed value should have been reloaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, wait_for_int_value(cfg, "added", 3), "Added value should have been reloaded.");
+
+	// replaced file is reloaded
+	char tmppath[310];
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	f = fopen(tmppath, "w");
+	fprintf(f, "watched 4\n");
+	fclose(f);
+	rename(tmppath, path);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, wait_for_int_value(cfg, "watched", 4), "Replaced file should have been reloaded.");
+
+	// malformed file keeps the previous values
+	f = fopen(path, "w");
+	fwrite("watched 5\0\n", 1, 11, f);
+	fclose(f);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, wait_for_int_value(cfg, "watched", 5), "Malformed file should not have been reloaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, wait_for_int_value(cfg, "watched", 4), "Previous value should have been kept.");
+
+	configuration_ctx_unwatch(cfg);
+	configuration_destroy(cfg);
+	unlink(path);
+}
+
+void test_configuration_watch_save(){
+	configuration_t *cfg = configuration_create();
+	configuration_ctx_init(cfg, "configurationtest", "test_watch_save.ini");
+	char path[300];
+	snprintf(path, sizeof(path), "%s/test_watch_save.ini", configuration_ctx_get_configdir(cfg));
+	FILE *f = fopen(path, "w");
+	fprintf(f, "counter 1\n");
+	fclose(f);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_load(cfg), "Load should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_watch(cfg), "Watch should succeed.");
+
+	// our own save is not reloaded over a later set
+	configuration_ctx_set_int_value(cfg, "counter", 2);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_save(cfg), "Save should succeed.");
+	configuration_ctx_set_int_value(cfg, "counter", 3);
+	usleep(300000);
+	int intval = 0;
+	configuration_ctx_get_int_value(cfg, "counter", &intval);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, intval, "Set after save should have been kept.");
+
+	// an outside change is not reloaded over unsaved sets
+	f = fopen(path, "w");
+	fprintf(f, "counter 4\n");
+	fclose(f);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, wait_for_int_value(cfg, "counter", 4), "Outside change should not have been reloaded over unsaved sets.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, wait_for_int_value(cfg, "counter", 3), "Unsaved set should have been kept.");
+
+	// once saved, outside changes are reloaded again
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_ctx_save(cfg), "Save should succeed.");
+	f = fopen(path, "w");
+	fprintf(f, "counter 5\n");
+	fclose(f);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, wait_for_int_value(cfg, "counter", 5), "Outside change should have been reloaded.");
+
+	configuration_ctx_unwatch(cfg);
+	configuration_destroy(cfg);
+	unlink(path);
+}
+
+void test_configuration_schema(){
+	configuration_init("configurationtest", "test_schema.ini");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init_schema(&test_schema), "Schema init should succeed.");
+
+	// defaults are set at the generated indexes
+	int intval = 0;
+	float floatval = 0.0f;
+	char strval[32];
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_int_value(TEST_TIMES_EXECUTED, &intval), "Get times_executed by index should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, intval, "times_executed should be its default.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_float_value("volume", &floatval), "Get volume by key should succeed.");
+	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0.25f, floatval, "volume should be its default.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_str_value(TEST_USER_NAME, &strval[0], 32), "Get user.name by index should succeed.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("guest user", strval, "user.name should be its default.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_str_value(TEST_EMPTY, &strval[0], 32), "Get empty by index should succeed.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("", strval, "empty should be an empty string.");
+
+	// loaded keys land on their generated indexes, others after them
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Load should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_int_value(TEST_TIMES_EXECUTED, &intval), "Get times_executed by index should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(9, intval, "times_executed should be the loaded value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_float_value(TEST_VOLUME, &floatval), "Get volume by index should succeed.");
+	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0.5f, floatval, "volume should be the loaded value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_str_value(TEST_USER_NAME, &strval[0], 32), "Get user.name by index should succeed.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("tester", strval, "user.name should be the loaded value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_int_value(TEST_NUM_ITEMS, &intval), "Unmapped key should follow the schema items.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(7, intval, "unmapped should be the loaded value.");
+}
+
+void test_configuration_handle(){
+	TEST_ASSERT_NULL_MESSAGE(configuration_lookup("testint"), "Lookup of a missing key should fail.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Configuration should have been loaded.");
+	configuration_handle_t *intkey = configuration_lookup("testint");
+	configuration_handle_t *floatkey = configuration_lookup("testfloat");
+	configuration_handle_t *strkey = configuration_lookup("teststr");
+	TEST_ASSERT_NOT_NULL_MESSAGE(intkey, "Lookup of testint should succeed.");
+
+	int intval = 0;
+	float floatval = 0.0f;
+	char strval[32];
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_by_handle(intkey, &intval), "Get testint by handle should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, intval, "testint should be the loaded value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_float_by_handle(floatkey, &floatval), "Get testfloat by handle should succeed.");
+	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(2.0f, floatval, "testfloat should be the loaded value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_by_handle(strkey, &strval[0], 32), "Get teststr by handle should succeed.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("three", strval, "teststr should be the loaded value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_float_by_handle(intkey, &floatval), "Get of another type by handle should fail.");
+
+	// handles see later sets, and keys moved by a reload
+	configuration_set_int_value("testint", 5);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_by_handle(intkey, &intval), "Get testint by handle should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(5, intval, "testint should be the set value.");
+	configuration_reset();
+	configuration_set_str_value("teststr", "first");
+	configuration_init("configurationtest", "test_configuration.ini");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Configuration should have been loaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_by_handle(intkey, &intval), "Get testint by handle should succeed after reload.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, intval, "testint should be the reloaded value.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_by_handle(strkey, &strval[0], 32), "Get teststr by handle should succeed after reload.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("three", strval, "teststr should be the reloaded value.");
+
+	configuration_reset();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_int_by_handle(intkey, &intval), "Get by handle of a removed key should fail.");
+	configuration_handle_free(intkey);
+	configuration_handle_free(floatkey);
+	configuration_handle_free(strkey);
+}
+
+typedef struct changes {
+	int calls;
+	int num_keys;
+	char keys[8][32];
+	int set_during_call; // sets made by the first call
+} t_changes;
+
+void record_changes(configuration_t *cfg, const char *const keys[], int num_keys, void *ctx){
+	t_changes *changes = ctx;
+	changes->calls++;
+	changes->num_keys = num_keys;
+	for(int i = 0; i < num_keys && i < 8; i++){
+		snprintf(changes->keys[i], 32, "%s", keys[i]);
+	}
+	if(changes->set_during_call){
+		changes->set_during_call = 0;
+		configuration_ctx_set_int_value(cfg, "testint", 10);
+		configuration_ctx_set_str_value(cfg, "teststr", "ten");
+	}
+}
+
+void test_configuration_subscribe(){
+	t_changes changes = { 0 };
+	t_changes other = { 0 };
+	int id = configuration_subscribe("test", record_changes, &changes);
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(0, id, "Subscribe should succeed.");
+	configuration_subscribe("unrelated", record_changes, &other);
+
+	// a load reports the loaded keys at once, sorted
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Configuration should have been loaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, changes.calls, "Load should notify once.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, changes.num_keys, "Load should report every loaded key.");
+	TEST_ASSERT_EQUAL_STRING("testfloat", changes.keys[0]);
+	TEST_ASSERT_EQUAL_STRING("testint", changes.keys[1]);
+	TEST_ASSERT_EQUAL_STRING("teststr", changes.keys[2]);
+
+	// only sets that change a value are reported
+	configuration_set_int_value("testint", 1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, changes.calls, "Setting the current value should not notify.");
+	configuration_set_int_value("testint", 2);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, changes.calls, "Changing a value should notify.");
+	TEST_ASSERT_EQUAL_INT(1, changes.num_keys);
+	TEST_ASSERT_EQUAL_STRING("testint", changes.keys[0]);
+	configuration_set_int_value("other", 2);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, changes.calls, "Keys without the prefix should not notify.");
+
+	// a transaction notifies once with its changed keys
+	configuration_begin();
+	configuration_set_int_value("testint", 3);
+	configuration_set_float_value("testfloat", 4.0f);
+	configuration_set_int_value("testint", 5);
+	configuration_set_str_value("teststr", "three");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, changes.calls, "Staged sets should not notify.");
+	configuration_commit();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, changes.calls, "Commit should notify once.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, changes.num_keys, "Commit should report the changed keys once each.");
+	TEST_ASSERT_EQUAL_STRING("testfloat", changes.keys[0]);
+	TEST_ASSERT_EQUAL_STRING("testint", changes.keys[1]);
+
+	// sets made during a call arrive together in the next one
+	changes.set_during_call = 1;
+	configuration_set_float_value("testfloat", 5.0f);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(5, changes.calls, "Sets during a call should be coalesced into one more call.");
+	TEST_ASSERT_EQUAL_INT(2, changes.num_keys);
+	TEST_ASSERT_EQUAL_STRING("testint", changes.keys[0]);
+	TEST_ASSERT_EQUAL_STRING("teststr", changes.keys[1]);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, other.calls, "Other subscriber should not have been notified.");
+
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_unsubscribe(id), "Unsubscribe should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_unsubscribe(id), "Second unsubscribe should fail.");
+	configuration_set_int_value("testint", 6);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(5, changes.calls, "Unsubscribed callback should not be called.");
+
+	// a prefix and a callback are needed
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_subscribe(NULL, record_changes, &changes), "Subscribe without a prefix should fail.");
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_ERROR_NULL_VALUE, configuration_get_error_code());
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_subscribe("test", NULL, NULL), "Subscribe without a callback should fail.");
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_ERROR_NULL_VALUE, configuration_get_error_code());
+}
+
+typedef struct {
+	int num_items;
+	int stop_after;
+	char keys[8][32];
+	t_configuration_value values[8];
+	char strs[8][32]; // copies of string values
+} t_items;
+
+int record_item(configuration_t *cfg, const char *key, const t_configuration_value *value, void *ctx){
+	t_items *items = ctx;
+	if(items->num_items < 8){
+		snprintf(items->keys[items->num_items], 32, "%s", key);
+		items->values[items->num_items] = *value;
+		if(value->type == CONFIGURATION_VAL_STR){
+			snprintf(items->strs[items->num_items], 32, "%s", value->str_value);
+		}
+	}
+	items->num_items++;
+	return items->num_items != items->stop_after;
+}
+
+void test_configuration_foreach_prefix(){
+	FILE *f = fopen("fixtures/configurationtest/test_sections.ini", "w");
+	fprintf(f, "name top\n[db.pool]\nsize 10\nidle 2.5\n[db]\nhost localhost\n[]\ndb.pool.max 20\n");
+	fclose(f);
+	configuration_init("configurationtest", "test_sections.ini");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Sections should have been loaded.");
+	int intval = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("db.pool.size", &intval), "Section key should be prefixed with the section.");
+	TEST_ASSERT_EQUAL_INT(10, intval);
+
+	t_items items = { 0 };
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, configuration_foreach_prefix("db.pool.", record_item, &items), "Query should pass the subtree.");
+	TEST_ASSERT_EQUAL_STRING("db.pool.idle", items.keys[0]);
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_VAL_FLOAT, items.values[0].type);
+	TEST_ASSERT_EQUAL_FLOAT(2.5f, items.values[0].float_value);
+	TEST_ASSERT_EQUAL_STRING("db.pool.max", items.keys[1]);
+	TEST_ASSERT_EQUAL_STRING("db.pool.size", items.keys[2]);
+	TEST_ASSERT_EQUAL_INT(10, items.values[2].int_value);
+
+	// keys added since the last query are merged in order
+	configuration_set_str_value("db.pool.name", "main");
+	configuration_set_int_value("dbx", 1);
+	memset(&items, 0, sizeof(items));
+	TEST_ASSERT_EQUAL_INT(5, configuration_foreach_prefix("db.", record_item, &items));
+	TEST_ASSERT_EQUAL_STRING("db.host", items.keys[0]);
+	TEST_ASSERT_EQUAL_STRING("localhost", items.values[0].str_value);
+	TEST_ASSERT_EQUAL_STRING("db.pool.idle", items.keys[1]);
+	TEST_ASSERT_EQUAL_STRING("db.pool.max", items.keys[2]);
+	TEST_ASSERT_EQUAL_STRING("db.pool.name", items.keys[3]);
+	TEST_ASSERT_EQUAL_STRING("db.pool.size", items.keys[4]);
+
+	memset(&items, 0, sizeof(items));
+	items.stop_after = 2;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, configuration_foreach_prefix("", record_item, &items), "Callback should be able to stop the query.");
+	TEST_ASSERT_EQUAL_STRING("db.host", items.keys[0]);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_foreach_prefix("nothing", record_item, &items), "Query without matches should pass nothing.");
+	TEST_ASSERT_EQUAL_INT(-1, configuration_foreach_prefix(NULL, record_item, &items));
+
+	// an empty [name] key would read back as a section line
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_str_value("[db]", ""), "Empty value of a section like key should be rejected.");
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_ERROR_INVALID, configuration_get_error_code());
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_str_value("[db]", "x"), "Section like key with a value should be set.");
+	configuration_begin();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_str_value("[db]", ""), "Empty value of a section like key should not be staged.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_commit());
+
+	// saved files keep the full keys
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save should succeed.");
+	configuration_reset();
+	configuration_init("configurationtest", "test_sections.ini");
+	configuration_load();
+	memset(&items, 0, sizeof(items));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(4, configuration_foreach_prefix("db.pool.", record_item, &items), "Saved keys should load into the same tree.");
+	char strval[8];
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value("[db]", &strval[0], sizeof(strval)), "Section like key should load as a key.");
+	TEST_ASSERT_EQUAL_STRING("x", strval);
+	unlink("fixtures/configurationtest/test_sections.ini");
+}
+
+void test_configuration_stream(){
+	FILE *f = fopen("fixtures/configurationtest/test_stream.ini", "w");
+	fprintf(f, "count 3\r\n\n[server]  \nname  main host \n[a b]\nratio 0.5\n[]\ncount 4\nempty");
+	fclose(f);
+
+	t_items items = { 0 };
+	TEST_ASSERT_EQUAL_INT_MESSAGE(6, configuration_stream("fixtures/configurationtest/test_stream.ini", record_item, &items), "Every entry should be passed.");
+	TEST_ASSERT_EQUAL_STRING("count", items.keys[0]);
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_VAL_INT, items.values[0].type);
+	TEST_ASSERT_EQUAL_INT(3, items.values[0].int_value);
+	TEST_ASSERT_EQUAL_STRING("server.name", items.keys[1]);
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_VAL_STR, items.values[1].type);
+	TEST_ASSERT_EQUAL_STRING("main host", items.strs[1]);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("server.[a", items.keys[2], "Bracketed words with a blank should be an entry, not a section.");
+	TEST_ASSERT_EQUAL_STRING("b]", items.strs[2]);
+	TEST_ASSERT_EQUAL_STRING("server.ratio", items.keys[3]);
+	TEST_ASSERT_EQUAL_FLOAT(0.5f, items.values[3].float_value);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("count", items.keys[4], "Repeated keys should be passed again.");
+	TEST_ASSERT_EQUAL_INT(4, items.values[4].int_value);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("empty", items.keys[5], "Last line without a newline should be passed.");
+	TEST_ASSERT_EQUAL_STRING("", items.strs[5]);
+	int intval = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_int_value("count", &intval), "Streaming should not store entries.");
+
+	memset(&items, 0, sizeof(items));
+	items.stop_after = 2;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, configuration_stream("fixtures/configurationtest/test_stream.ini", record_item, &items), "Callback should be able to stop the stream.");
+	TEST_ASSERT_EQUAL_INT(-1, configuration_stream("fixtures/configurationtest/missing.ini", record_item, &items));
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_ERROR_SYSTEM, configuration_get_error_code());
+	unlink("fixtures/configurationtest/test_stream.ini");
+}
+
 void test_configuration_get_error(){
 	configuration_reset();
         TEST_ASSERT_EQUAL_INT_MESSAGE(0, strncmp("", configuration_get_error(), 1), "Should not be any error message.");
@@ -228,13 +703,57 @@ void test_configuration_get_error(){
         TEST_ASSERT_LESS_THAN_INT_MESSAGE(0, strncmp("", configuration_get_error(), 1), "Should have an error message.");
 }
 
+void *get_error_code_thread(void *arg){
+	return (void *)(long)configuration_get_error_code();
+}
+
+void test_configuration_get_error_code(){
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_OK, configuration_get_error_code(), "Should not be any error.");
+	int intval;
+	configuration_get_int_value("non-existant", &intval);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_ERROR_NOT_FOUND, configuration_get_error_code(), "Missing key should not be found.");
+	TEST_ASSERT_EQUAL_STRING("Configuration key non-existant not found.", configuration_get_error());
+	configuration_set_int_value("testint", 1);
+	configuration_get_float_value("testint", &(float){ 0 });
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_ERROR_TYPE, configuration_get_error_code(), "Int should not be read as float.");
+
+	// errors are kept per thread
+	pthread_t thread;
+	void *code;
+	pthread_create(&thread, NULL, get_error_code_thread, NULL);
+	pthread_join(thread, &code);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_OK, (long)code, "Other thread should not see the error.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_ERROR_TYPE, configuration_get_error_code(), "Error should be kept.");
+
+	configuration_reset();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_OK, configuration_get_error_code(), "Reset should clear the error.");
+}
+
+void test_configuration_get_stats(){
+	// metrics are not built in by default
+	t_configuration_stats stats;
+	stats.gets = 1;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_stats(&stats), "Metrics should not be built in.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, stats.gets, "Stats should be zeroed.");
+}
+
 int main(){
 	UNITY_BEGIN();
 	RUN_TEST(test_configuration_init);
 	RUN_TEST(test_configuration_load);
 	RUN_TEST(test_set_get);
 	RUN_TEST(test_configuration_save);
+	RUN_TEST(test_configuration_save_async);
+	RUN_TEST(test_configuration_layers);
 	RUN_TEST(test_configuration_get_configdir);
+	RUN_TEST(test_configuration_contexts);
+	RUN_TEST(test_configuration_watch);
+	RUN_TEST(test_configuration_watch_save);
+	RUN_TEST(test_configuration_schema);
+	RUN_TEST(test_configuration_handle);
+	RUN_TEST(test_configuration_subscribe);
+	RUN_TEST(test_configuration_foreach_prefix);
+	RUN_TEST(test_configuration_stream);
 	/*
 	RUN_TEST(test_configuration_set_by_index_int_value);
 	RUN_TEST(test_configuration_get_by_index_int_value);
@@ -244,5 +763,7 @@ int main(){
 	RUN_TEST(test_configuration_get_by_index_str_value);
 	*/
 	RUN_TEST(test_configuration_get_error);
+	RUN_TEST(test_configuration_get_error_code);
+	RUN_TEST(test_configuration_get_stats);
 	return UNITY_END();
 }
@@ -1,18 +1,67 @@
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "../../Unity/src/unity.h"
+#define CONFIGURATION_METRICS
 #include "../src/configuration.c"
 
 void reset_configuration(){
-	for(int i = 0; i < CONFIGURATION_ITEMS_MAX; i++){
-		configuration.mappings[i].key[0] = '\0'; 
-		configuration.mappings[i].index = 0; 
-		configuration.items[i].key[0] = '\0'; 
-		configuration.items[i].val_type = CONFIGURATION_VAL_INT; 
-		configuration.items[i].val.int_value = 0; 
-	}
-	configuration.num_items = 0;
-	configuration.loaded = 0;
+	// keep the fixtures configdir set up by setUp
+	int configdirok = configuration.configdirok;
+	configuration_reset();
+	configuration.configdirok = configdirok;
+}
+
+// published table of the default configuration
+t_config_table *table(){
+	return atomic_load(&configuration.table);
+}
+
+int num_items(){
+	return table() ? atomic_load(&table()->num_items) : 0;
+}
+
+// make num items available for direct manipulation
+void make_items(int num){
+	atomic_store(&_table_reserve_published(&configuration, num)->num_items, num);
+}
+
+t_config_item *item(int i){
+	return &table()->items[i];
+}
+
+t_conf_val_type item_type(int i){
+	return _value_type(atomic_load(&item(i)->val));
+}
+
+int item_int(int i){
+	return _value_int(atomic_load(&item(i)->val));
+}
+
+float item_float(int i){
+	return _value_float(atomic_load(&item(i)->val));
+}
+
+const char *item_str(int i){
+	return _value_str(atomic_load(&item(i)->val));
+}
+
+void set_int(int i, int value){
+	atomic_store(&item(i)->val, _value_from_int(value));
+}
+
+void set_float(int i, float value){
+	atomic_store(&item(i)->val, _value_from_float(value));
+}
+
+void set_str(int i, const char *value){
+	atomic_store(&item(i)->val, _value_from_str(_string_intern(&configuration, value)));
+}
+
+// change the type of an item, keeping its value bits
+void set_type(int i, t_conf_val_type type){
+	t_config_value value = atomic_load(&item(i)->val);
+	atomic_store(&item(i)->val, (value & ~(t_config_value)CONFIGURATION_VAL_TYPE_MASK) | type);
 }
 
 char *xdg_config_home_orig = NULL;
@@ -28,9 +77,9 @@ void setUp(void){
 
 	reset_configuration();
 
-	snprintf(configuration.configdir, 256, "fixtures");
+	_configdir_set(&configuration, NULL, "fixtures");
 	configuration.configdirok = 1;
-	snprintf(configuration.error_msg, CONFIGURATION_ERROR_MSG_LEN, "");
+	_error_clear(&configuration);
 }
 
 //runs after each test
@@ -71,157 +120,927 @@ void test_configuration_init(){
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init("configurationtest","configurationtest.ini"), "Configuration init with HOME should succeed.");
 	TEST_ASSERT_EQUAL_STRING_MESSAGE("./fixtures/.config/configurationtest", configuration.configdir, "configuration.dirname should have been set by HOME.");
 
-	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration.num_items, "number of items should b zero after init.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, num_items(), "number of items should b zero after init.");
 }
 
 void test_configuration_init_indexes(){
-	struct configuration_index_mapping confmap[CONFIGURATION_ITEMS_MAX] = {
+	struct configuration_index_mapping confmap[] = {
 		{ "three", 3, CONFIGURATION_VAL_INT, "3" },
 		{ "two", 2, CONFIGURATION_VAL_FLOAT, "2.22" },
 		{ "one", 1, CONFIGURATION_VAL_STR, "one" }
 	};
 
-	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init_indexes(confmap), "configuration_init_indexes should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init_indexes(confmap, 3), "configuration_init_indexes should succeed.");
 	
 	TEST_ASSERT_EQUAL_STRING_MESSAGE("three", configuration.mappings[0].key, "configuration mapping key at 0 should be three.");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(3, configuration.mappings[0].index, "configuration mapping index at 0 should be 3.");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("three", configuration.items[3].key, "configuration item key at 3 should be three.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, configuration.items[3].val_type, "configuration item 3 should be initialized with type INT");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(3, configuration.items[3].val.int_value, "configuration item 3 should have value 3");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("three", item(3)->key, "configuration item key at 3 should be three.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, item_type(3), "configuration item 3 should be initialized with type INT");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, item_int(3), "configuration item 3 should have value 3");
 
 	TEST_ASSERT_EQUAL_STRING_MESSAGE("two", configuration.mappings[1].key, "configuration mapping key at 1 should be two.");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(2, configuration.mappings[1].index, "configuration mapping index at 1 should be 2.");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("two", configuration.items[2].key, "configuration item key at 2 should be two.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, configuration.items[2].val_type, "configuration item 2 should be initialized with type FLOAT");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(2.22f, configuration.items[2].val.float_value, "configuration item 2 should have value 2.22");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("two", item(2)->key, "configuration item key at 2 should be two.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, item_type(2), "configuration item 2 should be initialized with type FLOAT");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2.22f, item_float(2), "configuration item 2 should have value 2.22");
 
 	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", configuration.mappings[2].key, "configuration mapping key at 2 should be one.");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", configuration.items[1].key, "configuration item key at 1 should be one.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", item(1)->key, "configuration item key at 1 should be one.");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration.mappings[2].index, "configuration mapping index at 2 should be 1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, configuration.items[1].val_type, "configuration item 1 should be initialized with type STR");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", configuration.items[1].val.str_value, "configuration item 1 should have value \"one\"");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, item_type(1), "configuration item 1 should be initialized with type STR");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", item_str(1), "configuration item 1 should have value \"one\"");
+
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, configuration.num_mappings, "there should be three configuration mappings.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(4, num_items(), "items should cover the highest mapped index.");
+}
+
+void test_configuration_mapping_hash(){
+	// every key finds its own position
+	unsigned int hashes[1000];
+	char key[CONFIGURATION_KEY_MAX];
+	for(int i = 0; i < 1000; i++){
+		snprintf(key, sizeof(key), "key%d", i);
+		hashes[i] = _index_hash(key);
+	}
+	unsigned int num_buckets;
+	unsigned short *displacements;
+	unsigned int *slots;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, _phash_create(hashes, 1000, &num_buckets, &displacements, &slots), "Perfect hash should be built.");
+	for(int i = 0; i < 1000; i++){
+		TEST_ASSERT_EQUAL_INT_MESSAGE(i, _phash_find(displacements, num_buckets, slots, 1000, hashes[i]), "Key should find its position.");
+	}
+	free(displacements);
+	free(slots);
+	hashes[7] = hashes[3];
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, _phash_create(hashes, 1000, &num_buckets, &displacements, &slots), "Equal hashes should not be built.");
+	TEST_ASSERT_NULL(slots);
 
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("", configuration.mappings[3].key, "configuration mapping key at 3 should be empty.");
+	// loading resolves mapped keys through the hash
+	t_configuration_index_mapping mappings[200];
+	for(int i = 0; i < 200; i++){
+		snprintf(mappings[i].key, sizeof(mappings[i].key), "mapped%d", i);
+		mappings[i].index = 199 - i;
+		mappings[i].val_type = CONFIGURATION_VAL_INT;
+		snprintf(mappings[i].default_value, sizeof(mappings[i].default_value), "%d", i);
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init_indexes(mappings, 200), "configuration_init_indexes should succeed.");
+	TEST_ASSERT_NOT_NULL_MESSAGE(configuration.mapping_slots, "Mappings should be hashed.");
+	for(int i = 0; i < 200; i++){
+		TEST_ASSERT_EQUAL_INT_MESSAGE(199 - i, _mapping_index(&configuration, mappings[i].key), "Mapped key should resolve to its index.");
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(-1, _mapping_index(&configuration, "unmapped"), "Unmapped key should not resolve.");
+
+	// a key mapped twice keeps the first mapping
+	snprintf(mappings[5].key, sizeof(mappings[5].key), "mapped3");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init_indexes(mappings, 200), "configuration_init_indexes should succeed.");
+	TEST_ASSERT_NULL_MESSAGE(configuration.mapping_slots, "Repeated keys should not be hashed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(196, _mapping_index(&configuration, "mapped3"), "First mapping should win.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(190, _mapping_index(&configuration, "mapped9"), "Other keys should still resolve.");
 }
 
 void test_configuration_load(){
 	strncpy(configuration.filename, "test_configuration.ini", 32);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Configuration should have been loaded.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(8, configuration.num_items, "Number of configuration items should have been eight.");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", configuration.items[0].key, "Configuration one should have been in first configuration slot.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, configuration.items[0].val_type, "first configuration item type should be int.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, configuration.items[4].val_type, "fifth configuration item type should be str.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, configuration.items[6].val_type, "seventh configuration item type should be float.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(8, num_items(), "Number of configuration items should have been eight.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", item(0)->key, "Configuration one should have been in first configuration slot.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, item_type(0), "first configuration item type should be int.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, item_type(4), "fifth configuration item type should be str.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, item_type(6), "seventh configuration item type should be float.");
 
 	// test load using indexes
 	reset_configuration();
-	snprintf(configuration.mappings[0].key, CONFIGURATION_KEY_MAX, "%s", "three");
-	configuration.mappings[0].index = 0;
-	snprintf(configuration.mappings[1].key, CONFIGURATION_KEY_MAX, "%s", "two");
-	configuration.mappings[1].index = 1;
-	snprintf(configuration.mappings[2].key, CONFIGURATION_KEY_MAX, "%s", "one");
-	configuration.mappings[2].index = 2;
+	struct configuration_index_mapping confmap[] = {
+		{ "three", 0, CONFIGURATION_VAL_INT, "0" },
+		{ "two", 1, CONFIGURATION_VAL_INT, "0" },
+		{ "one", 2, CONFIGURATION_VAL_INT, "0" }
+	};
+	configuration_init_indexes(confmap, 3);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Configuration should have been loaded.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(8, configuration.num_items, "Number of configuration should have been eight.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(8, configuration.num_items, "Number of configuration should have been eight.");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("two", configuration.items[1].key, "Configuration two should have been at index 1.");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", configuration.items[2].key, "Configuration one should have been at index 2.");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("three", configuration.items[0].key, "Configuration three should have been at index 0.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(8, num_items(), "Number of configuration should have been eight.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(8, num_items(), "Number of configuration should have been eight.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("two", item(1)->key, "Configuration two should have been at index 1.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("one", item(2)->key, "Configuration one should have been at index 2.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("three", item(0)->key, "Configuration three should have been at index 0.");
+}
+
+void test_configuration_load_duplicates(){
+	strncpy(configuration.filename, "test_duplicates.ini", 32);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Configuration should have been loaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, num_items(), "Repeated keys should not add items.");
+	int val = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("one", &val), "one should be configured.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(11, val, "Last value for one should win.");
+	char strval[32] = {};
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value("two", &strval[0], 32), "two should be configured.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("twotwo", strval, "Last value for two should win.");
+}
+
+void test_configuration_load_unterminated(){
+	// a page sized file without a final newline is read rather than mapped
+	FILE *f = fopen("fixtures/test_unterminated.ini", "w");
+	fprintf(f, "pad ");
+	for(int i = 0; i < 4096 - 4 - 11; i++){
+		fputc('x', f);
+	}
+	fprintf(f, "\nlast 12345");
+	fclose(f);
+	strncpy(configuration.filename, "test_unterminated.ini", 32);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Configuration should have been loaded.");
+	unlink("fixtures/test_unterminated.ini");
+	int val = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("last", &val), "Last line should have been loaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(12345, val, "Value at the end of the file should not be cut short.");
+	char strval[4096] = {};
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value("pad", &strval[0], sizeof(strval)), "pad should have been loaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(4096 - 4 - 11, strlen(strval), "pad should have its full value.");
+}
+
+t_conf_val_type parse(const char *str, t_config_value *value){
+	return _value_parse(str, strlen(str), value);
+}
+
+void test_configuration_parse(){
+	t_config_value value = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, parse("42", &value), "42 should be an int.");
+	TEST_ASSERT_EQUAL_INT(42, _value_int(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, parse("-2147483648", &value), "INT_MIN should be an int.");
+	TEST_ASSERT_EQUAL_INT(INT_MIN, _value_int(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, parse("+2147483647", &value), "INT_MAX should be an int.");
+	TEST_ASSERT_EQUAL_INT(INT_MAX, _value_int(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, parse("2147483648", &value), "Ints that overflow should keep their text.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, parse("123456789012345678901234567890", &value), "Long ints should keep their text.");
+
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("2.22", &value), "2.22 should be a float.");
+	TEST_ASSERT_EQUAL_FLOAT(2.22f, _value_float(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("-56.789", &value), "-56.789 should be a float.");
+	TEST_ASSERT_EQUAL_FLOAT(-56.789f, _value_float(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("1.", &value), "1. should be a float.");
+	TEST_ASSERT_EQUAL_FLOAT(1.0f, _value_float(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse(".5", &value), ".5 should be a float.");
+	TEST_ASSERT_EQUAL_FLOAT(0.5f, _value_float(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("1.5e3", &value), "Exponents should be accepted.");
+	TEST_ASSERT_EQUAL_FLOAT(1500.0f, _value_float(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("3.14159265358979323846", &value), "Long floats should be converted.");
+	TEST_ASSERT_EQUAL_FLOAT(3.14159265f, _value_float(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("1e-30", &value), "Small floats should be converted.");
+	TEST_ASSERT_EQUAL_FLOAT(1e-30f, _value_float(value));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("-inf", &value), "-inf should be a float.");
+	TEST_ASSERT_TRUE(isinf(_value_float(value)) && _value_float(value) < 0);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("NaN", &value), "NaN should be a float.");
+	TEST_ASSERT_TRUE(isnan(_value_float(value)));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, parse("1e39", &value), "Floats that overflow should keep their text.");
+
+	const char *strings[] = { "", "-", ".", "1e", "1e+", "1,5", "0x10", "12abc", "1 2", "info", "one" };
+	for(int i = 0; i < sizeof(strings) / sizeof(strings[0]); i++){
+		TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, parse(strings[i], &value), strings[i]);
+	}
+
+	// numbers are read and written with '.' in every locale
+	if(setlocale(LC_NUMERIC, "de_DE.UTF-8") || setlocale(LC_NUMERIC, "fr_FR.UTF-8")){
+		TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("2.5", &value), "2.5 should be a float in any locale.");
+		TEST_ASSERT_EQUAL_FLOAT(2.5f, _value_float(value));
+		TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, parse("3.14159265358979323846", &value), "Long floats should be converted in any locale.");
+		TEST_ASSERT_EQUAL_FLOAT(3.14159265f, _value_float(value));
+		char buf[64];
+		_value_format_float(buf, sizeof(buf), 2.5f);
+		TEST_ASSERT_EQUAL_STRING_MESSAGE("2.5000", buf, "Floats should be saved with '.' in any locale.");
+		setlocale(LC_NUMERIC, "C");
+	}
+}
+
+void write_file(const char *path, const char *contents){
+	FILE *f = fopen(path, "w");
+	fputs(contents, f);
+	fclose(f);
+}
+
+void test_configuration_snapshot(){
+	write_file("fixtures/test_snapshot.ini", "one 1\ntwo 2.5\nthree three\n");
+	strncpy(configuration.filename, "test_snapshot.ini", 32);
+	configuration_use_snapshot(1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "First load should parse the file.");
+	TEST_ASSERT_NULL_MESSAGE(configuration.snapshots, "First load should not have used a snapshot.");
+	struct stat st;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, stat("fixtures/test_snapshot.ini.cache", &st), "Snapshot should have been written.");
+
+	// unchanged file loads from the snapshot
+	reset_configuration();
+	strncpy(configuration.filename, "test_snapshot.ini", 32);
+	configuration_use_snapshot(1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Second load should succeed.");
+	TEST_ASSERT_NOT_NULL_MESSAGE(configuration.snapshots, "Second load should have used the snapshot.");
+	int val = 0;
+	float fval = 0.0f;
+	char strval[32] = {};
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("one", &val));
+	TEST_ASSERT_EQUAL_INT(1, val);
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_float_value("two", &fval));
+	TEST_ASSERT_EQUAL_FLOAT(2.5f, fval);
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_str_value("three", &strval[0], 32));
+	TEST_ASSERT_EQUAL_STRING("three", strval);
+	TEST_ASSERT_EQUAL_PTR_MESSAGE(_string_intern(&configuration, "three"), item_str(2), "Snapshot strings should be interned.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_str_value("four", "three"), "Set after snapshot load should succeed.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_str_value("four", &strval[0], 32));
+	TEST_ASSERT_EQUAL_STRING("three", strval);
+
+	// corrupt snapshot falls back to the text and is rewritten
+	reset_configuration();
+	FILE *f = fopen("fixtures/test_snapshot.ini.cache", "r+");
+	fseek(f, -3, SEEK_END);
+	fputc('X', f);
+	fclose(f);
+	strncpy(configuration.filename, "test_snapshot.ini", 32);
+	configuration_use_snapshot(1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Load with corrupt snapshot should succeed.");
+	TEST_ASSERT_NULL_MESSAGE(configuration.snapshots, "Corrupt snapshot should not have been used.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_str_value("three", &strval[0], 32));
+	TEST_ASSERT_EQUAL_STRING("three", strval);
+	reset_configuration();
+	strncpy(configuration.filename, "test_snapshot.ini", 32);
+	configuration_use_snapshot(1);
+	configuration_load();
+	TEST_ASSERT_NOT_NULL_MESSAGE(configuration.snapshots, "Snapshot should have been rewritten.");
+
+	// reloads copy the snapshot strings instead of keeping another mapping
+	t_snapshot_map *map = configuration.snapshots;
+	for(int i = 0; i < 3; i++){
+		_watch_reload(&configuration);
+	}
+	TEST_ASSERT_EQUAL_PTR_MESSAGE(map, configuration.snapshots, "Reloads should not have kept their snapshot mapped.");
+	TEST_ASSERT_NULL_MESSAGE(map->next, "Only the first snapshot should be mapped.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_str_value("three", &strval[0], 32));
+	TEST_ASSERT_EQUAL_STRING("three", strval);
+	TEST_ASSERT_EQUAL_PTR_MESSAGE(_string_intern(&configuration, "three"), item_str(2), "Reloaded snapshot strings should be interned.");
+
+	// changed file makes the snapshot stale
+	reset_configuration();
+	write_file("fixtures/test_snapshot.ini", "one 11\ntwo 2.5\nthree three\n");
+	strncpy(configuration.filename, "test_snapshot.ini", 32);
+	configuration_use_snapshot(1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Load with stale snapshot should succeed.");
+	TEST_ASSERT_NULL_MESSAGE(configuration.snapshots, "Stale snapshot should not have been used.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("one", &val));
+	TEST_ASSERT_EQUAL_INT(11, val);
+
+	// different mappings make the snapshot stale
+	reset_configuration();
+	struct configuration_index_mapping confmap[] = {
+		{ "three", 0, CONFIGURATION_VAL_STR, "" }
+	};
+	configuration_init_indexes(confmap, 1);
+	strncpy(configuration.filename, "test_snapshot.ini", 32);
+	configuration_use_snapshot(1);
+	TEST_ASSERT_EQUAL_INT(1, configuration_load());
+	TEST_ASSERT_NULL_MESSAGE(configuration.snapshots, "Snapshot made with other mappings should not have been used.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("three", item(0)->key, "three should be at its mapped index.");
+
+	configuration_use_snapshot(0);
+	unlink("fixtures/test_snapshot.ini");
+	unlink("fixtures/test_snapshot.ini.cache");
+}
+
+void test_configuration_snapshot_schema(){
+	static const unsigned short displacements[] = { 0 };
+	static const unsigned int slots[] = { 0 };
+	static const t_configuration_schema_item items1[] = { { "limit", CONFIGURATION_VAL_INT, 1, 0.0f, NULL } };
+	static const t_configuration_schema_item items2[] = { { "limit", CONFIGURATION_VAL_INT, 2, 0.0f, NULL } };
+	static const t_configuration_schema schema1 = { items1, 1, displacements, 1, slots };
+	static const t_configuration_schema schema2 = { items2, 1, displacements, 1, slots };
+	unlink("fixtures/test_snapshot_schema.ini.cache");
+	write_file("fixtures/test_snapshot_schema.ini", "other 3\n");
+	strncpy(configuration.filename, "test_snapshot_schema.ini", 32);
+	configuration_use_snapshot(1);
+	configuration_init_schema(&schema1);
+	TEST_ASSERT_EQUAL_INT(1, configuration_load());
+	// a rewritten snapshot is renamed into place, a used one keeps its inode
+	struct stat st;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, stat("fixtures/test_snapshot_schema.ini.cache", &st), "Snapshot should have been written.");
+	ino_t written = st.st_ino;
+
+	// a schema with other defaults makes the snapshot stale
+	reset_configuration();
+	strncpy(configuration.filename, "test_snapshot_schema.ini", 32);
+	configuration_use_snapshot(1);
+	configuration_init_schema(&schema2);
+	TEST_ASSERT_EQUAL_INT(1, configuration_load());
+	stat("fixtures/test_snapshot_schema.ini.cache", &st);
+	TEST_ASSERT_TRUE_MESSAGE(written != st.st_ino, "Snapshot made with other defaults should have been replaced.");
+	written = st.st_ino;
+	int val = 0;
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("limit", &val));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, val, "New default should be used.");
+
+	// the same schema uses the rewritten snapshot
+	reset_configuration();
+	strncpy(configuration.filename, "test_snapshot_schema.ini", 32);
+	configuration_use_snapshot(1);
+	configuration_init_schema(&schema2);
+	TEST_ASSERT_EQUAL_INT(1, configuration_load());
+	stat("fixtures/test_snapshot_schema.ini.cache", &st);
+	TEST_ASSERT_TRUE_MESSAGE(written == st.st_ino, "Snapshot made with the same schema should have been used.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("limit", &val));
+	TEST_ASSERT_EQUAL_INT(2, val);
+
+	configuration_use_snapshot(0);
+	unlink("fixtures/test_snapshot_schema.ini");
+	unlink("fixtures/test_snapshot_schema.ini.cache");
+}
+
+// size of the file at path, -1 if it does not exist
+long file_size(const char *path){
+	struct stat st;
+	return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+void test_configuration_journal(){
+	const char *path = "fixtures/test_journal.ini";
+	const char *journal = "fixtures/test_journal.ini.journal";
+	const char *old_journal = "fixtures/test_journal.ini.journal.old";
+	unlink(path);
+	unlink(journal);
+	unlink(old_journal);
+	strncpy(configuration.filename, "test_journal.ini", 32);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_use_journal(1), "Journal should be enabled.");
+
+	// sets are appended to the journal and replayed without a config file
+	configuration_set_int_value("one", 1);
+	configuration_set_float_value("two", 2.5f);
+	configuration_set_str_value("three", "three");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(-1, file_size(path), "Sets should not write the config file.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(strlen("one 1\ntwo 2.5000\nthree three\n"), file_size(journal), "Each set should append one record.");
+	reset_configuration();
+	configuration_use_journal(1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Load of journal alone should succeed.");
+	int val = 0;
+	float fval = 0.0f;
+	char strval[32] = {};
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("one", &val));
+	TEST_ASSERT_EQUAL_INT(1, val);
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_float_value("two", &fval));
+	TEST_ASSERT_EQUAL_FLOAT(2.5f, fval);
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_str_value("three", &strval[0], 32));
+	TEST_ASSERT_EQUAL_STRING("three", strval);
+
+	// save folds the journal into the file, later sets only append their own record
+	configuration_set_int_value("one", 2);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(-1, file_size(journal), "Save should remove the journal.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(-1, file_size(old_journal), "Save should remove the rotated journal.");
+	long saved_size = file_size(path);
+	configuration_set_int_value("one", 3);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(saved_size, file_size(path), "Set should not rewrite the config file.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(strlen("one 3\n"), file_size(journal), "Set should append one record.");
+	reset_configuration();
+	configuration_use_journal(1);
+	TEST_ASSERT_EQUAL_INT(1, configuration_load());
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("one", &val));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, val, "Journal should be replayed over the file.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_str_value("three", &strval[0], 32));
+	TEST_ASSERT_EQUAL_STRING("three", strval);
+
+	// a record cut short by a crash is ignored, and dropped before the next append
+	FILE *f = fopen(journal, "a");
+	fputs("one 4", f);
+	fclose(f);
+	reset_configuration();
+	configuration_use_journal(1);
+	TEST_ASSERT_EQUAL_INT(1, configuration_load());
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("one", &val));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, val, "Incomplete record should be ignored.");
+	configuration_set_int_value("four", 4);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(strlen("one 3\nfour 4\n"), file_size(journal), "Incomplete record should be dropped.");
+
+	// a journal rotated by an interrupted save is replayed first
+	write_file(old_journal, "one 5\nfive 5\n");
+	write_file(journal, "one 6\n");
+	reset_configuration();
+	configuration_use_journal(1);
+	TEST_ASSERT_EQUAL_INT(1, configuration_load());
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("one", &val));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(6, val, "Newer journal should win.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("five", &val));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(5, val, "Rotated journal should be replayed.");
+
+	// a growing journal is folded into the file
+	int num_sets = CONFIGURATION_JOURNAL_COMPACT_SIZE / 4;
+	for(int i = 0; i < num_sets; i++){
+		configuration_set_int_value("counter", i);
+	}
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(saved_size, file_size(path), "Journal should have been folded into the file.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(-1, file_size(old_journal), "Compaction should remove the rotated journal.");
+	TEST_ASSERT_LESS_THAN_INT_MESSAGE(CONFIGURATION_JOURNAL_COMPACT_SIZE, file_size(journal), "Compaction should keep the journal small.");
+	reset_configuration();
+	configuration_use_journal(1);
+	TEST_ASSERT_EQUAL_INT(1, configuration_load());
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("counter", &val));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(num_sets - 1, val, "Journal and file should hold the last value.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_int_value("five", &val));
+	TEST_ASSERT_EQUAL_INT(5, val);
+
+	configuration_use_journal(0);
+	unlink(path);
+	unlink(journal);
+	unlink(old_journal);
+}
+
+void test_configuration_index(){
+	char key[32];
+	TEST_ASSERT_NULL_MESSAGE(table(), "No items should be allocated after reset.");
+	for(int i = 0; i < 1000; i++){
+		snprintf(key, sizeof(key), "key%d", i);
+		TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_int_value(key, i), "Set should succeed as storage grows.");
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1000, num_items(), "Every key should have its own item.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1024, table()->items_size, "Storage should have grown geometrically.");
+	TEST_ASSERT_GREATER_OR_EQUAL_INT_MESSAGE(2 * table()->items_size, table()->index_size, "Index should stay at most half full.");
+	for(int i = 0; i < 1000; i++){
+		snprintf(key, sizeof(key), "key%d", i);
+		TEST_ASSERT_EQUAL_INT_MESSAGE(i, _table_find(table(), key), "Index should find each key at its item.");
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(-1, _table_find(table(), "key"), "Index should not find a missing key.");
+
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_int_value("key7", 70), "Update of existing key should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(70, item_int(7), "key7 should have been updated in place.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1000, num_items(), "Update should not add an item.");
+}
+
+void test_configuration_handle_generation(){
+	configuration_set_int_value("a", 1);
+	configuration_set_int_value("b", 2);
+	t_configuration_handle *handle = configuration_lookup("b");
+	unsigned int generation = table()->generation;
+	TEST_ASSERT_TRUE_MESSAGE(atomic_load(&handle->slot) == ((uint64_t)generation << 32 | 1), "Handle should cache the index of b.");
+
+	// items added or grown in place keep the generation
+	make_items(100);
+	TEST_ASSERT_EQUAL_UINT_MESSAGE(generation, table()->generation, "Growing should keep the generation.");
+
+	// mappings move keys
+	struct configuration_index_mapping confmap[] = { { "b", 0, CONFIGURATION_VAL_INT, "7" } };
+	configuration_init_indexes(confmap, 1);
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(generation, table()->generation, "Mapping should change the generation.");
+	int intval = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_by_handle(handle, &intval), "Get by handle should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(7, intval, "Handle should find b at its mapped index.");
+	TEST_ASSERT_TRUE_MESSAGE(atomic_load(&handle->slot) == (uint64_t)table()->generation << 32, "Handle should cache the mapped index.");
+	configuration_handle_free(handle);
+}
+
+void test_configuration_strings(){
+	// keys and values are not limited in length
+	char key[100];
+	char value[200];
+	memset(key, 'k', sizeof(key) - 1);
+	key[sizeof(key) - 1] = '\0';
+	memset(value, 'v', sizeof(value) - 1);
+	value[sizeof(value) - 1] = '\0';
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_str_value(key, value), "Set of long key and value should succeed.");
+	char strval[300] = {};
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value(key, &strval[0], sizeof(strval)), "Get of long key should succeed.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE(value, strval, "Long value should not be truncated.");
+
+	// keys are stored once, values set at runtime are not interned
+	configuration_set_str_value("a", "same");
+	configuration_set_str_value("b", "same");
+	configuration_set_str_value("same", "same");
+	TEST_ASSERT_EQUAL_STRING("same", item_str(1));
+	TEST_ASSERT_EQUAL_STRING("same", item_str(2));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(4, configuration.num_strings, "Only distinct keys should be stored.");
+
+	// replaced values are freed once no reader uses them
+	for(int i = 0; i < 1000; i++){
+		char status[32];
+		snprintf(status, sizeof(status), "status %d", i);
+		TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_str_value("a", status), "Set of a should succeed.");
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(4, configuration.num_strings, "Runtime values should not grow the string arena.");
+	TEST_ASSERT_LESS_THAN_INT_MESSAGE(CONFIGURATION_RETIRED_STRS_MIN + 1, configuration.num_retired_strs, "Sets in place should free replaced values as they go.");
+	_tables_reclaim(&configuration);
+	TEST_ASSERT_NULL_MESSAGE(configuration.retired_strs, "Replaced values should have been freed.");
+	TEST_ASSERT_EQUAL_STRING("status 999", item_str(1));
+
+	// values with spaces and empty values survive a save and load
+	strncpy(configuration.filename, "test_configuration_saved.ini", 32);
+	configuration_set_str_value("spaces", "two words");
+	configuration_set_str_value("empty", "");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save should succeed.");
+	reset_configuration();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Load should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value(key, &strval[0], sizeof(strval)), "Long key should have been loaded.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE(value, strval, "Long value should have been loaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value("spaces", &strval[0], sizeof(strval)), "spaces should have been loaded.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("two words", strval, "Value with spaces should have been loaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value("empty", &strval[0], sizeof(strval)), "empty should have been loaded.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("", strval, "Empty value should have been loaded.");
+}
+
+_Atomic int concurrent_stop;
+_Atomic int concurrent_errors;
+
+void *concurrent_reader(void *arg){
+	while(!atomic_load(&concurrent_stop)){
+		int val = 0;
+		if(!configuration_get_int_value("stable", &val) || val != 42){
+			atomic_fetch_add(&concurrent_errors, 1);
+		}
+		// flip is always either int 1 or float 2.0, type and value are read together
+		t_config_value value;
+		if(!_value_find(&configuration, "flip", &value, NULL, 0)
+				|| (_value_type(value) == CONFIGURATION_VAL_INT && _value_int(value) != 1)
+				|| (_value_type(value) == CONFIGURATION_VAL_FLOAT && _value_float(value) != 2.0f)
+				|| _value_type(value) == CONFIGURATION_VAL_STR){
+			atomic_fetch_add(&concurrent_errors, 1);
+		}
+		// status is replaced all the time and its old strings are freed
+		char status[32];
+		if(!configuration_get_str_value("status", &status[0], sizeof(status)) || strncmp(status, "status ", 7) != 0){
+			atomic_fetch_add(&concurrent_errors, 1);
+		}
+	}
+	return NULL;
+}
+
+void test_configuration_concurrent(){
+	char key[32];
+	pthread_t readers[4];
+	configuration_set_int_value("stable", 42);
+	configuration_set_int_value("flip", 1);
+	configuration_set_str_value("status", "status start");
+	atomic_store(&concurrent_stop, 0);
+	atomic_store(&concurrent_errors, 0);
+	for(int i = 0; i < 4; i++){
+		pthread_create(&readers[i], NULL, concurrent_reader, NULL);
+	}
+	// adding keys replaces the table several times while readers use it
+	for(int i = 0; i < 5000; i++){
+		snprintf(key, sizeof(key), "key%d", i);
+		configuration_set_int_value(key, i);
+		snprintf(key, sizeof(key), "status %d", i);
+		configuration_set_str_value("status", key);
+		if(i % 2){
+			configuration_set_int_value("flip", 1);
+		}
+		else{
+			configuration_set_float_value("flip", 2.0f);
+		}
+	}
+	atomic_store(&concurrent_stop, 1);
+	for(int i = 0; i < 4; i++){
+		pthread_join(readers[i], NULL);
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, atomic_load(&concurrent_errors), "Readers should always see complete values.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(5003, num_items(), "Every key should have been added.");
+	int val = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("key4999", &val), "Last key should be readable.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(4999, val, "Last key should have its value.");
+
+	// without readers every replaced table can be freed
+	_tables_reclaim(&configuration);
+	TEST_ASSERT_NULL_MESSAGE(configuration.retired, "Replaced tables should be freed once no reader uses them.");
+	TEST_ASSERT_NULL_MESSAGE(configuration.retired_strs, "Replaced strings should be freed once no reader uses them.");
+}
+
+void *transaction_reader(void *arg){
+	while(!atomic_load(&concurrent_stop)){
+		// both values from one table, they are only ever set together
+		t_config_reader *reader = _read_begin(&configuration);
+		t_config_table *t = atomic_load(&configuration.table);
+		int x = _table_find(t, "x");
+		int y = _table_find(t, "y");
+		if(x < 0 || y < 0 || atomic_load(&t->items[x].val) != atomic_load(&t->items[y].val)){
+			atomic_fetch_add(&concurrent_errors, 1);
+		}
+		_read_end(&configuration, reader);
+	}
+	return NULL;
+}
+
+void *transaction_other_thread(void *arg){
+	*(int *)arg = configuration_set_int_value("other", 1);
+	return NULL;
+}
+
+void test_configuration_transaction(){
+	int val = 0;
+	float fval = 0.0f;
+	configuration_set_int_value("a", 1);
+	configuration_set_int_value("b", 1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_commit(), "Commit without a transaction should fail.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_abort(), "Abort without a transaction should fail.");
+
+	// staged sets are not visible until commit
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_begin(), "Begin should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_begin(), "Nested begin should fail.");
+	TEST_ASSERT_EQUAL_INT(1, configuration_set_int_value("a", 2));
+	TEST_ASSERT_EQUAL_INT(1, configuration_set_float_value("new", 3.5f));
+	TEST_ASSERT_EQUAL_INT(1, configuration_set_by_index_int_value(1, 4));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_by_index_int_value(100, 4), "Staged set out of bounds should fail.");
+	configuration_get_int_value("a", &val);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, val, "Staged set should not be visible.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_float_value("new", &fval), "Staged key should not exist yet.");
+
+	// other threads are not part of the transaction
+	pthread_t other;
+	int other_ok = 0;
+	pthread_create(&other, NULL, transaction_other_thread, &other_ok);
+	pthread_join(other, NULL);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, other_ok, "Set by another thread should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("other", &val), "Set by another thread should be applied.");
+
+	t_config_table *before = table();
+	unsigned long changes = atomic_load(&configuration.changes);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_commit(), "Commit should succeed.");
+	TEST_ASSERT_NOT_EQUAL_MESSAGE(before, table(), "Commit should publish a new table.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(changes + 1, atomic_load(&configuration.changes), "Commit should count as one change.");
+	configuration_get_int_value("a", &val);
+	TEST_ASSERT_EQUAL_INT(2, val);
+	configuration_get_int_value("b", &val);
+	TEST_ASSERT_EQUAL_INT(4, val);
+	TEST_ASSERT_EQUAL_INT(1, configuration_get_float_value("new", &fval));
+	TEST_ASSERT_EQUAL_FLOAT(3.5f, fval);
+	configuration_get_int_value("other", &val);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, val, "Commit should keep sets by other threads.");
+
+	// abort discards staged sets
+	configuration_begin();
+	configuration_set_int_value("a", 5);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_abort(), "Abort should succeed.");
+	configuration_get_int_value("a", &val);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, val, "Aborted set should be discarded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_int_value("a", 6), "Set after abort should be applied.");
+	configuration_get_int_value("a", &val);
+	TEST_ASSERT_EQUAL_INT(6, val);
+
+	// journaled in one append
+	strncpy(configuration.filename, "test_transaction.ini", 32);
+	unlink("fixtures/test_transaction.ini.journal");
+	configuration_use_journal(1);
+	configuration_begin();
+	configuration_set_int_value("a", 7);
+	configuration_set_str_value("s", "seven");
+	configuration_commit();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(strlen("a 7\ns seven\n"), file_size("fixtures/test_transaction.ini.journal"), "Commit should journal every set.");
+	configuration_use_journal(0);
+	unlink("fixtures/test_transaction.ini.journal");
+
+	// readers never see half a transaction
+	configuration_set_int_value("x", 0);
+	configuration_set_int_value("y", 0);
+	pthread_t readers[4];
+	atomic_store(&concurrent_stop, 0);
+	atomic_store(&concurrent_errors, 0);
+	for(int i = 0; i < 4; i++){
+		pthread_create(&readers[i], NULL, transaction_reader, NULL);
+	}
+	for(int i = 1; i < 2000; i++){
+		configuration_begin();
+		configuration_set_int_value("x", i);
+		configuration_set_int_value("y", i);
+		configuration_commit();
+	}
+	atomic_store(&concurrent_stop, 1);
+	for(int i = 0; i < 4; i++){
+		pthread_join(readers[i], NULL);
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, atomic_load(&concurrent_errors), "Readers should see whole transactions.");
+}
+
+void test_configuration_transaction_reload(){
+	char key[8];
+	strncpy(configuration.filename, "test_txn_reload.ini", 32);
+	for(int i = 0; i < 100; i++){
+		snprintf(key, sizeof(key), "k%d", i);
+		configuration_set_int_value(key, i);
+	}
+	configuration_save();
+	configuration_begin();
+	configuration_set_int_value("k90", 9999);
+	configuration_set_int_value("k1", 1111);
+
+	// a reload between begin and commit replaces the table the sets were staged against
+	FILE *f = fopen("fixtures/test_txn_reload.ini", "w");
+	fputs("a 1\nb 2\n", f);
+	fclose(f);
+	_watch_reload(&configuration);
+	TEST_ASSERT_EQUAL_INT(2, num_items());
+
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_commit(), "Commit after a reload should succeed.");
+	int val = 0;
+	configuration_get_int_value("b", &val);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, val, "Commit should not write to the item that took the staged index.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("k90", &val), "Staged key missing from the reloaded table should be added.");
+	TEST_ASSERT_EQUAL_INT(9999, val);
+	configuration_get_int_value("k1", &val);
+	TEST_ASSERT_EQUAL_INT(1111, val);
+	unlink("fixtures/test_txn_reload.ini");
 }
 
 void test_configuration_save(){
 	strncpy(configuration.filename, "test_configuration_saved.ini", 32);
-	strncpy(configuration.items[0].key, "test1", 32);
-	configuration.items[0].val.int_value = 1;
-	strncpy(configuration.items[1].key, "test2", 32);
-	configuration.items[1].val.int_value = 2;
-	strncpy(configuration.items[2].key, "test3", 32);
-	configuration.items[2].val.int_value = 3;
-	strncpy(configuration.items[3].key, "test4", 32);
-	configuration.items[3].val.int_value = 4;
-	strncpy(configuration.items[4].key, "teststr1", 32);
-	configuration.items[4].val_type = CONFIGURATION_VAL_STR;
-	snprintf(&configuration.items[4].val.str_value[0], CONFIGURATION_VAL_STR_LEN, "%s", "str1");
-	strncpy(configuration.items[5].key, "teststr2", 32);
-	configuration.items[5].val_type = CONFIGURATION_VAL_STR;
-	snprintf(&configuration.items[5].val.str_value[0], CONFIGURATION_VAL_STR_LEN, "%s", "str2");
-	strncpy(configuration.items[6].key, "testfloat1", 32);
-	configuration.items[6].val_type = CONFIGURATION_VAL_FLOAT;
-	configuration.items[6].val.float_value = 1.234f;
-	strncpy(configuration.items[7].key, "testfloat2", 32);
-	configuration.items[7].val_type = CONFIGURATION_VAL_FLOAT;
-	configuration.items[7].val.float_value = 56.789f;
-	configuration.num_items = 8;
+	make_items(8);
+	item(0)->key = "test1";
+	set_int(0, 1);
+	item(1)->key = "test2";
+	set_int(1, 2);
+	item(2)->key = "test3";
+	set_int(2, 3);
+	item(3)->key = "test4";
+	set_int(3, 4);
+	item(4)->key = "teststr1";
+	set_type(4, CONFIGURATION_VAL_STR);
+	set_str(4, "str1");
+	item(5)->key = "teststr2";
+	set_type(5, CONFIGURATION_VAL_STR);
+	set_str(5, "str2");
+	item(6)->key = "testfloat1";
+	set_type(6, CONFIGURATION_VAL_FLOAT);
+	set_float(6, 1.234f);
+	item(7)->key = "testfloat2";
+	set_type(7, CONFIGURATION_VAL_FLOAT);
+	set_float(7, 56.789f);
 	configuration_save();
 	configuration_load();
 
-	TEST_ASSERT_EQUAL_INT_MESSAGE(8, configuration.num_items, "eight configurations should have been loaded.");
-	int matched = (strncmp(configuration.items[0].key, "test1", 32) == 0);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(8, num_items(), "eight configurations should have been loaded.");
+	int matched = (strncmp(item(0)->key, "test1", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "test1 should have been in slot 0.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration.items[0].val.int_value, "test1 should have had value 1.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, item_int(0), "test1 should have had value 1.");
 
-	matched = (strncmp(configuration.items[1].key, "test2", 32) == 0);
+	matched = (strncmp(item(1)->key, "test2", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "test2 should have been in slot 1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(2, configuration.items[1].val.int_value, "test2 should have had value 2.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, item_int(1), "test2 should have had value 2.");
 
-	matched = (strncmp(configuration.items[2].key, "test3", 32) == 0);
+	matched = (strncmp(item(2)->key, "test3", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "test3 should have been in slot 1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(3, configuration.items[2].val.int_value, "test3 should have had value 3.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, item_int(2), "test3 should have had value 3.");
 
-	matched = (strncmp(configuration.items[3].key, "test4", 32) == 0);
+	matched = (strncmp(item(3)->key, "test4", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "test4 should have been in slot 1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(4, configuration.items[3].val.int_value, "test4 should have had value 4.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(4, item_int(3), "test4 should have had value 4.");
 
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, configuration.items[4].val_type, "fifth configuration item type should be str.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, item_type(4), "fifth configuration item type should be str.");
 
-	matched = (strncmp(configuration.items[6].key, "testfloat1", 32) == 0);
+	matched = (strncmp(item(6)->key, "testfloat1", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "testfloat1 should have been in slot 6.");
-	TEST_ASSERT_FLOAT_WITHIN_MESSAGE(0.001f, 1.234f, configuration.items[6].val.float_value, "testfloat1 should have had value 1.234.");
+	TEST_ASSERT_FLOAT_WITHIN_MESSAGE(0.001f, 1.234f, item_float(6), "testfloat1 should have had value 1.234.");
+}
+
+void test_configuration_save_unchanged(){
+	char path[300];
+	char tmppath[310];
+	struct stat st;
+	strncpy(configuration.filename, "test_unchanged.ini", 32);
+	snprintf(path, sizeof(path), "%s/%s", configuration.configdir, configuration.filename);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	unlink(path);
+
+	configuration_set_int_value("test1", 1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, stat(path, &st), "Save should have written the file.");
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(0, stat(tmppath, &st), "Save should not leave a temp file behind.");
+
+	// without changes nothing is written
+	unlink(path);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Unchanged save should succeed.");
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(0, stat(path, &st), "Unchanged save should not write the file.");
+
+	// a set makes the next save write again, keeping the file's permissions
+	configuration_set_int_value("test1", 2);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save after set should succeed.");
+	chmod(path, 0600);
+	configuration_set_int_value("test1", 3);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save after set should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, stat(path, &st), "Save should have replaced the file.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0600, st.st_mode & 0777, "Replaced file should keep its permissions.");
+
+	// a loaded file matches the values
+	reset_configuration();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Load should succeed.");
+	unlink(path);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save after load should succeed.");
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(0, stat(path, &st), "Save after load should not write the file.");
+
+	// a failed save stays pending
+	configuration_set_int_value("test1", 4);
+	mkdir(path, 0755);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_save(), "Save over a directory should fail.");
+	TEST_ASSERT_NOT_EQUAL_INT_MESSAGE(0, stat(tmppath, &st), "Failed save should not leave a temp file behind.");
+	rmdir(path);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Retried save should succeed.");
+	reset_configuration();
+	configuration_load();
+	int val = 0;
+	configuration_get_int_value("test1", &val);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(4, val, "Retried save should have written the value.");
+	unlink(path);
+}
+
+void test_configuration_configdir_fd(){
+	strncpy(configuration.filename, "test_dirfd.ini", 32);
+	configuration_set_int_value("test1", 1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save should succeed.");
+	int fd = atomic_load(&configuration.dir_fd);
+	TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "Save should have opened configdir.");
+	configuration_set_int_value("test1", 2);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Second save should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(fd, atomic_load(&configuration.dir_fd), "Second save should reuse the configdir fd.");
+	reset_configuration();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(-1, atomic_load(&configuration.dir_fd), "Reset should close the configdir fd.");
+
+	strncpy(configuration.filename, "test_dirfd.ini", 32);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Load relative to configdir should succeed.");
+	int val = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("test1", &val), "test1 should have been loaded.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, val, "test1 should have the saved value.");
+	unlink("fixtures/test_dirfd.ini");
+
+	// another dirname closes the configdir of the previous one
+	configuration.configdirok = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init("configurationtest", "test_dirfd.ini"), "Init should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save should succeed.");
+	TEST_ASSERT_TRUE_MESSAGE(atomic_load(&configuration.dir_fd) >= 0, "Save should have opened configdir.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init("configurationtest2", "test_dirfd.ini"), "Init of another dirname should succeed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(-1, atomic_load(&configuration.dir_fd), "Init of another dirname should close the configdir fd.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("./fixtures/configurationtest2", configuration_get_configdir(), "Init of another dirname should find its configdir.");
+	unlink("fixtures/configurationtest/test_dirfd.ini");
+	rmdir("fixtures/configurationtest2");
+}
+
+void test_configuration_configdir_long(){
+	// configdir is not limited in length
+	char base[512] = "fixtures/long";
+	mkdir(base, 0755);
+	while(strlen(base) < 400){
+		strcat(base, "/0123456789abcdef");
+		mkdir(base, 0755);
+	}
+	setenv("XDG_CONFIG_HOME", base, 1);
+	configuration.configdirok = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_init("configurationtest", "test_long.ini"), "Init with a long configdir should succeed.");
+	TEST_ASSERT_GREATER_THAN_INT_MESSAGE(400, strlen(configuration_get_configdir()), "Configdir should not be truncated.");
+	configuration_set_int_value("test1", 1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save in a long configdir should succeed.");
+	reset_configuration();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Load from a long configdir should succeed.");
+	int val = 0;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("test1", &val), "test1 should have been loaded.");
+
+	char path[600];
+	snprintf(path, sizeof(path), "%s/test_long.ini", configuration_get_configdir());
+	unlink(path);
+	rmdir(configuration_get_configdir());
+	while(strcmp(base, "fixtures") != 0){
+		rmdir(base);
+		*strrchr(base, '/') = '\0';
+	}
 }
 
 void test_configuration_get_configdir(){
 	configuration.configdirok = 0;
-	snprintf(configuration.configdir, 256, "testdir1");
+	_configdir_set(&configuration, NULL, "testdir1");
 	TEST_ASSERT_EQUAL_STRING_MESSAGE("", configuration_get_configdir(), "Configdir should be empty if configdir not ok.");
 	configuration.configdirok = 1;
 	TEST_ASSERT_EQUAL_STRING_MESSAGE("testdir1", configuration_get_configdir(), "Configdir should be returned.");
 }
 
 void test_configuration_set_by_index_int_value(){
-	configuration_set_by_index_int_value(0, 1);
-	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration.items[0].val.int_value, "configuration item at index 0 should have been set to 1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, configuration.items[0].val_type, "configuration item at index 0 should have type INT.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_by_index_int_value(0, 1), "should not have set value at an index with no item.");
+	make_items(1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_by_index_int_value(0, 1), "should have set value at index 0.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, item_int(0), "configuration item at index 0 should have been set to 1.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_INT, item_type(0), "configuration item at index 0 should have type INT.");
 }
 
 void test_configuration_set_int_value(){
 	configuration_set_int_value("test1", 1);
-	int matched = (strncmp(configuration.items[0].key, "test1", 32) == 0);
+	int matched = (strncmp(item(0)->key, "test1", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "test1 should have been in first configuration slot.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration.items[0].val.int_value, "test1 should have had value 1.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, item_int(0), "test1 should have had value 1.");
 
 	// update value
 	configuration_set_int_value("test1", 0);
-	matched = (strncmp(configuration.items[0].key, "test1", 32) == 0);
+	matched = (strncmp(item(0)->key, "test1", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "test1 should have been in first configuration slot.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration.items[0].val.int_value, "test1 should have had value 0.");
-	matched = (strncmp(configuration.items[1].key, "test1", 32) == 0);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, item_int(0), "test1 should have had value 0.");
+	matched = (item(1)->key && strncmp(item(1)->key, "test1", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, matched, "test1 should NOT have been in second configuration slot.");
 
 	configuration_set_int_value("test2", 1);
-	matched = (strncmp(configuration.items[1].key, "test2", 32) == 0);
+	matched = (strncmp(item(1)->key, "test2", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "test2 should have been in second configuration slot.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration.items[1].val.int_value, "test2 should have had value 1.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, item_int(1), "test2 should have had value 1.");
 }
 
 void test_configuration_get_by_index_int_value(){
-	configuration.items[0].val.int_value = 1;
-	configuration.items[0].val_type = CONFIGURATION_VAL_INT;
+	make_items(1);
+	set_int(0, 1);
+	set_type(0, CONFIGURATION_VAL_INT);
 	int val = 0;
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_int_value(-1, &val), "should not have successfully got index -1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_int_value(CONFIGURATION_ITEMS_MAX, &val), "should not have successfully got index CONFIGURATION_ITEMS_MAX.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_FLOAT;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_int_value(num_items(), &val), "should not have successfully got index num_items.");
+	set_type(0, CONFIGURATION_VAL_FLOAT);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_int_value(0, &val), "should not have successfully got int from float.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_INT;
+	set_type(0, CONFIGURATION_VAL_INT);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_int_value(0, &val), "should have successfully got index 0.");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, val, "should have got 1 from index 0.");
 }
@@ -230,61 +1049,65 @@ void test_configuration_get_int_value(){
 	reset_configuration();
 	int val = 0;
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_int_value("test1", &val), "test1 should NOT be configured.");
-	strncpy(configuration.items[0].key, "test1", 32);
-	configuration.items[0].val.int_value = 1;
-	configuration.num_items = 1;
-	configuration.items[0].val_type = CONFIGURATION_VAL_FLOAT;
+	make_items(1);
+	item(0)->key = "test1";
+	set_int(0, 1);
+	_index_rebuild(table());
+	set_type(0, CONFIGURATION_VAL_FLOAT);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_int_value(0, &val), "should not have successfully got int from float.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_INT;
+	set_type(0, CONFIGURATION_VAL_INT);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("test1", &val), "test1 should be configured.");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, val, "val should be 1.");
 
 	int val2 = 0;
-	strncpy(configuration.items[1].key, "test2", 32);
-	configuration.items[1].val.int_value = 1;
-	configuration.num_items = 2;
+	item(1)->key = "test2";
+	set_int(1, 1);
+	make_items(2);
+	_index_rebuild(table());
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("test2", &val2), "test2 should be configured.");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, val2, "val should be 1.");
 }
 
 void test_configuration_set_by_index_float_value(){
+	make_items(1);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_by_index_float_value(-1, 0.1f), "should not have successfully set value at index -1");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_by_index_float_value(CONFIGURATION_ITEMS_MAX, 0.1f), "should not have successfully set value at index CONFIGURATION_ITEMS_MAX");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_by_index_float_value(num_items(), 0.1f), "should not have successfully set value at index num_items");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_by_index_float_value(0, 0.1f), "should have successfully set value");
-	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0.1f, configuration.items[0].val.float_value, "configuration item at index 0 should have been set to 0.1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, configuration.items[0].val_type, "configuration item at index 0 should have type FLOAT.");
+	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0.1f, item_float(0), "configuration item at index 0 should have been set to 0.1.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, item_type(0), "configuration item at index 0 should have type FLOAT.");
 }
 
 void test_configuration_set_float_value(){
 	configuration_set_float_value("testfloat1", 1.234f);
-	int matched = (strncmp(configuration.items[0].key, "testfloat1", 32) == 0);
+	int matched = (strncmp(item(0)->key, "testfloat1", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "testfloat1 should have been in first configuration slot.");
-	TEST_ASSERT_FLOAT_WITHIN_MESSAGE(0.001f, 1.234f, configuration.items[0].val.float_value, "testfloat1 should have had value 1.234");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, configuration.items[0].val_type, "val_type should have been set to float");
+	TEST_ASSERT_FLOAT_WITHIN_MESSAGE(0.001f, 1.234f, item_float(0), "testfloat1 should have had value 1.234");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_FLOAT, item_type(0), "val_type should have been set to float");
 
 	// update value
 	configuration_set_float_value("testfloat1", 56.789f);
-	matched = (strncmp(configuration.items[0].key, "testfloat1", 32) == 0);
+	matched = (strncmp(item(0)->key, "testfloat1", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "testfloat1 should have been in first configuration slot.");
-	TEST_ASSERT_FLOAT_WITHIN_MESSAGE(0.001f, 56.789, configuration.items[0].val.float_value, "testfloat1 should have had value 56.789.");
-	matched = (strncmp(configuration.items[1].key, "testfloat1", 32) == 0);
+	TEST_ASSERT_FLOAT_WITHIN_MESSAGE(0.001f, 56.789, item_float(0), "testfloat1 should have had value 56.789.");
+	matched = (item(1)->key && strncmp(item(1)->key, "testfloat1", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, matched, "testfloat1 should NOT have been in second configuration slot.");
 
 	configuration_set_float_value("testfloat2", 12.345f);
-	matched = (strncmp(configuration.items[1].key, "testfloat2", 32) == 0);
+	matched = (strncmp(item(1)->key, "testfloat2", 32) == 0);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, matched, "testfloat2 should have been in second configuration slot.");
-	TEST_ASSERT_FLOAT_WITHIN_MESSAGE(0.001f, 12.345f, configuration.items[1].val.float_value, "testfloat2 should have had value 12.345.");
+	TEST_ASSERT_FLOAT_WITHIN_MESSAGE(0.001f, 12.345f, item_float(1), "testfloat2 should have had value 12.345.");
 }
 
 void test_configuration_get_by_index_float_value(){
 	float val = 0.0f;
-	configuration.items[0].val_type = CONFIGURATION_VAL_FLOAT;
-	configuration.items[0].val.float_value = 0.1f;
+	make_items(1);
+	set_type(0, CONFIGURATION_VAL_FLOAT);
+	set_float(0, 0.1f);
 	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0, configuration_get_by_index_float_value(-1, &val), "should not have got value from index -1.");
-	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0, configuration_get_by_index_float_value(CONFIGURATION_ITEMS_MAX, &val), "should not have got value from index CONFIGURATION_ITEMS_MAX.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_INT;
+	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0, configuration_get_by_index_float_value(num_items(), &val), "should not have got value from index num_items.");
+	set_type(0, CONFIGURATION_VAL_INT);
 	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0, configuration_get_by_index_float_value(0, &val), "should not have got FLOAT from INT.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_FLOAT;
+	set_type(0, CONFIGURATION_VAL_FLOAT);
 	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(1, configuration_get_by_index_float_value(0, &val), "should have got value from index 0.");
 	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0.1f, val, "should have got 0.1 from index 0.");
 }
@@ -293,47 +1116,51 @@ void test_configuration_get_float_value(){
 	reset_configuration();
 	float val = 0.0f;
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_float_value("testfloat1", &val), "testfloat1 should NOT be configured.");
-	strncpy(configuration.items[0].key, "testfloat1", 32);
-	configuration.items[0].val_type = CONFIGURATION_VAL_FLOAT;
-	configuration.items[0].val.float_value = 1.234f;
-	configuration.num_items = 1;
+	make_items(1);
+	item(0)->key = "testfloat1";
+	set_type(0, CONFIGURATION_VAL_FLOAT);
+	set_float(0, 1.234f);
+	_index_rebuild(table());
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_float_value("testfloat1", &val), "testfloat1 should be configured.");
 	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(1.234f, val, "val should be 1.234.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_INT;
+	set_type(0, CONFIGURATION_VAL_INT);
 	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(0, configuration_get_by_index_float_value(0, &val), "should not have got FLOAT from INT.");
 
 	float val2 = 0.0f;
-	strncpy(configuration.items[1].key, "testfloat2", 32);
-	configuration.items[1].val_type = CONFIGURATION_VAL_FLOAT;
-	configuration.items[1].val.float_value = 12.345f;
-	configuration.num_items = 2;
+	item(1)->key = "testfloat2";
+	set_type(1, CONFIGURATION_VAL_FLOAT);
+	set_float(1, 12.345f);
+	make_items(2);
+	_index_rebuild(table());
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_float_value("testfloat2", &val2), "testfloat2 should be configurationed.");
 	TEST_ASSERT_EQUAL_FLOAT_MESSAGE(12.345f, val2, "val2 should be 12.345");
 }
 
 void test_configuration_set_by_index_str_value(){
+	make_items(1);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_by_index_str_value(-1, "test"), "Should not have successfully set value at index -1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_by_index_str_value(CONFIGURATION_ITEMS_MAX, "test"), "Should not have successfully set value at index CONFIGURATION_ITEMS_MAX.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_set_by_index_str_value(num_items(), "test"), "Should not have successfully set value at index num_items.");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_set_by_index_str_value(0, "test"), "Should have successfully set value at index 0.");
-	TEST_ASSERT_EQUAL_STRING_MESSAGE("test", configuration.items[0].val.str_value, "configuration item at index 0 should have been set to \"test\".");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, configuration.items[0].val_type, "configuration item at index 0 should have type STR.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("test", item_str(0), "configuration item at index 0 should have been set to \"test\".");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, item_type(0), "configuration item at index 0 should have type STR.");
 }
 
 void test_configuration_set_str_value(){
 	reset_configuration();
 	configuration_set_str_value("test1", "str1");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, configuration.items[0].val_type, "val type should be str");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_VAL_STR, item_type(0), "val type should be str");
 }
 
 void test_configuration_get_by_index_str_value(){
 	char val[32] = {};
-	configuration.items[0].val_type = CONFIGURATION_VAL_STR;
-	snprintf(configuration.items[0].val.str_value, CONFIGURATION_VAL_STR_LEN, "%s", "test");
+	make_items(1);
+	set_type(0, CONFIGURATION_VAL_STR);
+	set_str(0, "test");
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_str_value(-1, &val[0], 32), "should not have got value from index -1.");
-	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_str_value(CONFIGURATION_ITEMS_MAX, &val[0], 32), "should not have got value from index CONFIGURATION_ITEMS_MAX.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_INT;
-	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_str_value(CONFIGURATION_ITEMS_MAX, &val[0], 32), "should not have got STR from INT.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_STR;
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_str_value(num_items(), &val[0], 32), "should not have got value from index num_items.");
+	set_type(0, CONFIGURATION_VAL_INT);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_by_index_str_value(num_items(), &val[0], 32), "should not have got STR from INT.");
+	set_type(0, CONFIGURATION_VAL_STR);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_by_index_str_value(0, &val[0], 32), "should have got value from index 0.");
 	TEST_ASSERT_EQUAL_STRING_MESSAGE("test", val, "should have got \"test\"");
 }
@@ -342,29 +1169,382 @@ void test_configuration_get_str_value(){
 	reset_configuration();
 	char val[32] = {};
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_str_value("test1", &val[0], 32), "test1 should NOT be configured.");
-	snprintf(&configuration.items[0].key[0], 32, "%s", "test1");
-	snprintf(&configuration.items[0].val.str_value[0], CONFIGURATION_VAL_STR_LEN, "%s", "str1");
+	make_items(1);
+	item(0)->key = "test1";
+	set_str(0, "str1");
 	configuration.loaded = 1;
-	configuration.num_items = 1;
-	configuration.items[0].val_type = CONFIGURATION_VAL_INT;
+	_index_rebuild(table());
+	set_type(0, CONFIGURATION_VAL_INT);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_get_str_value("test1", &val[0], 32), "should not have got STR from INT.");
-	configuration.items[0].val_type = CONFIGURATION_VAL_STR;
+	set_type(0, CONFIGURATION_VAL_STR);
 	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_str_value("test1", &val[0], 32), "should have got val for test1");
 	TEST_ASSERT_EQUAL_STRING_MESSAGE("str1", val, "val should be str1");
 }
 
 void test_configuration_get_error(){
         TEST_ASSERT_EQUAL_INT_MESSAGE(0, strncmp("", configuration_get_error(), 1), "Should not be any error message.");
-	configuration_set_by_index_float_value(CONFIGURATION_ITEMS_MAX + 1, 0.1f);
+	configuration_set_by_index_float_value(num_items() + 1, 0.1f);
         TEST_ASSERT_LESS_THAN_INT_MESSAGE(0, strncmp("", configuration_get_error(), 1), "Should have an error message.");
 }
 
+void test_configuration_stats(){
+	t_configuration_stats stats;
+	strncpy(configuration.filename, "test_configuration.ini", 32);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Configuration should have been loaded.");
+	int val = 0;
+	configuration_get_int_value("one", &val);
+	configuration_get_int_value("non-existant", &val);
+	configuration_get_by_index_int_value(num_items() + 1, &val);
+	configuration_set_int_value("one", 2);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_stats(&stats), "Metrics should be built in.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(3, stats.gets, "Every get should be counted.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, stats.get_misses, "Missing key and index should be counted.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.sets, "Set should be counted.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.loads, "Load should be counted.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.load_ns.count, "Load should be timed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, stats.parse_errors, "Fixture should parse cleanly.");
+
+	strncpy(configuration.filename, "test_configuration_saved.ini", 32);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Configuration should have been saved.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Unchanged configuration should save.");
+	configuration_get_stats(&stats);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.saves, "Save should be counted.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.saves_skipped, "Unchanged save should be skipped.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.save_ns.count, "Only the written save should be timed.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(2, stats.fsync_ns.count, "File and directory syncs should be timed.");
+	unsigned long bucketed = 0;
+	for(int i = 0; i < CONFIGURATION_HISTOGRAM_BUCKETS; i++){
+		bucketed += stats.save_ns.buckets[i];
+	}
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, bucketed, "Save should fall in one bucket.");
+	TEST_ASSERT_TRUE_MESSAGE(stats.save_ns.total_ns > 0, "Save should take some time.");
+
+	// a NUL byte fails the load
+	reset_configuration();
+	FILE *f = fopen("fixtures/test_malformed.ini", "w");
+	fprintf(f, "one 1\n");
+	fputc('\0', f);
+	fclose(f);
+	strncpy(configuration.filename, "test_malformed.ini", 32);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration_load(), "Malformed configuration should not load.");
+	unlink("fixtures/test_malformed.ini");
+	configuration_get_stats(&stats);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, stats.gets, "Reset should clear the metrics.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.loads, "Failed load should be counted.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.load_failures, "Load failure should be counted.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, stats.parse_errors, "Parse error should be counted.");
+}
+
+struct log_messages {
+	int calls;
+	t_configuration_log_level level;
+	char msg[128];
+};
+
+void log_message(configuration_t *cfg, t_configuration_log_level level, const char *msg, void *ctx){
+	struct log_messages *messages = ctx;
+	messages->calls++;
+	messages->level = level;
+	snprintf(messages->msg, sizeof(messages->msg), "%s", msg);
+}
+
+void test_configuration_save_async_coalesce(){
+	t_configuration_stats stats;
+	strncpy(configuration.filename, "test_async.ini", 32);
+	// requests pile up while the first save waits for the save lock
+	pthread_mutex_lock(&configuration.save_lock);
+	for(int i = 0; i < 20; i++){
+		configuration_set_int_value("test1", i);
+		TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save_async(NULL, NULL), "Save request should succeed.");
+	}
+	pthread_mutex_unlock(&configuration.save_lock);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_flush(), "Flush should succeed.");
+	configuration_get_stats(&stats);
+	TEST_ASSERT_TRUE_MESSAGE(stats.saves + stats.saves_skipped <= 2, "Waiting requests should share one save.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(20, configuration.save_requests_done, "Every request should be done.");
+
+	reset_configuration();
+	strncpy(configuration.filename, "test_async.ini", 32);
+	configuration_load();
+	int val = 0;
+	configuration_get_int_value("test1", &val);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(19, val, "Last value should have been saved.");
+
+	// a save writes the values as they are when it runs, later sets included
+	pthread_mutex_lock(&configuration.save_lock);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save_async(NULL, NULL), "Save request should succeed.");
+	configuration_set_int_value("test2", 2);
+	pthread_mutex_unlock(&configuration.save_lock);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_flush(), "Flush should succeed.");
+	reset_configuration();
+	strncpy(configuration.filename, "test_async.ini", 32);
+	configuration_load();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_get_int_value("test2", &val), "Set after the request should have been saved.");
+	unlink("fixtures/test_async.ini");
+}
+
+void test_configuration_layers_reload(){
+	FILE *f = fopen("fixtures/test_layers.ini", "w");
+	fprintf(f, "overridden user\n");
+	fclose(f);
+	setenv("XDG_CONFIG_DIRS", "./fixtures/system1:./fixtures/system2", 1);
+	strncpy(configuration.dirname, "configurationtest", 32);
+	strncpy(configuration.filename, "test_layers.ini", 32);
+	configuration_use_system_config(1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Layers should have been loaded.");
+	t_config_table *base = configuration.layers_base;
+	TEST_ASSERT_NOT_NULL_MESSAGE(base, "Load should have kept the layers below the config file.");
+
+	// a changed config file is parsed on top of the kept layers
+	f = fopen("fixtures/test_layers.ini", "w");
+	fprintf(f, "overridden reloaded\n");
+	fclose(f);
+	_watch_reload(&configuration);
+	TEST_ASSERT_EQUAL_PTR_MESSAGE(base, configuration.layers_base, "Reload should reuse the layers below.");
+	char strval[32] = {};
+	configuration_get_str_value("overridden", &strval[0], 32);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("reloaded", strval, "Reload should read the config file again.");
+	configuration_get_str_value("shared", &strval[0], 32);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("system1", strval, "Reload should keep the system values.");
+
+	// removing the config file leaves the layers below
+	unlink("fixtures/test_layers.ini");
+	_watch_reload(&configuration);
+	configuration_get_str_value("overridden", &strval[0], 32);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("system1", strval, "Missing config file should leave the system value.");
+
+	configuration_use_system_config(0);
+	TEST_ASSERT_NULL_MESSAGE(configuration.layers_base, "Disabling system config should drop the layers.");
+	unsetenv("XDG_CONFIG_DIRS");
+	strncpy(configuration.dirname, "configuration", 32);
+}
+
+void test_configuration_layers_toggle(){
+	struct configuration_index_mapping confmap[] = {
+		{ "limit", 0, CONFIGURATION_VAL_INT, "1" }
+	};
+	configuration_init_indexes(confmap, 1);
+	write_file("fixtures/test_layers_toggle.ini", "limit 5\n");
+	setenv("XDG_CONFIG_DIRS", "./fixtures/system1", 1);
+	strncpy(configuration.filename, "test_layers_toggle.ini", 32);
+	configuration_use_system_config(1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_load(), "Layers should have been loaded.");
+	_watch_reload(&configuration);
+
+	// the layers are read again on top of the defaults, not the user values
+	configuration_use_env("LAYERSTOGGLE_");
+	write_file("fixtures/test_layers_toggle.ini", "limit 5\nextra 1\n");
+	_watch_reload(&configuration);
+	int val = 0;
+	configuration_get_int_value("limit", &val);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(5, val, "User value should have been reloaded.");
+	configuration_set_int_value("other", 7);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, configuration_save(), "Save should succeed.");
+	char saved[256] = {};
+	FILE *f = fopen("fixtures/test_layers_toggle.ini", "r");
+	fread(saved, 1, sizeof(saved) - 1, f);
+	fclose(f);
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("limit 5\nextra 1\nother 7\n", saved, "Save should keep the user values.");
+
+	configuration_use_system_config(0);
+	configuration_use_env(NULL);
+	unsetenv("XDG_CONFIG_DIRS");
+	unlink("fixtures/test_layers_toggle.ini");
+}
+
+void test_configuration_set_log(){
+	struct log_messages messages = { 0 };
+	configuration_set_log(log_message, &messages);
+	struct configuration_index_mapping confmap[] = {
+		{ "invalid", -1, CONFIGURATION_VAL_INT, "0" }
+	};
+	configuration_init_indexes(confmap, 1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_ERROR_INVALID, configuration_get_error_code(), "Mapping should be invalid.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, messages.calls, "Invalid mapping should be logged.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(CONFIGURATION_LOG_ERROR, messages.level, "Invalid mapping should be an error.");
+	TEST_ASSERT_EQUAL_STRING(configuration_get_error(), messages.msg);
+	configuration_set_log(NULL, NULL);
+	messages.calls = 0;
+	configuration_init_indexes(confmap, 1);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, messages.calls, "Default log should not call the callback.");
+}
+
+void test_configuration_reset_options(){
+	struct log_messages messages = { 0 };
+	configuration_use_snapshot(1);
+	configuration_use_journal(1);
+	configuration_use_system_config(1);
+	configuration_use_env("RESETTEST_");
+	configuration_set_log(log_message, &messages);
+	reset_configuration();
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration.use_snapshot, "Reset should disable snapshots.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration.use_journal, "Reset should disable the journal.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, configuration.use_system_config, "Reset should disable system config.");
+	TEST_ASSERT_EQUAL_STRING_MESSAGE("", configuration.env_prefix, "Reset should disable environment overrides.");
+	TEST_ASSERT_NULL_MESSAGE(configuration.log, "Reset should restore the default log.");
+}
+
+int count_key_order(configuration_t *cfg, const char *key, const t_configuration_value *value, void *ctx){
+	char *previous = ctx;
+	TEST_ASSERT_TRUE_MESSAGE(strcmp(previous, key) < 0, "Keys should be passed in order.");
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_VAL_INT, value->type);
+	snprintf(previous, 32, "%s", key);
+	return 1;
+}
+
+void test_configuration_sorted(){
+	char key[32];
+	// room for the new keys in place
+	_table_reserve_published(&configuration, 32);
+	for(int i = 0; i < 8; i++){
+		snprintf(key, sizeof(key), "a.%02d", 7 - i);
+		configuration_set_int_value(key, i);
+	}
+	char previous[32] = "";
+	TEST_ASSERT_EQUAL_INT(8, configuration_foreach_prefix("a.", count_key_order, previous));
+	t_config_sorted *sorted = atomic_load(&table()->sorted);
+	TEST_ASSERT_NOT_NULL_MESSAGE(sorted, "First query should sort the table.");
+	TEST_ASSERT_EQUAL_INT(8, sorted->num_keys);
+
+	// a few new keys are merged in without sorting again
+	configuration_set_int_value("a.050", 0);
+	configuration_set_int_value("b", 0);
+	previous[0] = '\0';
+	TEST_ASSERT_EQUAL_INT(9, configuration_foreach_prefix("a.", count_key_order, previous));
+	TEST_ASSERT_EQUAL_STRING("a.07", previous);
+	TEST_ASSERT_TRUE_MESSAGE(sorted == atomic_load(&table()->sorted), "Few new keys should not sort again.");
+
+	// more new keys than the tail holds are merged into a new order, however large the table
+	reset_configuration();
+	_table_reserve_published(&configuration, 512);
+	for(int i = 0; i < 256; i++){
+		snprintf(key, sizeof(key), "k%03d", 255 - i);
+		configuration_set_int_value(key, i);
+	}
+	previous[0] = '\0';
+	configuration_foreach_prefix("k", count_key_order, previous);
+	sorted = atomic_load(&table()->sorted);
+	for(int i = 0; i < 40; i++){
+		snprintf(key, sizeof(key), "k%03dx", i * 7);
+		configuration_set_int_value(key, i);
+	}
+	// a reader still using the old order keeps it
+	t_config_reader *reader = _read_begin(&configuration);
+	previous[0] = '\0';
+	TEST_ASSERT_EQUAL_INT(296, configuration_foreach_prefix("k", count_key_order, previous));
+	t_config_sorted *resorted = atomic_load(&table()->sorted);
+	TEST_ASSERT_EQUAL_INT_MESSAGE(296, resorted->num_keys, "More new keys than the tail holds should sort again.");
+	TEST_ASSERT_EQUAL_INT(296, resorted->num_items);
+	configuration_set_int_value("l", 0);
+	TEST_ASSERT_TRUE_MESSAGE(resorted->older == sorted, "Replaced order should be kept while a reader may use it.");
+	_read_end(&configuration, reader);
+	configuration_set_int_value("m", 0);
+	TEST_ASSERT_NULL_MESSAGE(resorted->older, "Replaced order should be freed once no reader uses it.");
+}
+
+struct stream_sum {
+	int num_entries;
+	long sum;
+	int bad_keys;
+};
+
+int sum_entry(configuration_t *cfg, const char *key, const t_configuration_value *value, void *ctx){
+	struct stream_sum *sum = ctx;
+	char expected[32];
+	snprintf(expected, sizeof(expected), "entry%06d", value->int_value);
+	sum->bad_keys += strcmp(expected, key) != 0;
+	sum->num_entries++;
+	sum->sum += value->int_value;
+	return 1;
+}
+
+void test_configuration_stream_chunks(){
+	// lines cross chunk boundaries, one is longer than a chunk
+	const char *name = "fixtures/test_stream_chunks.ini";
+	FILE *f = fopen(name, "w");
+	long expected_sum = 0;
+	for(int i = 0; i < 20000; i++){
+		fprintf(f, "entry%06d %d\n", i, i);
+		expected_sum += i;
+		if(i == 7000){
+			fputs("long ", f);
+			for(int j = 0; j < CONFIGURATION_STREAM_CHUNK; j++){
+				fputc('x', f);
+			}
+			fputc('\n', f);
+		}
+	}
+	fclose(f);
+
+	struct log_messages messages = { 0 };
+	configuration_set_log(log_message, &messages);
+	struct stream_sum sum = { 0 };
+	TEST_ASSERT_EQUAL_INT(20000, configuration_stream(name, sum_entry, &sum));
+	TEST_ASSERT_EQUAL_INT_MESSAGE(0, sum.bad_keys, "Keys should match their values across chunks.");
+	TEST_ASSERT_TRUE_MESSAGE(sum.sum == expected_sum, "Every entry should be passed once.");
+	TEST_ASSERT_EQUAL_INT_MESSAGE(1, messages.calls, "Line longer than a chunk should be logged once.");
+	TEST_ASSERT_NOT_NULL_MESSAGE(strstr(messages.msg, "Entry 7002 "), "Log should name the entry of the long line.");
+
+	// binary files are rejected
+	f = fopen(name, "w");
+	fputs("entry000001 1\nentry", f);
+	fputc('\0', f);
+	fclose(f);
+	memset(&sum, 0, sizeof(sum));
+	TEST_ASSERT_EQUAL_INT(-1, configuration_stream(name, sum_entry, &sum));
+	TEST_ASSERT_EQUAL_INT(CONFIGURATION_ERROR_MALFORMED, configuration_get_error_code());
+	TEST_ASSERT_NOT_NULL_MESSAGE(strstr(configuration_get_error(), "after line 0."), "Error should name the last line read.");
+	TEST_ASSERT_EQUAL_INT(0, sum.num_entries);
+	configuration_set_log(NULL, NULL);
+	unlink(name);
+}
+
+void test_configuration_scan_delim(){
+	// delimiters at every position of every block width, and none at all
+	char text[100];
+	for(int len = 0; len <= 96; len++){
+		for(int delim = 0; delim <= len; delim++){
+			memset(text, 'k', sizeof(text));
+			if(delim < len){
+				text[delim] = " \t\r\n"[delim % 4];
+			}
+			const char *expected = text + delim;
+			TEST_ASSERT_TRUE(_scan_delim_scalar(text, text + len) == expected);
+#ifdef CONFIGURATION_SCAN_X86
+			TEST_ASSERT_TRUE_MESSAGE(_scan_delim_sse2(text, text + len) == expected, "SSE2 scan should match the scalar scan.");
+			if(__builtin_cpu_supports("avx2")){
+				TEST_ASSERT_TRUE_MESSAGE(_scan_delim_avx2(text, text + len) == expected, "AVX2 scan should match the scalar scan.");
+			}
+#endif
+		}
+	}
+	// bytes above 127 are not delimiters
+	memset(text, 0xa0, sizeof(text));
+	TEST_ASSERT_TRUE(configuration_scan_delim(text, text + 64) == text + 64);
+}
+
 int main(){
 	UNITY_BEGIN();
 	RUN_TEST(test_configuration_init);
 	RUN_TEST(test_configuration_init_indexes);
+	RUN_TEST(test_configuration_mapping_hash);
 	RUN_TEST(test_configuration_load);
+	RUN_TEST(test_configuration_load_duplicates);
+	RUN_TEST(test_configuration_load_unterminated);
+	RUN_TEST(test_configuration_parse);
+	RUN_TEST(test_configuration_snapshot);
+	RUN_TEST(test_configuration_snapshot_schema);
+	RUN_TEST(test_configuration_journal);
+	RUN_TEST(test_configuration_index);
+	RUN_TEST(test_configuration_handle_generation);
+	RUN_TEST(test_configuration_strings);
+	RUN_TEST(test_configuration_concurrent);
+	RUN_TEST(test_configuration_transaction);
+	RUN_TEST(test_configuration_transaction_reload);
 	RUN_TEST(test_configuration_save);
+	RUN_TEST(test_configuration_save_unchanged);
+	RUN_TEST(test_configuration_configdir_fd);
+	RUN_TEST(test_configuration_configdir_long);
 	RUN_TEST(test_configuration_get_configdir);
 	RUN_TEST(test_configuration_set_by_index_int_value);
 	RUN_TEST(test_configuration_set_int_value);
@@ -379,5 +1559,14 @@ int main(){
 	RUN_TEST(test_configuration_get_by_index_str_value);
 	RUN_TEST(test_configuration_get_str_value);
 	RUN_TEST(test_configuration_get_error);
+	RUN_TEST(test_configuration_stats);
+	RUN_TEST(test_configuration_save_async_coalesce);
+	RUN_TEST(test_configuration_layers_reload);
+	RUN_TEST(test_configuration_layers_toggle);
+	RUN_TEST(test_configuration_set_log);
+	RUN_TEST(test_configuration_reset_options);
+	RUN_TEST(test_configuration_sorted);
+	RUN_TEST(test_configuration_stream_chunks);
+	RUN_TEST(test_configuration_scan_delim);
 	return UNITY_END();
 }
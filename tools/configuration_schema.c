@@ -0,0 +1,275 @@
+/*
+ * Copyright 2023 Roger Feese
+ *
+ * Generate a C header from a configuration schema, for use with
+ * configuration_init_schema(). Each line of the schema file holds a key, its
+ * type (int, float or str) and its default value, which is the rest of the
+ * line. Blank lines and lines starting with # are ignored:
+ *
+ *   # name type default
+ *   times_executed int 0
+ *   volume float 0.5
+ *   user_name str guest
+ *
+ * The header declares an enum of item indexes named after the keys, the
+ * items with their default values and a minimal perfect hash of the keys.
+ *
+ * Usage: configuration_schema <name> <schema file> > <name>_schema.h
+ */
+#include <ctype.h>
+#include "../src/configuration.c"
+
+#define SCHEMA_LINE_MAX 1024
+
+typedef struct schema_entry {
+	char *key;
+	char *identifier;
+	t_conf_val_type val_type;
+	int int_default;
+	float float_default;
+	char *str_default;
+	int line;
+} t_schema_entry;
+
+static const char *type_names[] = { "int", "float", "str" };
+static const char *type_enums[] = { "CONFIGURATION_VAL_INT", "CONFIGURATION_VAL_FLOAT", "CONFIGURATION_VAL_STR" };
+
+//---------------------------------------------------------------------------
+// upper case identifier for key, with anything but letters and digits as _
+static char *make_identifier(const char *name, const char *key){
+	char *identifier = malloc(strlen(name) + strlen(key) + 2);
+	char *p = identifier;
+	for(const char *c = name; *c; c++){
+		*p++ = toupper((unsigned char)*c);
+	}
+	*p++ = '_';
+	for(const char *c = key; *c; c++){
+		*p++ = isalnum((unsigned char)*c) ? toupper((unsigned char)*c) : '_';
+	}
+	*p = '\0';
+	return identifier;
+}
+//---------------------------------------------------------------------------
+static void print_string(const char *str){
+	putchar('"');
+	for(const unsigned char *c = (const unsigned char *)str; *c; c++){
+		if(*c == '"' || *c == '\\'){
+			printf("\\%c", *c);
+		}
+		else if(isprint(*c)){
+			putchar(*c);
+		}
+		else{
+			printf("\\%03o", *c);
+		}
+	}
+	putchar('"');
+}
+//---------------------------------------------------------------------------
+static void print_float(float value){
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.9g", value);
+	printf("%s%sf", buf, strpbrk(buf, ".e") ? "" : ".0");
+}
+//---------------------------------------------------------------------------
+static int parse_entry(t_schema_entry *entry, char *line, const char *path, int line_number){
+	// key and type are the first words, default is the rest of the line
+	char *p = line;
+	char *words[2];
+	for(int w = 0; w < 2; w++){
+		while(*p == ' ' || *p == '\t'){
+			p++;
+		}
+		words[w] = p;
+		while(*p && *p != ' ' && *p != '\t'){
+			p++;
+		}
+		if(p == words[w]){
+			fprintf(stderr, "%s:%d: expected key, type and default value\n", path, line_number);
+			return 0;
+		}
+		if(*p){
+			*p++ = '\0';
+		}
+	}
+	while(*p == ' ' || *p == '\t'){
+		p++;
+	}
+	char *end = p + strlen(p);
+	while(end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')){
+		end--;
+	}
+	*end = '\0';
+
+	entry->key = strdup(words[0]);
+	entry->line = line_number;
+	entry->int_default = 0;
+	entry->float_default = 0.0f;
+	entry->str_default = NULL;
+	int type;
+	for(type = 0; type < 3 && strcmp(words[1], type_names[type]) != 0; type++);
+	if(type == 3){
+		fprintf(stderr, "%s:%d: unknown type %s, expected int, float or str\n", path, line_number, words[1]);
+		return 0;
+	}
+	entry->val_type = type;
+
+	// defaults are parsed the way the loader parses values
+	t_config_value value = 0;
+	t_conf_val_type parsed = *p ? _value_parse(p, end - p, &value) : CONFIGURATION_VAL_INT;
+	switch(entry->val_type){
+		case CONFIGURATION_VAL_INT:
+			if(parsed != CONFIGURATION_VAL_INT){
+				fprintf(stderr, "%s:%d: default of %s is not an int\n", path, line_number, entry->key);
+				return 0;
+			}
+			entry->int_default = _value_int(value);
+			break;
+		case CONFIGURATION_VAL_FLOAT:
+			if(parsed == CONFIGURATION_VAL_INT){
+				entry->float_default = _value_int(value);
+			}
+			else if(parsed == CONFIGURATION_VAL_FLOAT && isfinite(_value_float(value))){
+				entry->float_default = _value_float(value);
+			}
+			else{
+				fprintf(stderr, "%s:%d: default of %s is not a finite float\n", path, line_number, entry->key);
+				return 0;
+			}
+			break;
+		case CONFIGURATION_VAL_STR:
+			entry->str_default = strdup(p);
+			break;
+	}
+	return 1;
+}
+//---------------------------------------------------------------------------
+int main(int argc, char *argv[]){
+	if(argc != 3){
+		fprintf(stderr, "Usage: %s <name> <schema file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *name = argv[1];
+	const char *path = argv[2];
+	for(const char *c = name; *c; c++){
+		if(!isalnum((unsigned char)*c) && *c != '_'){
+			fprintf(stderr, "Name %s must only contain letters, digits and _\n", name);
+			return EXIT_FAILURE;
+		}
+	}
+	if(!isalpha((unsigned char)*name) && *name != '_'){
+		fprintf(stderr, "Name %s must start with a letter or _\n", name);
+		return EXIT_FAILURE;
+	}
+	FILE *f = fopen(path, "r");
+	if(!f){
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	t_schema_entry *entries = NULL;
+	unsigned int num_entries = 0;
+	char line[SCHEMA_LINE_MAX];
+	for(int line_number = 1; fgets(line, sizeof(line), f); line_number++){
+		size_t len = strlen(line);
+		if(len && line[len - 1] == '\n'){
+			line[--len] = '\0';
+		}
+		else if(!feof(f)){
+			fprintf(stderr, "%s:%d: line is too long\n", path, line_number);
+			return EXIT_FAILURE;
+		}
+		char *p = line;
+		while(*p == ' ' || *p == '\t' || *p == '\r'){
+			p++;
+		}
+		if(!*p || *p == '#'){
+			continue;
+		}
+		entries = realloc(entries, (num_entries + 1) * sizeof(t_schema_entry));
+		if(!entries || !parse_entry(&entries[num_entries], p, path, line_number)){
+			return EXIT_FAILURE;
+		}
+		entries[num_entries].identifier = make_identifier(name, entries[num_entries].key);
+		num_entries++;
+	}
+	fclose(f);
+	if(!num_entries){
+		fprintf(stderr, "%s: schema has no items\n", path);
+		return EXIT_FAILURE;
+	}
+
+	unsigned int *hashes = malloc(num_entries * sizeof(unsigned int));
+	for(unsigned int i = 0; i < num_entries; i++){
+		hashes[i] = _index_hash(entries[i].key);
+		for(unsigned int j = 0; j < i; j++){
+			if(strcmp(entries[i].key, entries[j].key) == 0){
+				fprintf(stderr, "%s:%d: %s already defined on line %d\n", path, entries[i].line, entries[i].key, entries[j].line);
+				return EXIT_FAILURE;
+			}
+			if(strcmp(entries[i].identifier, entries[j].identifier) == 0){
+				fprintf(stderr, "%s:%d: %s and %s both make %s\n", path, entries[i].line, entries[i].key, entries[j].key, entries[i].identifier);
+				return EXIT_FAILURE;
+			}
+			if(hashes[i] == hashes[j]){
+				fprintf(stderr, "%s:%d: %s has the same hash as %s, rename one of them\n", path, entries[i].line, entries[i].key, entries[j].key);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	unsigned int num_buckets;
+	unsigned short *displacements;
+	unsigned int *slots;
+	if(!_phash_create(hashes, num_entries, &num_buckets, &displacements, &slots)){
+		fprintf(stderr, "%s: unable to build a perfect hash of the keys\n", path);
+		return EXIT_FAILURE;
+	}
+
+	printf("/*\n * Generated by configuration_schema from %s. Do not edit.\n */\n", path);
+	char *guard = make_identifier(name, "SCHEMA_H");
+	printf("#ifndef %s\n#define %s\n\n#include \"configuration.h\"\n\n", guard, guard);
+
+	printf("enum %s_index {\n", name);
+	for(unsigned int i = 0; i < num_entries; i++){
+		printf("\t%s,\n", entries[i].identifier);
+	}
+	char *num_items = make_identifier(name, "NUM_ITEMS");
+	printf("\t%s\n};\n\n", num_items);
+
+	printf("static const t_configuration_schema_item %s_schema_items[] = {\n", name);
+	for(unsigned int i = 0; i < num_entries; i++){
+		printf("\t{ ");
+		print_string(entries[i].key);
+		printf(", %s, %d, ", type_enums[entries[i].val_type], entries[i].int_default);
+		print_float(entries[i].float_default);
+		printf(", ");
+		if(entries[i].str_default){
+			print_string(entries[i].str_default);
+		}
+		else{
+			printf("NULL");
+		}
+		printf(" },\n");
+	}
+	printf("};\n\n");
+
+	printf("static const unsigned short %s_schema_displacements[] = {", name);
+	for(unsigned int b = 0; b < num_buckets; b++){
+		printf("%s%u", b % 16 ? ", " : (b ? ",\n\t" : "\n\t"), displacements[b]);
+	}
+	printf("\n};\n\n");
+
+	printf("static const unsigned int %s_schema_slots[] = {", name);
+	for(unsigned int i = 0; i < num_entries; i++){
+		printf("%s%u", i % 16 ? ", " : (i ? ",\n\t" : "\n\t"), slots[i]);
+	}
+	printf("\n};\n\n");
+
+	printf("static const t_configuration_schema %s_schema = {\n", name);
+	printf("\t%s_schema_items, %s,\n", name, num_items);
+	printf("\t%s_schema_displacements, %u,\n", name, num_buckets);
+	printf("\t%s_schema_slots\n};\n\n", name);
+	printf("#endif //%s\n", guard);
+	return EXIT_SUCCESS;
+}